@@ -0,0 +1,41 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Timing & latency helpers shared by the benchmark tools (tcp-bench, tcp-replay)
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+
+/**
+ * Gets the time elapsed on a monotonic clock
+ *
+ * @return the current monotonic time in nanoseconds
+ */
+long long now_ns(void);
+
+/**
+ * Sleeps until a time of the monotonic clock
+ *
+ * @param ns: time to wake up at
+ */
+void sleep_until(long long ns);
+
+/**
+ * Compares two durations in nanoseconds (qsort)
+ */
+int compare_ns(const void *a, const void *b);
+
+/**
+ * Gets a percentile of the sorted durations
+ *
+ * @param sorted: durations in nanoseconds sorted with compare_ns
+ * @param count: amount of durations, greater than 0
+ * @param percentile: percentile wanted, between 0 & 100
+ *
+ * @return the duration in microseconds
+ */
+double percentile_us(const long long *sorted, size_t count, double percentile);
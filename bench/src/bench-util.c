@@ -0,0 +1,40 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Timing & latency helpers shared by the benchmark tools
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <time.h>
+
+#include "bench-util.h"
+
+/* HEADER IMPLEMENTATION */
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleep_until(long long ns) {
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+double percentile_us(const long long *sorted, size_t count, double percentile) {
+    size_t rank = percentile / 100 * count;
+    if (rank >= count) rank = count - 1;
+    return sorted[rank] / 1000.0;
+}
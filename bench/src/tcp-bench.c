@@ -0,0 +1,396 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Loopback benchmark of the lib primitives (send_data, expect_data, receive_data)
+ *
+ * Two tests are run for every message size, socket buffer size & concurrency level:
+ *      pingpong: each client sends a message & waits for its echo (send_data,
+ *                expect_data on both sides), the round-trip times give p50/p99/p999
+ *      stream:   each client sends messages for the whole duration (send_data),
+ *                the server counts what it receives (receive_data) for the throughput
+ *
+ * The results are printed as JSON (one result per line) to be diffed between versions
+ *
+ * usage: tcp-bench [-d duration_ms] [-m sizes] [-b buffer_sizes] [-c concurrency_levels]
+ *      the lists are separated by commas, a buffer size of 0 keeps the kernel defaults
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench-util.h"
+#include "tcp-util.h"
+
+#define BACKLOG         128     // pending connections (at least the concurrency)
+#define MAX_LIST        16      // values per swept parameter
+#define MAX_CONCURRENCY 256     // clients at once
+#define ACCEPT_TIMEOUT  5000    // ms the server waits for the clients to connect
+
+#define TEST_PINGPONG   0
+#define TEST_STREAM     1
+
+static const char *test_names[] = { "pingpong", "stream" };
+
+/** Parameters of a run */
+struct bench_run {
+    int test;                   // TEST_PINGPONG or TEST_STREAM
+    int msg_size;               // bytes per message
+    int buf_size;               // SO_SNDBUF & SO_RCVBUF on both sides, 0 for the defaults
+    int concurrency;            // clients at once
+    int duration_ms;            // time each client runs
+    char host[INET6_ADDRSTRLEN];// loopback address of the server
+    char port[8];               // port of the server
+    struct tcp_options opts;    // options of both sides
+
+    pthread_mutex_t gate;       // held until the barrier knows how many clients started
+    pthread_barrier_t start;    // releases the clients together once all are connected
+    long long start_ns;         // time the clients were released
+};
+
+/** Client thread */
+struct bench_client {
+    struct bench_run *run;
+    pthread_t thread;
+    long long *rtt_ns;          // round-trip times measured (pingpong)
+    size_t rtt_count;
+    size_t rtt_cap;
+    int error;                  // errno of the failure, 0 if the client succeeded
+};
+
+/** Server connection thread */
+struct bench_worker {
+    struct bench_run *run;
+    pthread_t thread;
+    int fd;                     // connection accepted
+    unsigned long long bytes;   // bytes received
+};
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Parses a list of positive numbers separated by commas
+ *
+ * @param arg: list to parse
+ * @param out_values: returned values
+ *
+ * @return the amount of values, -1 if the list is invalid
+ */
+static int parse_list(char *arg, int *out_values) {
+    char *token, *end;
+    int count = 0;
+
+    for (token = strtok(arg, ","); token; token = strtok(NULL, ",")) {
+        if (count == MAX_LIST) return -1;
+        out_values[count] = strtol(token, &end, 10);
+        if (*end || out_values[count] < 0) return -1;
+        count++;
+    }
+
+    return count ? count : -1;
+}
+
+/**
+ * Gets the address the clients connect to: ephemeral port of the listening socket,
+ * on the loopback address of the family listened on
+ *
+ * @param listen_fd: listening socket of the server
+ * @param run: parameters of the run, whose host & port are set
+ *
+ * @return 0 if the address is known, -1 if an error occured (errno is set)
+ */
+static int server_address(int listen_fd, struct bench_run *run) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+
+    if (getsockname(listen_fd, (struct sockaddr *) &addr, &len)) {
+        return -1;
+    }
+    if (addr.ss_family == AF_INET6) {
+        strcpy(run->host, "::1");
+        sprintf(run->port, "%d", ntohs(((struct sockaddr_in6 *) &addr)->sin6_port));
+    } else {
+        strcpy(run->host, "127.0.0.1");
+        sprintf(run->port, "%d", ntohs(((struct sockaddr_in *) &addr)->sin_port));
+    }
+    return 0;
+}
+
+/**
+ * Server connection: echoes the messages (pingpong) or counts them (stream)
+ * until the client closes the connection
+ */
+static void *worker_main(void *arg) {
+    struct bench_worker *worker = arg;
+    char *buffer = malloc(worker->run->msg_size);
+    ssize_t bytes;
+
+    if (buffer == NULL) {
+        disconnect(worker->fd);
+        return NULL;
+    }
+
+    if (worker->run->test == TEST_PINGPONG) {
+        while (expect_data(worker->fd, buffer, worker->run->msg_size) == 0
+                && send_data(worker->fd, buffer, worker->run->msg_size) == 0);
+    } else {
+        while ((bytes = receive_data(worker->fd, buffer, worker->run->msg_size)) > 0) {
+            worker->bytes += bytes;
+        }
+    }
+
+    free(buffer);
+    disconnect(worker->fd);
+    return NULL;
+}
+
+/**
+ * Keeps a round-trip time
+ *
+ * @return 0 if it has been kept, -1 if the memory is exhausted
+ */
+static int record_rtt(struct bench_client *client, long long ns) {
+    long long *grown;
+
+    if (client->rtt_count == client->rtt_cap) {
+        client->rtt_cap = client->rtt_cap ? 2 * client->rtt_cap : 4096;
+        grown = realloc(client->rtt_ns, client->rtt_cap * sizeof(long long));
+        if (grown == NULL) return -1;
+        client->rtt_ns = grown;
+    }
+
+    client->rtt_ns[client->rtt_count++] = ns;
+    return 0;
+}
+
+/**
+ * Client: connects, waits for the others & runs the test for the duration
+ */
+static void *client_main(void *arg) {
+    struct bench_client *client = arg;
+    struct bench_run *run = client->run;
+    char *buffer = calloc(1, run->msg_size);
+    long long end, sent;
+    int sockfd;
+
+    sockfd = client_connect_opts(run->host, run->port, &run->opts);
+
+    // every client waits at the barrier, even the failed ones
+    pthread_mutex_lock(&run->gate);
+    pthread_mutex_unlock(&run->gate);
+    if (pthread_barrier_wait(&run->start) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        run->start_ns = now_ns();
+    }
+    if (sockfd < 0 || buffer == NULL) {
+        client->error = errno ? errno : ENOMEM;
+        if (sockfd >= 0) disconnect(sockfd);
+        free(buffer);
+        return NULL;
+    }
+
+    end = now_ns() + run->duration_ms * 1000000LL;
+    while ((sent = now_ns()) < end) {
+        if (send_data(sockfd, buffer, run->msg_size)) {
+            client->error = errno;
+            break;
+        }
+        if (run->test == TEST_PINGPONG) {
+            if (expect_data(sockfd, buffer, run->msg_size)
+                    || record_rtt(client, now_ns() - sent)) {
+                client->error = errno;
+                break;
+            }
+        }
+    }
+
+    free(buffer);
+    disconnect(sockfd);
+    return NULL;
+}
+
+/**
+ * Runs a test & prints its result
+ *
+ * @param run: parameters of the run
+ * @param listen_fd: listening socket of the server
+ * @param first: 1 if it is the first result printed
+ *
+ * @return 0 if the run succeeded, -1 otherwise (the error is printed)
+ */
+static int bench(struct bench_run *run, int listen_fd, int first) {
+    struct bench_client clients[MAX_CONCURRENCY];
+    struct bench_worker workers[MAX_CONCURRENCY];
+    unsigned long long bytes = 0;
+    long long *rtt_ns = NULL;
+    size_t rtt_count = 0;
+    double elapsed_s;
+    long long deadline;
+    int i, started, accepted, rv, error = 0;
+
+    memset(clients, 0, sizeof clients);
+    memset(workers, 0, sizeof workers);
+
+    // the clients connect in their threads & wait at the gate until the barrier is set
+    // for the ones which could be started
+    pthread_mutex_init(&run->gate, NULL);
+    pthread_mutex_lock(&run->gate);
+    for (started = 0; started < run->concurrency; started++) {
+        clients[started].run = run;
+        error = pthread_create(&clients[started].thread, NULL, client_main, &clients[started]);
+        if (error) break;
+    }
+    pthread_barrier_init(&run->start, NULL, started ? started : 1);
+    pthread_mutex_unlock(&run->gate);
+
+    // the server accepts them here, a client which could not connect never comes
+    deadline = tcp_deadline(ACCEPT_TIMEOUT);
+    for (accepted = 0; accepted < started; accepted++) {
+        workers[accepted].run = run;
+        if ((rv = wait_io(listen_fd, POLLIN, deadline))
+                || (workers[accepted].fd = accept(listen_fd, NULL, NULL)) < 0) {
+            if (!error) error = errno;
+            break;
+        }
+        if ((rv = pthread_create(&workers[accepted].thread, NULL, worker_main,
+                                 &workers[accepted]))) {
+            disconnect(workers[accepted].fd);
+            if (!error) error = rv;
+            break;
+        }
+    }
+
+    // clients left without a worker: the connections queued are reset & the next ones
+    // refused, the clients return instead of waiting for an echo
+    if (accepted < started) {
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+
+    // gather the results
+    for (i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+        if (clients[i].error && !error) error = clients[i].error;
+        rtt_count += clients[i].rtt_count;
+    }
+    for (i = 0; i < accepted; i++) {
+        pthread_join(workers[i].thread, NULL);
+        bytes += workers[i].bytes;
+    }
+    elapsed_s = (now_ns() - run->start_ns) / 1e9;
+    pthread_barrier_destroy(&run->start);
+    pthread_mutex_destroy(&run->gate);
+
+    // listening again for the next runs (the ephemeral port was released)
+    if (accepted < started && (listen(listen_fd, BACKLOG) || server_address(listen_fd, run))
+            && !error) {
+        error = errno;
+    }
+
+    if (rtt_count && (rtt_ns = malloc(rtt_count * sizeof(long long)))) {
+        rtt_count = 0;
+        for (i = 0; i < started; i++) {
+            memcpy(rtt_ns + rtt_count, clients[i].rtt_ns, clients[i].rtt_count * sizeof(long long));
+            rtt_count += clients[i].rtt_count;
+        }
+        qsort(rtt_ns, rtt_count, sizeof(long long), compare_ns);
+    }
+    for (i = 0; i < started; i++) free(clients[i].rtt_ns);
+
+    if (error || accepted < run->concurrency) {
+        fprintf(stderr, "[bench] %s msg_size=%d buf_size=%d concurrency=%d: %s\n",
+                test_names[run->test], run->msg_size, run->buf_size, run->concurrency,
+                strerror(error ? error : EPROTO));
+        free(rtt_ns);
+        return -1;
+    }
+
+    printf("%s    {\"test\": \"%s\", \"msg_size\": %d, \"buf_size\": %d, \"concurrency\": %d",
+            first ? "" : ",\n", test_names[run->test], run->msg_size, run->buf_size,
+            run->concurrency);
+    if (run->test == TEST_PINGPONG && rtt_count) {
+        printf(", \"round_trips\": %zu, \"round_trips_per_s\": %.0f, \"rtt_us\": "
+               "{\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+                rtt_count, rtt_count / elapsed_s,
+                percentile_us(rtt_ns, rtt_count, 50), percentile_us(rtt_ns, rtt_count, 99),
+                percentile_us(rtt_ns, rtt_count, 99.9), rtt_ns[rtt_count - 1] / 1000.0);
+    } else {
+        printf(", \"bytes\": %llu, \"mb_per_s\": %.1f}", bytes, bytes / elapsed_s / 1e6);
+    }
+    fflush(stdout);
+
+    free(rtt_ns);
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    int sizes[MAX_LIST] = { 64, 1024, 16384, 65536 };
+    int bufs[MAX_LIST] = { 0, 65536, 1048576 };
+    int levels[MAX_LIST] = { 1, 4, 16 };
+    int sizes_count = 4, bufs_count = 3, levels_count = 3;
+    int duration_ms = 200;
+    struct bench_run run;
+    int listen_fd, opt, m, b, c, test, failed = 0, first = 1;
+
+    while ((opt = getopt(argc, argv, "d:m:b:c:")) != -1) {
+        switch (opt) {
+            case 'd': duration_ms = atoi(optarg); break;
+            case 'm': sizes_count = parse_list(optarg, sizes); break;
+            case 'b': bufs_count = parse_list(optarg, bufs); break;
+            case 'c': levels_count = parse_list(optarg, levels); break;
+            default: sizes_count = -1; break;
+        }
+    }
+    for (c = 0; c < levels_count; c++) {
+        if (levels[c] < 1 || levels[c] > MAX_CONCURRENCY) levels_count = -1;
+    }
+    for (m = 0; m < sizes_count; m++) {
+        if (sizes[m] < 1) sizes_count = -1;
+    }
+    if (duration_ms <= 0 || sizes_count < 0 || bufs_count < 0 || levels_count < 0) {
+        fprintf(stderr, "usage: %s [-d duration_ms] [-m sizes] [-b buffer_sizes] "
+                "[-c concurrency_levels]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n  \"benchmark\": \"tcp-bench\",\n  \"duration_ms\": %d,\n  \"results\": [\n",
+            duration_ms);
+
+    for (b = 0; b < bufs_count; b++) {
+        memset(&run, 0, sizeof run);
+        run.duration_ms = duration_ms;
+        run.buf_size = bufs[b];
+        run.opts.nodelay = 1;
+        run.opts.sndbuf = run.opts.rcvbuf = bufs[b];
+
+        listen_fd = server_listen_opts("0", BACKLOG, &run.opts);
+        if (listen_fd < 0 || server_address(listen_fd, &run)) {
+            perror("[bench] listening");
+            return EXIT_FAILURE;
+        }
+
+        for (m = 0; m < sizes_count; m++) {
+            for (c = 0; c < levels_count; c++) {
+                for (test = TEST_PINGPONG; test <= TEST_STREAM; test++) {
+                    run.test = test;
+                    run.msg_size = sizes[m];
+                    run.concurrency = levels[c];
+                    if (bench(&run, listen_fd, first)) failed++;
+                    else first = 0;
+                }
+            }
+        }
+
+        disconnect(listen_fd);
+    }
+
+    printf("\n  ]\n}\n");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,372 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Replay of recorded client sessions (see tcp-record.h) against a server,
+ * to benchmark it under a realistic load
+ *
+ * Each connection of the recording becomes a session: its sends are replayed at their
+ * recorded time (divided by the speed), each batch of data received is awaited in full
+ * before going on. Every session is replayed by as many concurrent copies as asked,
+ * the sessions start at their recorded offset from the beginning of the recording
+ *
+ * The server throughput & the latency of its responses (last send to the last byte of
+ * the response) are printed as JSON, as tcp-bench
+ *
+ * usage: tcp-replay [-s speed] [-c copies] [-t timeout_ms] recording host port
+ *      speed 1 replays in real time, 0 as fast as possible
+ *
+ * Record the sessions of a client with: TCP_RECORD=sessions.rec ./client ...
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench-util.h"
+#include "tcp-record.h"
+#include "tcp-util.h"
+
+#define MAX_COPIES      1024    // concurrent copies of each session
+#define SCRATCH_SIZE    (64 * 1024)     // buffer receiving the responses
+#define THREAD_STACK    (256 * 1024)    // stack of a replaying thread
+
+/** Step of a session: data to send, or amount of data to receive */
+struct step {
+    enum tcp_record_type type;  // TCP_RECORD_SEND or TCP_RECORD_RECV
+    long long offset_us;        // recorded time from the first data of the session
+    const char *data;           // data to send
+    size_t length;              // bytes to send or to receive
+};
+
+/** Connection of the recording */
+struct session {
+    unsigned int pid;           // process & socket which recorded it
+    int sockfd;
+    int open;                   // 0 once its close has been recorded
+    long long start_us;         // time of its first record
+    struct step *steps;
+    size_t count;
+    size_t cap;
+};
+
+/** Replay parameters shared by the threads */
+struct replay {
+    char *host;
+    char *port;
+    double speed;               // 0: as fast as possible
+    int timeout_ms;             // time allowed to receive a response
+    long long first_us;         // time of the first record
+    long long start_ns;         // time the replay started
+};
+
+/** Copy of a session replayed by a thread */
+struct player {
+    struct replay *replay;
+    struct session *session;
+    pthread_t thread;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    long long *latency_ns;      // latency of each response
+    size_t latency_count;
+    size_t latency_cap;
+    int error;                  // errno of the failure, 0 if the session succeeded
+};
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Splits the recording into sessions: the records of a (process, socket) until its close
+ * The data received in a row is merged in a single step
+ *
+ * @param recording: recording loaded
+ * @param out_count: returned amount of sessions
+ *
+ * @return the sessions (to free), NULL if an error occured
+ */
+static struct session *split_sessions(struct tcp_recording *recording, size_t *out_count) {
+    struct session *sessions = NULL, *s, *grown;
+    struct tcp_record *r;
+    struct step *steps;
+    size_t count = 0, cap = 0, i, j;
+
+    for (i = 0; i < recording->count; i++) {
+        r = &recording->records[i];
+
+        // connection still open in that process
+        for (j = count, s = NULL; j > 0; j--) {
+            if (sessions[j - 1].open && sessions[j - 1].pid == r->pid
+                    && sessions[j - 1].sockfd == r->sockfd) {
+                s = &sessions[j - 1];
+                break;
+            }
+        }
+
+        if (r->type == TCP_RECORD_CLOSE) {
+            if (s) s->open = 0;
+            continue;
+        }
+
+        // new connection
+        if (s == NULL) {
+            if (count == cap) {
+                cap = cap ? 2 * cap : 64;
+                if ((grown = realloc(sessions, cap * sizeof(struct session))) == NULL) break;
+                sessions = grown;
+            }
+            s = &sessions[count++];
+            memset(s, 0, sizeof *s);
+            s->pid = r->pid;
+            s->sockfd = r->sockfd;
+            s->open = 1;
+            s->start_us = r->time_us;
+        }
+
+        if (r->type == TCP_RECORD_RECV && s->count && s->steps[s->count - 1].type == r->type) {
+            s->steps[s->count - 1].length += r->length;
+            continue;
+        }
+
+        if (s->count == s->cap) {
+            s->cap = s->cap ? 2 * s->cap : 16;
+            if ((steps = realloc(s->steps, s->cap * sizeof(struct step))) == NULL) break;
+            s->steps = steps;
+        }
+        s->steps[s->count].type = r->type;
+        s->steps[s->count].offset_us = r->time_us - s->start_us;
+        s->steps[s->count].data = r->data;
+        s->steps[s->count].length = r->length;
+        s->count++;
+    }
+
+    // out of memory
+    if (i < recording->count) {
+        for (j = 0; j < count; j++) free(sessions[j].steps);
+        free(sessions);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *out_count = count;
+    return sessions;
+}
+
+/**
+ * Keeps the latency of a response
+ *
+ * @return 0 if it has been kept, -1 if the memory is exhausted
+ */
+static int record_latency(struct player *player, long long ns) {
+    long long *grown;
+
+    if (player->latency_count == player->latency_cap) {
+        player->latency_cap = player->latency_cap ? 2 * player->latency_cap : 64;
+        grown = realloc(player->latency_ns, player->latency_cap * sizeof(long long));
+        if (grown == NULL) return -1;
+        player->latency_ns = grown;
+    }
+
+    player->latency_ns[player->latency_count++] = ns;
+    return 0;
+}
+
+/**
+ * Replays a session: connects at its offset, sends & awaits the data as recorded
+ */
+static void *player_main(void *arg) {
+    struct player *player = arg;
+    struct replay *replay = player->replay;
+    struct session *session = player->session;
+    struct step *step;
+    char *scratch = malloc(SCRATCH_SIZE);
+    long long start, last_send;
+    size_t i, remaining, len;
+    int sockfd, rv;
+
+    if (scratch == NULL) {
+        player->error = ENOMEM;
+        return NULL;
+    }
+
+    // sessions start at their recorded offset
+    if (replay->speed > 0) {
+        sleep_until(replay->start_ns
+                    + (session->start_us - replay->first_us) * 1000 / replay->speed);
+    }
+
+    sockfd = client_connect(replay->host, replay->port);
+    if (sockfd < 0) {
+        player->error = errno;
+        free(scratch);
+        return NULL;
+    }
+    start = last_send = now_ns();
+
+    for (i = 0; i < session->count && !player->error; i++) {
+        step = &session->steps[i];
+
+        if (step->type == TCP_RECORD_SEND) {
+            if (replay->speed > 0) {
+                sleep_until(start + step->offset_us * 1000 / replay->speed);
+            }
+            if (send_data(sockfd, (char *) step->data, step->length)) {
+                player->error = errno;
+                break;
+            }
+            player->bytes_sent += step->length;
+            last_send = now_ns();
+            continue;
+        }
+
+        // the whole response, within the timeout
+        for (remaining = step->length; remaining; remaining -= len) {
+            len = remaining < SCRATCH_SIZE ? remaining : SCRATCH_SIZE;
+            rv = expect_data_deadline(sockfd, scratch, len, tcp_deadline(replay->timeout_ms));
+            if (rv) {
+                player->error = rv == ERR_TCP_PEER_CLOSED ? ECONNRESET : errno;
+                break;
+            }
+        }
+        if (!player->error) {
+            player->bytes_received += step->length;
+            if (record_latency(player, now_ns() - last_send)) player->error = ENOMEM;
+        }
+    }
+
+    disconnect(sockfd);
+    free(scratch);
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+    struct tcp_recording recording;     // records loaded
+    struct session *sessions;           // connections of the recording
+    struct player *players;             // copies of the sessions replayed
+    struct replay replay;
+    pthread_attr_t attr;
+    size_t sessions_count, players_count, i, latency_count = 0;
+    unsigned long long bytes_sent = 0, bytes_received = 0;
+    long long *latency_ns = NULL;
+    double elapsed_s;
+    int copies = 1, failed = 0, first_error = 0, opt;
+
+    memset(&replay, 0, sizeof replay);
+    replay.speed = 1;
+    replay.timeout_ms = 10000;
+
+    while ((opt = getopt(argc, argv, "s:c:t:")) != -1) {
+        switch (opt) {
+            case 's': replay.speed = atof(optarg); break;
+            case 'c': copies = atoi(optarg); break;
+            case 't': replay.timeout_ms = atoi(optarg); break;
+            default: copies = -1; break;
+        }
+    }
+    if (argc - optind != 3 || copies < 1 || copies > MAX_COPIES || replay.speed < 0
+            || replay.timeout_ms <= 0) {
+        fprintf(stderr, "usage: %s [-s speed] [-c copies] [-t timeout_ms] recording host port\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    replay.host = argv[optind + 1];
+    replay.port = argv[optind + 2];
+
+    if (tcp_record_load(argv[optind], &recording)) {
+        perror("[replay] loading the recording");
+        return EXIT_FAILURE;
+    }
+    if ((sessions = split_sessions(&recording, &sessions_count)) == NULL) {
+        perror("[replay] splitting the sessions");
+        tcp_record_free(&recording);
+        return EXIT_FAILURE;
+    }
+    if (sessions_count == 0) {
+        fprintf(stderr, "[replay] no session recorded\n");
+        free(sessions);
+        tcp_record_free(&recording);
+        return EXIT_FAILURE;
+    }
+
+    players_count = sessions_count * copies;
+    players = calloc(players_count, sizeof(struct player));
+    if (players == NULL) {
+        perror("[replay] allocating the sessions");
+        for (i = 0; i < sessions_count; i++) free(sessions[i].steps);
+        free(sessions);
+        tcp_record_free(&recording);
+        return EXIT_FAILURE;
+    }
+
+    // a thread per copy of each session, with a small stack
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    replay.first_us = sessions[0].start_us;
+    replay.start_ns = now_ns();
+    for (i = 0; i < players_count; i++) {
+        players[i].replay = &replay;
+        players[i].session = &sessions[i % sessions_count];
+        if (pthread_create(&players[i].thread, &attr, player_main, &players[i])) {
+            players_count = i;
+            perror("[replay] starting the sessions");
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    for (i = 0; i < players_count; i++) {
+        pthread_join(players[i].thread, NULL);
+        bytes_sent += players[i].bytes_sent;
+        bytes_received += players[i].bytes_received;
+        latency_count += players[i].latency_count;
+        if (players[i].error) {
+            if (!failed) first_error = players[i].error;
+            failed++;
+        }
+    }
+    elapsed_s = (now_ns() - replay.start_ns) / 1e9;
+
+    if (latency_count && (latency_ns = malloc(latency_count * sizeof(long long)))) {
+        latency_count = 0;
+        for (i = 0; i < players_count; i++) {
+            memcpy(latency_ns + latency_count, players[i].latency_ns,
+                    players[i].latency_count * sizeof(long long));
+            latency_count += players[i].latency_count;
+        }
+        qsort(latency_ns, latency_count, sizeof(long long), compare_ns);
+    }
+
+    if (failed) {
+        fprintf(stderr, "[replay] %d sessions failed, first: %s\n", failed, strerror(first_error));
+    }
+
+    printf("{\n  \"replay\": \"%s\",\n  \"target\": \"%s:%s\",\n  \"speed\": %g,\n"
+           "  \"copies\": %d,\n  \"sessions\": %zu,\n  \"failed\": %d,\n"
+           "  \"responses\": %zu,\n  \"bytes_sent\": %llu,\n  \"bytes_received\": %llu,\n"
+           "  \"duration_s\": %.3f,\n  \"mb_per_s\": %.1f,\n  \"responses_per_s\": %.0f",
+            argv[optind], replay.host, replay.port, replay.speed, copies, players_count, failed,
+            latency_count, bytes_sent, bytes_received, elapsed_s,
+            (bytes_sent + bytes_received) / elapsed_s / 1e6, latency_count / elapsed_s);
+    if (latency_ns) {
+        printf(",\n  \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+                percentile_us(latency_ns, latency_count, 50),
+                percentile_us(latency_ns, latency_count, 99),
+                percentile_us(latency_ns, latency_count, 99.9),
+                latency_ns[latency_count - 1] / 1000.0);
+    }
+    printf("\n}\n");
+
+    for (i = 0; i < players_count; i++) free(players[i].latency_ns);
+    for (i = 0; i < sessions_count; i++) free(sessions[i].steps);
+    free(latency_ns);
+    free(players);
+    free(sessions);
+    tcp_record_free(&recording);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -12,6 +12,16 @@
 #define ID_BYTE         'a'             // identification byte
 
 #define BUF_SIZE        1024            // char buffer size
+#define NAME_MAX_LEN    255             // file name length accepted in a list
+#define SESSION_TIMEOUT 60000           // ms a client is served before being dropped
+#define FASTOPEN_QLEN   16              // connections accepted with data in their SYN
+#define DEFER_ACCEPT    5               // s a connection waits for the id byte before being accepted
+#define ACCEPT_BATCH    16              // connections accepted per call
+#define ACCEPT_BACKOFF  100             // ms waited after a failed accept
+#define HANDOFF_ADDRESS "unix:/tmp/ex-files.handoff"   // where a new instance asks for the socket
+#define HANDOFF_TIMEOUT 5000            // ms allowed to hand the listening socket over
+#define AUTOTUNE        1               // 1 to size the socket buffers & the chunks of the
+                                        // file transfers from the measured BDP
 
 #define DIR_FILE        "./files"       // directory containing the downloadable files
 #define DIR_DL          "./download"    // directory containing the downloaded files
@@ -10,6 +10,9 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
+
+struct tcp_stream;
 
 /** List of downloadable files information */
 struct dl_file {
@@ -60,30 +63,35 @@ void free_list(struct dl_file *files);
  * Sends a serialized list of files information:
  * first packet contains the count of elements in the list
  * then each file information is sent in a packet prefixed by the data size
+ * (the stream is flushed)
  *
- * @param sockfd: tcp connection socket file descriptor
+ * @param stream: buffered tcp connection stream
  * @param files: list of files information
  * @param size: count of elements contained in the list
  *
  * @return the amount of bytes sent or -1 if an error occured (errno is set)
  */
-ssize_t send_list(int sockfd, struct dl_file *files, uint16_t size);
+ssize_t send_list(struct tcp_stream *stream, struct dl_file *files, uint16_t size);
 
 /**
  * Receives a linked list of files information
+ * The names are checked: at most NAME_MAX_LEN bytes, no '/', neither "." nor ".."
  *
- * @param sockfd: tcp connection socket file descriptor
+ * @param stream: buffered tcp connection stream
  * @param out_file: returned list containing the data received
  * @param out_size: returned list size (count of elements contained in the list)
  *
- * @return number of bytes received or -1 if an error occured (errno is set)
+ * @return number of bytes received or -1 if an error occured
+ *      (EMSGSIZE if a name is too long, EPROTO if it is invalid), errno is set
  */
-ssize_t receive_list(int sockfd, struct dl_file **out_file, uint16_t *out_size);
+ssize_t receive_list(struct tcp_stream *stream, struct dl_file **out_file, uint16_t *out_size);
 
 /**
- * Sends a file prefixed by its size
+ * Sends a file prefixed by its size on disk (the size of the file info is ignored)
+ * (the stream is flushed before the file is sent by the kernel,
+ * within the stream deadline if any, yielding to the other coroutines if run in one)
  *
- * @param sockfd: destination socket file descriptor
+ * @param stream: destination buffered tcp connection stream
  * @param file: file to send
  * @param dirname: name of the directory where the file is located
  *
@@ -92,12 +100,12 @@ ssize_t receive_list(int sockfd, struct dl_file **out_file, uint16_t *out_size);
  *      -1 if an error occured
  *      errno is set
  */
-int send_file(int sockfd, struct dl_file *file, char *dirname);
+int send_file(struct tcp_stream *stream, struct dl_file *file, char *dirname);
 
 /**
  * Receives a file prefixed by its size
  *
- * @param sockfd: socket file descriptor
+ * @param stream: buffered tcp connection stream
  * @param file: file to receive
  * @param dirname: download directory
  *
@@ -106,7 +114,7 @@ int send_file(int sockfd, struct dl_file *file, char *dirname);
  *      -1 if an error occured
  *      errno is set
  */
-int receive_file(int sockfd, struct dl_file *file, char* dirname);
+int receive_file(struct tcp_stream *stream, struct dl_file *file, char* dirname);
 
 /**
  * Gets the index of the file chosen by the user
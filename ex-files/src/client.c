@@ -19,15 +19,22 @@
 #include "const.h"
 #include "file.h"
 #include "tcp-util.h"
+#include "tcp-stream.h"
 
 int main(int argc, char *argv[]) {
     char hostname[BUF_SIZE];             // server name or ip address (dot separated)
     int sockfd;                     // socket file descriptor
+    struct tcp_stream *stream;      // buffered stream over the connection
+    struct tcp_options opts = {     // id byte & list sent at once,
+        .nodelay = 1,               // the id byte carried by the SYN (Fast Open: the handshake
+        .fastopen = 1               // waits for it, the addresses are not raced)
+    };
     struct dl_file *files = NULL;   // list of files received from the server
     uint16_t files_size;            // size of the list received from the server
     struct dl_file *file = NULL;    // file chosen by the user
     uint16_t chosen_file;           // number corresponding to the file chosen by the user (index in the list)
     char id_byte = ID_BYTE;         // protocol identification byte
+    int fastopen;                   // 1 if the id byte was carried by the SYN
 
     // test the args
     if (argc != 2) {
@@ -39,7 +46,7 @@ int main(int argc, char *argv[]) {
     strncpy(hostname, argv[1], BUF_SIZE);
 
     // connect to the server
-    sockfd = client_connect(hostname, PORT);
+    sockfd = client_connect_opts(hostname, PORT, &opts);
     if (sockfd < 0) {
         if (sockfd == ERR_TCP_CREATE_SOCK) {
             fprintf(stderr, "[client] creating the socket: %s\n", gai_strerror(errno));
@@ -49,18 +56,30 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    stream = tcp_stream_open(sockfd, 0);
+    if (stream == NULL) {
+        perror("[client] creating the stream");
+        return EXIT_FAILURE;
+    }
+
     // send identification byte
-    if (send_data(sockfd, &id_byte, 1)) {
+    if (tcp_stream_write(stream, &id_byte, 1) || tcp_stream_flush(stream)) {
         perror("[client] sending the identification byte");
         return EXIT_FAILURE;
     }
 
     // receive the list of downloadable files
-    if (receive_list(sockfd, &files, &files_size) < 0) {
+    if (receive_list(stream, &files, &files_size) < 0) {
         perror("[client] receiving the list\n");
         return EXIT_FAILURE;
     }
 
+    // the server cookie is known from the second connection on
+    if ((fastopen = tcp_fastopen_used(sockfd)) >= 0) {
+        printf("[client] handshake: %s\n", fastopen
+                    ? "id byte sent in the SYN (TCP Fast Open)" : "regular");
+    }
+
     // print the list
     puts("\nList of files available for download:");
     print_list(files, files_size);
@@ -79,7 +98,7 @@ int main(int argc, char *argv[]) {
     }
 
     // send it to the server
-    if (send_list(sockfd, file, 1) < 0) {
+    if (send_list(stream, file, 1) < 0) {
         perror("[client] sending the chosen file\n");
         free_list(file);
         return EXIT_FAILURE;
@@ -87,7 +106,7 @@ int main(int argc, char *argv[]) {
 
     // receive the file
     printf("\nDownloading %s...\n", file->name);
-    if (receive_file(sockfd, file, DIR_DL)) {
+    if (receive_file(stream, file, DIR_DL)) {
         perror("[client] receiving file");
         free_list(file);
         return EXIT_FAILURE;
@@ -96,6 +115,7 @@ int main(int argc, char *argv[]) {
     free_list(file);
 
     // close the connection
+    tcp_stream_free(stream);
     disconnect(sockfd);
 
     return EXIT_SUCCESS;
@@ -8,18 +8,24 @@
  ****************************************************************************************/
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "const.h"
 #include "file.h"
 #include "serial-util.h"
-#include "tcp-util.h"
+#include "tcp-bufpool.h"
+#include "tcp-coro.h"
+#include "tcp-frame.h"
+#include "tcp-stream.h"
+#include "tcp-tune.h"
 
 
 /* PRIVATE FUNCTIONS */
@@ -33,6 +39,36 @@ void clean_stdin(void) {
     while (c != '\n' && c != EOF);
 }
 
+/**
+ * Builds the path of a file in a directory
+ *
+ * @param out_path: returned path (BUF_SIZE bytes)
+ * @param dirname: directory
+ * @param filename: file name
+ *
+ * @return 0 if the path fits, -1 otherwise (errno is set to ENAMETOOLONG)
+ */
+int file_path(char *out_path, char *dirname, char *filename) {
+    int len = snprintf(out_path, BUF_SIZE, "%s/%s", dirname, filename);
+
+    if (len < 0 || len >= BUF_SIZE) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks a file name received: a name in the directory, not a path
+ *
+ * @param name: file name
+ *
+ * @return 1 if the name is valid, 0 otherwise
+ */
+int valid_name(char *name) {
+    return *name && strchr(name, '/') == NULL && strcmp(name, ".") && strcmp(name, "..");
+}
+
 /**
  * Gets the size of the file
  *
@@ -46,7 +82,9 @@ uint64_t get_file_size(char *filename, char* path) {
     char filepath[BUF_SIZE];    // file path
     long size;                  // file size
 
-    sprintf(filepath, "%s/%s", path, filename);
+    if (file_path(filepath, path, filename)) {
+        return 0;
+    }
 
     fp = fopen(filepath, "r");
     if (fp == NULL) {
@@ -149,141 +187,218 @@ void free_list(struct dl_file *files) {
     }
 }
 
-ssize_t send_list(int sockfd, struct dl_file *files, uint16_t size) {
-    char buf_mem[TCP_BUF_SIZE]; // buffer used to send data
-    char *start, *buffer;       // pointers used to access the buffer
-    uint32_t data_size;         // size of the packet sent
+ssize_t send_list(struct tcp_stream *stream, struct dl_file *files, uint16_t size) {
+    char head[sizeof(uint64_t)];    // name length
+    char tail[sizeof(uint64_t)];    // file size following the name
+    struct iovec iov[3];        // frame gathered from the name length, the name & the size
+    uint64_t name_len;          // length of the file name
     ssize_t bytes_sent = 0;     // total amount of data sent
 
-    start = buffer = buf_mem;
-
     // send a packet containing the number of elements that will be sent
-    buffer = write_u16(size, buffer);
-    if (send_data(sockfd, start, buffer - start)) {
+    write_u16(size, head);
+    if (tcp_stream_write(stream, head, sizeof(uint16_t))) {
         return -1;
     }
 
-    // send packet containing the file info prefixed by its size
+    // send a frame per file info (the frame header is added by send_frame)
     while (files) {
-        // fill the packet with the files data
-        // reserve space for the header
-        buffer = write_str(files->name, start + sizeof(uint32_t));
-        buffer = write_u64(files->size, buffer);
-
-        // fill the packet header with the data size
-        data_size = buffer - start - sizeof(uint32_t);
-        write_u32(data_size, start);
-
-        // send the packet & stop sending if an error occured
-        if (send_data(sockfd, start, buffer - start)) {
+        // name prefixed by its length (the name itself is sent from the list), then size
+        name_len = strlen(files->name);
+        write_u64(name_len, head);
+        write_u64(files->size, tail);
+
+        // send the frame & stop sending if an error occured
+        iov[0].iov_base = head;
+        iov[0].iov_len = sizeof head;
+        iov[1].iov_base = files->name;
+        iov[1].iov_len = name_len;
+        iov[2].iov_base = tail;
+        iov[2].iov_len = sizeof tail;
+        if (send_frame(stream, iov, 3)) {
             return -1;
         }
 
-        bytes_sent += data_size;
+        bytes_sent += sizeof head + name_len + sizeof tail;
         files = files->next;
     }
 
+    // send the frames still combined in the stream buffer
+    if (tcp_stream_flush(stream)) {
+        return -1;
+    }
+
     return bytes_sent;
 }
 
-ssize_t receive_list(int sockfd, struct dl_file **out_files, uint16_t *out_size) {
+ssize_t receive_list(struct tcp_stream *stream, struct dl_file **out_files, uint16_t *out_size) {
     struct dl_file *file = NULL;        // file info
     struct dl_file *prev_file = NULL;   // previous file info kept to link the list
-    uint32_t data_size;                 // size of packet expected
+    struct tcp_frame_buf frame = { 0 }; // receive buffer reused for every file info
     ssize_t bytes_received = 0;         // total amount of data received
-    char buf_mem[TCP_BUF_SIZE];         // buffer used to receive data
-    char *start, *buffer;               // pointers used to access the buffer
-    uint16_t i;                         // packet index
-    int rv;
+    char count[sizeof(uint16_t)];       // buffer used to receive the number of elements
+    uint64_t name_len;                  // length of the file name announced
+    char *buffer;                       // pointer used to access the frame
+    uint16_t i;                         // frame index
+    int tuned;                          // 1 if the low watermark follows the frames
+    ssize_t rv;
 
     // init variables
     *out_files = NULL;
-    start = buffer = buf_mem;
 
     // receive first packet: number of elements contained in the list
-    rv = expect_data(sockfd, start, sizeof(uint16_t));
+    rv = tcp_stream_expect(stream, count, sizeof(uint16_t));
     if (rv) {
         return rv;
     }
 
     // fill the returned list size
-    read_u16(start, out_size);
+    read_u16(count, out_size);
 
-    // receive packets containing the data prefixed by its size (1 packet = 1 node)
+    // small frames: the reader only wakes up once a whole header or frame has come
+    // (over TCP, the shared-memory streams have no socket to tune)
+    tuned = tcp_stream_tune_rcvlowat(stream, 1) == 0;
+
+    // receive a frame per file info
     for (i = 0; i < *out_size; i++) {
-        // receive the packet header containing the packet size
-        rv = expect_data(sockfd, start, sizeof(uint32_t));
-        if (rv) {
-            return rv;
+        // a name longer than NAME_MAX_LEN is refused before being read
+        rv = recv_frame(stream, &frame, 2 * sizeof(uint64_t) + NAME_MAX_LEN);
+        if (rv < 0) {
+            break;
         }
-        read_u32(start, &data_size);
 
-        // receive the data
-        rv = expect_data(sockfd, start, data_size);
-        if (rv) {
-            return rv;
+        // the name announced must fit in the frame, followed by the size
+        if (frame.len >= 2 * sizeof(uint64_t)) {
+            read_u64(frame.data, &name_len);
+        }
+        if (frame.len < 2 * sizeof(uint64_t) || name_len != frame.len - 2 * sizeof(uint64_t)) {
+            errno = EPROTO;
+            rv = -1;
+            break;
         }
-        bytes_received += data_size;
+        bytes_received += frame.len;
 
         // fill the file info with the data received
         file = malloc(sizeof(struct dl_file));
-        buffer = read_str(start, &file->name);
+        buffer = read_str(frame.data, &file->name);
         buffer = read_u64(buffer, (uint64_t *) &file->size);
         file->next = NULL;
 
         if (*out_files != NULL) prev_file->next = file;
         else *out_files = file;
         prev_file = file;
+
+        // the name is used as a path in the files or download directory
+        if (!valid_name(file->name)) {
+            errno = EPROTO;
+            rv = -1;
+            break;
+        }
+    }
+
+    tcp_frame_buf_free(&frame);
+    if (tuned) tcp_stream_tune_rcvlowat(stream, 0);
+
+    // do not return a partial list
+    if (rv < 0) {
+        free_list(*out_files);
+        *out_files = NULL;
+        return rv;
     }
 
     return bytes_received;
 }
 
-int send_file(int sockfd, struct dl_file *file, char *dirname) {
+int send_file(struct tcp_stream *stream, struct dl_file *file, char *dirname) {
     char filepath[BUF_SIZE];            // file path
     int fd;                             // file descriptor
     char size_buf[sizeof(uint64_t)];    // buffer used to send the size of the file
     uint64_t remaining_bytes;           // remaining data amount to send
     ssize_t bytes_sent;                 // amount of bytes sent
     off_t offset = 0;                   // offset used by sendfile
+    int nonblocking;                    // 1 if sendfile must not block
+    struct tcp_autotune tune;           // send buffer & chunk sized from the measured BDP
+    int tuned;                          // 1 if the transfer is tuned
+    size_t chunk;                       // bytes sent per call
+    struct stat st;                     // size of the file on disk
 
     // open the file
-    sprintf(filepath, "%s/%s", dirname, file->name);
+    if (file_path(filepath, dirname, file->name)) {
+        return -1;
+    }
     fd = open(filepath, O_RDONLY);
     if (fd < 0) {
         return -1;
     }
 
-    // send file size
-    remaining_bytes = file->size;
+    // send file size: the size on disk, the one announced by the peer is not trusted
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    remaining_bytes = st.st_size;
     write_u64(remaining_bytes, size_buf);
-    if (send_data(sockfd, size_buf, sizeof(uint64_t))) {
+    if (tcp_stream_write(stream, size_buf, sizeof(uint64_t)) || tcp_stream_flush(stream)) {
+        close(fd);
         return -1;
     }
 
-    // send bytes while bytes remain
+    // with a deadline or in a coroutine, sendfile must not block:
+    // wait for room in the socket instead (the other coroutines run meanwhile)
+    nonblocking = stream->deadline >= 0 || coro_self() != NULL;
+    if (nonblocking && set_nonblocking(stream->fd, 1)) {
+        close(fd);
+        return -1;
+    }
+
+    // send bytes while bytes remain (by chunks when tuned, to sample between them)
+    tuned = AUTOTUNE && tcp_autotune_init(&tune, stream->fd, TCP_TUNE_SEND, NULL) == 0;
     while (remaining_bytes) {
-        bytes_sent = sendfile(sockfd, fd, &offset, remaining_bytes);
+        chunk = tuned ? tcp_autotune_step(&tune) : remaining_bytes;
+        bytes_sent = sendfile(stream->fd, fd, &offset,
+                              remaining_bytes > chunk ? chunk : remaining_bytes);
         if (bytes_sent < 0) {
-            close(fd);
-            return -1;
+            if (errno == EAGAIN && wait_io(stream->fd, POLLOUT, stream->deadline) == 0) {
+                continue;
+            }
+            break;
+        }
+
+        // end of the file reached early: it has been truncated meanwhile
+        if (bytes_sent == 0) {
+            errno = ENODATA;
+            break;
         }
         remaining_bytes -= bytes_sent;
     }
     close(fd);
-    return 0;
+
+    // restore the blocking mode (keeping the error of the transfer if any)
+    if (nonblocking) {
+        int saved_errno = errno;
+        set_nonblocking(stream->fd, 0);
+        errno = saved_errno;
+    }
+
+    return remaining_bytes ? -1 : 0;
 }
 
-int receive_file(int sockfd, struct dl_file *file, char *dirname) {
+int receive_file(struct tcp_stream *stream, struct dl_file *file, char *dirname) {
     FILE *fp;                   // file pointer
     char filepath[BUF_SIZE];    // file path
     uint64_t remaining_bytes;   // remaining data amount to receive
-    char buffer[TCP_BUF_SIZE];  // buffer filled with the data received
-    ssize_t bytes_expected;     // bytes expected by expect data
+    char *buffer;               // buffer filled with the data received
+    size_t buf_cap;             // size of the buffer
+    ssize_t bytes_received;     // bytes received by the stream
+    struct tcp_autotune tune;   // receive buffer & chunk sized from the measured BDP
+    int tuned;                  // 1 if the transfer is tuned
+    size_t chunk;               // bytes received per call
+    int rv = -1;
 
     // make directory if it does not exist
     mkdir(dirname, 0700);
-    sprintf(filepath, "%s/%s", dirname, file->name);
+    if (file_path(filepath, dirname, file->name)) {
+        return -1;
+    }
 
     // open the file
     fp = fopen(filepath, "wb");
@@ -291,27 +406,48 @@ int receive_file(int sockfd, struct dl_file *file, char *dirname) {
         return -1;
     }
 
-    // receive file size
-    if (expect_data(sockfd, buffer, sizeof(uint64_t))) {
+    // buffer from the pool, as large as the stream one: large reads bypass the stream
+    buffer = tcp_buf_get(stream->rcap, &buf_cap);
+    if (buffer == NULL) {
+        fclose(fp);
         return -1;
     }
+
+    // receive file size
+    if (tcp_stream_expect(stream, buffer, sizeof(uint64_t))) {
+        goto out;
+    }
     read_u64(buffer, &remaining_bytes);
 
-    // receive bytes while bytes remain
+    // receive bytes while bytes remain (served from the stream read-ahead)
+    tuned = AUTOTUNE && tcp_autotune_init(&tune, stream->fd, TCP_TUNE_RECV, NULL) == 0;
     while (remaining_bytes) {
-        bytes_expected = remaining_bytes > TCP_BUF_SIZE ? TCP_BUF_SIZE : remaining_bytes;
-        if (expect_data(sockfd, buffer, bytes_expected)) {
-            return -1;
+        // larger chunks on a larger BDP: swap the buffer for one of the size class
+        chunk = tuned ? tcp_autotune_step(&tune) : buf_cap;
+        if (chunk > buf_cap) {
+            tcp_buf_put(buffer, buf_cap);
+            if ((buffer = tcp_buf_get(chunk, &buf_cap)) == NULL) {
+                goto out;
+            }
         }
 
-        if ((ssize_t) fwrite(buffer, 1, bytes_expected, fp) != bytes_expected) {
-            return -1;
+        bytes_received = tcp_stream_receive(stream, buffer,
+                            remaining_bytes > buf_cap ? buf_cap : remaining_bytes);
+        if (bytes_received <= 0) {
+            goto out;
         }
-        remaining_bytes -= bytes_expected;
+
+        if ((ssize_t) fwrite(buffer, 1, bytes_received, fp) != bytes_received) {
+            goto out;
+        }
+        remaining_bytes -= bytes_received;
     }
+    rv = 0;
 
+out:
+    tcp_buf_put(buffer, buf_cap);
     fclose(fp);
-    return 0;
+    return rv;
 }
 
 uint16_t get_chosen_file(uint16_t size) {
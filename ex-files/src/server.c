@@ -8,13 +8,21 @@
  * Add subdirectory "files" with files to download
  * or change the downloadable files directory in const.h
  *
+ * arg (optional) : "coro" to serve all the clients from coroutines in this process
+ *                  instead of a child process per client
+ *                  "handoff" to restart without downtime: the listening socket is taken
+ *                  over from the server running in handoff mode, which finishes serving
+ *                  its clients & exits, then offered in turn to the next instance
+ *
  * RI 2020 - Laura Binacchi - Fedora 32
  ****************************************************************************************/
 
 #include <errno.h>
 #include <netdb.h>          // gai_strerror
+#include <poll.h>
 #include <signal.h>         // sigaction
 #include <stdio.h>
+#include <stdlib.h>         // malloc
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>       // WNOHANG
@@ -22,10 +30,19 @@
 
 #include "const.h"
 #include "file.h"
+#include "tcp-coro.h"
+#include "tcp-handoff.h"
 #include "tcp-util.h"
+#include "tcp-stream.h"
 
 #define BACKLOG 10  // amount of pending connections allowed
 
+/** Client served by a coroutine */
+struct session {
+    int fd;                             // client socket file descriptor
+    char ip[INET6_ADDRSTRLEN];          // human readable ip address of the client
+};
+
 // Save errno after a child death
 void sigchld_handler(int s) {
     (void)s;
@@ -34,19 +51,185 @@ void sigchld_handler(int s) {
     errno = saved_errno;
 }
 
-int main() {
-    int sockfd;                         // server socket file descriptor
-    int newfd;                          // client socket file descriptor
-    char client_ip[INET6_ADDRSTRLEN];   // string containing the human readable ip address of the client
-    struct sigaction sa;                // modified action to call on a child process death
+/**
+ * Serves a client: sends the list of files, then the file chosen
+ * The same sequential code runs in a child process or in a coroutine
+ *
+ * @param newfd: client socket file descriptor, closed before returning
+ * @param client_ip: human readable ip address of the client
+ *
+ * @return EXIT_SUCCESS if the file has been sent, EXIT_FAILURE otherwise
+ */
+int serve_client(int newfd, char *client_ip) {
+    struct tcp_stream *stream;          // buffered stream over the client connection
     char id_byte;                       // identification byte received from the client
     struct dl_file *files;              // files info linked list sent to the client
     uint16_t files_size;                // number of elements contained in the list
     ssize_t rsize;                      // returned size
     int rint;                           // returned integer
 
+    stream = tcp_stream_open(newfd, 0);
+    if (stream == NULL) {
+        perror("[server] creating the stream");
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+
+    // a stalled or slow client can not hold the server longer than the session
+    tcp_stream_set_deadline(stream, tcp_deadline(SESSION_TIMEOUT));
+
+    // receive the identification byte
+    rint = tcp_stream_expect(stream, &id_byte, 1);
+    if (rint < 0) {
+        if (rint == ERR_TCP_PEER_CLOSED) {
+            fprintf(stderr, "[server:%s] receiving id byte: client has closed the connection\n", client_ip);
+        } else {
+            perror("[server] receiving the identification byte");
+        }
+        tcp_stream_free(stream);
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+
+    // test the identification byte
+    if (id_byte != ID_BYTE) {
+        fprintf(stderr, "[server:%s] closing: wrong identification byte\n", client_ip);
+        tcp_stream_free(stream);
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+
+    files_size = get_list(DIR_FILE, &files);
+
+    // send the list
+    rsize = send_list(stream, files, files_size);
+    free_list(files);
+
+    if (rsize < 0) {
+        fprintf(stderr, "[server:%s] sending the list: %s\n", client_ip, strerror(errno));
+        tcp_stream_free(stream);
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+
+    if (files_size == 0) {
+        printf("[server:%s] closing: no file available for download\n", client_ip);
+        tcp_stream_free(stream);
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+    printf("[server:%s] list of available files sent\n", client_ip);
+
+    // receive the chosen file
+    rsize = receive_list(stream, &files, &files_size);
+    if (rsize < 0) {
+        if (rsize == ERR_TCP_PEER_CLOSED) {
+            fprintf(stderr, "[server:%s] receiving chosen file: "
+                        "client has closed the connection\n", client_ip);
+        } else {
+            perror("[server] receiving chosen file");
+        }
+        tcp_stream_free(stream);
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+
+    // send the file
+    rint = send_file(stream, files, DIR_FILE);
+    if (rint) {
+        fprintf(stderr, "[server:%s] sending %s: %s\n", client_ip, files->name, strerror(errno));
+        free_list(files);
+        tcp_stream_free(stream);
+        disconnect(newfd);
+        return EXIT_FAILURE;
+    }
+    printf("[server:%s] successfully sent %s\n", client_ip, files->name);
+    free_list(files);
+
+    printf("[server:%s] closing\n", client_ip);
+    tcp_stream_free(stream);
+    disconnect(newfd);
+    return EXIT_SUCCESS;
+}
+
+// Coroutine serving a client
+void session_coro(void *arg) {
+    struct session *session = arg;
+
+    serve_client(session->fd, session->ip);
+    free(session);
+}
+
+// Coroutine accepting the clients, each one served by a new coroutine
+void accept_coro(void *arg) {
+    int sockfd = *(int *) arg;          // server socket file descriptor
+    struct tcp_accepted accepted[ACCEPT_BATCH];  // connections taken from the backlog
+    struct session *session;            // client accepted
+    int count, i;
+
+    while (1) {
+        // yields until a client connects
+        count = server_accept_batch(sockfd, accepted, ACCEPT_BATCH, SOCK_CLOEXEC, -1);
+        if (count < 0) {
+            perror("[server] accepting incoming connection");
+            // out of descriptors or memory: the backlog stays readable, let the sessions
+            // end before trying again
+            coro_sleep(ACCEPT_BACKOFF);
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+            session = malloc(sizeof(struct session));
+            if (session == NULL) {
+                perror("[server] allocating the session");
+                disconnect(accepted[i].fd);
+                continue;
+            }
+
+            session->fd = accepted[i].fd;
+            server_accepted_ip(&accepted[i], session->ip);
+
+            printf("[server] connection received from %s%s...\n", session->ip,
+                        tcp_fastopen_used(session->fd) == 1 ? " (TCP Fast Open)" : "");
+
+            if (coro_spawn(coro_self(), session_coro, session)) {
+                perror("[server] creating the coroutine");
+                disconnect(session->fd);
+                free(session);
+            }
+        }
+    }
+}
+
+/**
+ * Opens the listening socket: takes it over from the running server in handoff mode,
+ * otherwise (or if no server is running) opens a passive connection
+ *
+ * @param opts: options of the listening socket
+ * @param handoff_mode: 1 to take the socket of the running server over
+ *
+ * @return the listening socket, -1 if an error occured (printed)
+ */
+int open_listener(struct tcp_options *opts, int handoff_mode) {
+    int sockfd;                         // server socket file descriptor
+    int rv;
+
+    if (handoff_mode) {
+        rv = server_takeover(HANDOFF_ADDRESS, &sockfd, 1, tcp_deadline(HANDOFF_TIMEOUT));
+        if (rv == 1) {
+            printf("[server] listening socket taken over from the running server\n");
+            return sockfd;
+        }
+
+        // no server running: listen ourselves
+        if (rv != ERR_TCP_ACTIVE_CONNECT) {
+            perror("[server] taking the listening socket over");
+            return -1;
+        }
+    }
+
     // open a passive connection
-    sockfd = server_listen(PORT, BACKLOG);
+    sockfd = server_listen_opts(PORT, BACKLOG, opts);
     if (sockfd < 0) {
         switch (sockfd) {
             case ERR_TCP_CREATE_SOCK:
@@ -64,6 +247,72 @@ int main() {
             default:
                 break;
         }
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Ends the server once its listening socket has been handed over:
+ * the clients being served by the children are served until the end
+ *
+ * @param sockfd: listening socket, taken over by the new instance
+ * @param handoff_fd: handoff socket
+ *
+ * @return EXIT_SUCCESS
+ */
+int drain_children(int sockfd, int handoff_fd) {
+    disconnect(sockfd);
+    disconnect(handoff_fd);
+    printf("[server] listening socket handed over, finishing the downloads in progress...\n");
+
+    // the children are also reaped by the SIGCHLD handler: wait until none is left
+    while (wait(NULL) > 0 || errno == EINTR);
+
+    printf("[server] all the clients served, exiting\n");
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    int sockfd;                         // server socket file descriptor
+    int newfd;                          // client socket file descriptor
+    struct tcp_options opts = {         // inherited by the client connections,
+        .nodelay = 1,                   // the id byte may come with the SYN (Fast Open),
+        .fastopen = FASTOPEN_QLEN,      // the server only wakes up once it has come
+        .defer_accept = DEFER_ACCEPT
+    };
+    struct tcp_accepted accepted[ACCEPT_BATCH];  // connections taken from the backlog
+    int count, i, other;
+    char client_ip[INET6_ADDRSTRLEN];   // string containing the human readable ip address of the client
+    struct sigaction sa;                // modified action to call on a child process death
+    struct coro_sched *sched;           // scheduler of the coroutines in coro mode
+    int coro_mode = argc > 1 && strcmp(argv[1], "coro") == 0;
+    int handoff_mode = argc > 1 && strcmp(argv[1], "handoff") == 0;
+    int handoff_fd = -1;                // socket on which the next instance asks for ours
+    struct pollfd pfds[2];              // listening & handoff sockets in handoff mode
+
+    sockfd = open_listener(&opts, handoff_mode);
+    if (sockfd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // coro mode: one process, the clients are served while the others wait for the network
+    if (coro_mode) {
+        sched = coro_sched_create(0);
+        if (sched == NULL || coro_spawn(sched, accept_coro, &sockfd)) {
+            perror("[server] creating the scheduler");
+            disconnect(sockfd);
+            return EXIT_FAILURE;
+        }
+
+        printf("[server] waiting for connections (coroutines)...\n");
+
+        if (coro_run(sched)) {
+            perror("[server] running the coroutines");
+        }
+        coro_sched_destroy(sched);
+        disconnect(sockfd);
         return EXIT_FAILURE;
     }
 
@@ -78,88 +327,68 @@ int main() {
         return EXIT_FAILURE;
     }
 
+    // handoff mode: offer the listening socket to the next instance
+    if (handoff_mode && (handoff_fd = server_handoff_listen(HANDOFF_ADDRESS)) < 0) {
+        perror("[server] opening the handoff socket");
+        disconnect(sockfd);
+        return EXIT_FAILURE;
+    }
+
     printf("[server] waiting for connections...\n");
 
     while (1) {
-        // get a new socket file descriptor for the incoming connection
-        newfd = server_accept(sockfd, client_ip);
-        if (newfd < 0) {
-            perror("[server] accepting incoming connection");
-            continue;
-        }
-
-        printf("[server] connection received from %s...\n", client_ip);
-
-        // open a child process
-        if (!fork()) {
-            // child doesn't need the listener
-            disconnect(sockfd);
+        if (handoff_fd >= 0) {
+            // wait for a client or for the next instance
+            pfds[0].fd = sockfd;
+            pfds[0].events = POLLIN;
+            pfds[1].fd = handoff_fd;
+            pfds[1].events = POLLIN;
+            if (poll(pfds, 2, -1) < 0) {
+                continue;
+            }
 
-            // receive the identification byte
-            rint = expect_data(newfd, &id_byte, 1);
-            if (rint < 0) {
-                if (rint == ERR_TCP_PEER_CLOSED) {
-                    fprintf(stderr, "[server:%s] receiving id byte: client has closed the connection\n", client_ip);
-                } else {
-                    perror("[server] receiving the identification byte");
+            // keep accepting until the next instance has acknowledged the socket
+            if (pfds[1].revents) {
+                if (server_handoff(handoff_fd, &sockfd, 1, tcp_deadline(HANDOFF_TIMEOUT)) == 0) {
+                    return drain_children(sockfd, handoff_fd);
                 }
-                disconnect(newfd);
-                return EXIT_FAILURE;
+                perror("[server] handing the listening socket over");
             }
 
-            // test the identification byte
-            if (id_byte != ID_BYTE) {
-                fprintf(stderr, "[server:%s] closing: wrong identification byte\n", client_ip);
-                disconnect(newfd);
-                return EXIT_FAILURE;
+            if (!pfds[0].revents) {
+                continue;
             }
+        }
 
-            files_size = get_list(DIR_FILE, &files);
-
-            // send the list
-            rsize = send_list(newfd, files, files_size);
-            free_list(files);
+        // take the incoming connections queued (at least one, unless polled in handoff mode)
+        count = server_accept_batch(sockfd, accepted, ACCEPT_BATCH, SOCK_CLOEXEC,
+                                    handoff_fd >= 0 ? 0 : -1);
+        if (count == ERR_TCP_WOULD_BLOCK) {
+            continue;
+        }
+        if (count < 0) {
+            perror("[server] accepting incoming connection");
+            continue;
+        }
 
-            if (rsize < 0) {
-                fprintf(stderr, "[server:%s] sending the list: %s\n", client_ip, strerror(errno));
-                disconnect(newfd);
-                return EXIT_FAILURE;
-            }
+        for (i = 0; i < count; i++) {
+            newfd = accepted[i].fd;
+            server_accepted_ip(&accepted[i], client_ip);
 
-            if (files_size == 0) {
-                printf("[server:%s] closing: no file available for download\n", client_ip);
-                disconnect(newfd);
-                return EXIT_FAILURE;
-            }
-            printf("[server:%s] list of available files sent\n", client_ip);
-
-            // receive the chosen file
-            rsize = receive_list(newfd, &files, &files_size);
-            if (rsize < 0) {
-                if (rsize == ERR_TCP_PEER_CLOSED) {
-                    fprintf(stderr, "[server:%s] receiving chosen file: "
-                                "client has closed the connection\n", client_ip);
-                } else {
-                    perror("[server] receiving chosen file");
-                }
-                disconnect(newfd);
-                return EXIT_FAILURE;
-            }
+            printf("[server] connection received from %s%s...\n", client_ip,
+                        tcp_fastopen_used(newfd) == 1 ? " (TCP Fast Open)" : "");
 
-            // send the file
-            rint = send_file(newfd, files, DIR_FILE);
-            if (rint) {
-                fprintf(stderr, "[server:%s] sending %s: %s\n", client_ip, files->name, strerror(errno));
-                free_list(files);
-                disconnect(newfd);
-                return EXIT_FAILURE;
+            // open a child process
+            if (!fork()) {
+                // child doesn't need the listener nor the rest of the batch
+                disconnect(sockfd);
+                if (handoff_fd >= 0) disconnect(handoff_fd);
+                for (other = i + 1; other < count; other++) disconnect(accepted[other].fd);
+                return serve_client(newfd, client_ip);
             }
-            printf("[server:%s] successfully sent %s\n", client_ip, files->name);
-            free_list(files);
 
-            printf("[server:%s] closing\n", client_ip);
+            // the connection belongs to the child
             disconnect(newfd);
-            return EXIT_SUCCESS;
         }
     }
 
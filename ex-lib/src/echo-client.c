@@ -15,51 +15,76 @@
 
 #include "constants.h"
 #include "tcp-util.h"
+#include "tcp-pool.h"
 
 int main(int argc, char *argv[]) {
     char hostname[BUF_SIZE];        // server name or ip address (dot separated)
     char msg_sent[BUF_SIZE];        // message to send to the server
     char msg_received[BUF_SIZE];    // message reveived back from the server
     int sockfd, rv;                 // socket file descriptor & return value
+    struct tcp_pool *pool;          // keeps the connection open between the messages
+    struct tcp_pool_stats stats;    // amount of connections opened & reused
+    int i;
     
     // test the params
-    if (argc != 3) {
-        fprintf(stderr,"usage: %s hostname message\n", argv[0]);
+    if (argc < 3) {
+        fprintf(stderr,"usage: %s hostname message [message...]\n", argv[0]);
         return 1;
     }
 
     strncpy(hostname, argv[1], BUF_SIZE);
 
-    // connect to the server
-    sockfd = client_connect(hostname, PORT);
-    if (sockfd < 0) {
-        if (sockfd == -1) fprintf(stderr, "[client] creating the socket: %s\n", gai_strerror(errno));
-        else if (sockfd == -2) perror("[client] connecting to the server");
+    pool = pool_create(1, 0);
+    if (pool == NULL) {
+        perror("[client] creating the connection pool");
         return 1;
     }
 
-    // send message
-    // TODO check if argv[2] > BUF_SIZE, here the message is truncated if too long
-    strncpy(msg_sent, argv[2], BUF_SIZE);
-    if (send_data(sockfd, msg_sent, strlen(msg_sent))) {
-        perror("[client] sending message");
-        return 1;
-    }
+    // one echo exchange per message, on the same connection when possible
+    for (i = 2; i < argc; i++) {
+        // connect to the server (or reuse the connection of the previous message)
+        sockfd = pool_get(pool, hostname, PORT);
+        if (sockfd < 0) {
+            if (sockfd == -1) fprintf(stderr, "[client] creating the socket: %s\n", gai_strerror(errno));
+            else if (sockfd == -2) perror("[client] connecting to the server");
+            pool_destroy(pool);
+            return 1;
+        }
 
-    // receive back message
-    rv = expect_data(sockfd, msg_received, strlen(msg_sent));
-    if (rv) {
-        if (rv == -1) fprintf(stderr, "[client] connection closed by the server before receiving expected amount of data");
-        else perror("[client] receiving data");
-        return 1;
+        // send message
+        // TODO check if argv[i] > BUF_SIZE, here the message is truncated if too long
+        strncpy(msg_sent, argv[i], BUF_SIZE - 1);
+        msg_sent[BUF_SIZE - 1] = '\0';
+        if (send_data(sockfd, msg_sent, strlen(msg_sent))) {
+            perror("[client] sending message");
+            pool_release(pool, sockfd, 0);
+            pool_destroy(pool);
+            return 1;
+        }
+
+        // receive back message
+        rv = expect_data(sockfd, msg_received, strlen(msg_sent));
+        if (rv) {
+            if (rv == ERR_TCP_PEER_CLOSED) fprintf(stderr, "[client] connection closed by the server before receiving expected amount of data\n");
+            else perror("[client] receiving data");
+            pool_release(pool, sockfd, 0);
+            pool_destroy(pool);
+            return 1;
+        }
+
+        // the whole echo has been received: the connection can serve the next message
+        pool_release(pool, sockfd, 1);
+
+        // print received message
+        msg_received[strlen(msg_sent)] = '\0';
+        printf("[client] message received: \"%s\"\n", msg_received);
     }
 
-    // print received message
-    msg_received[strlen(msg_sent)] = '\0';
-    printf("[client] message received: \"%s\"\n", msg_received);
+    pool_get_stats(pool, &stats);
+    printf("[client] %d message(s) sent on %lu connection(s)\n", argc - 2, stats.created);
 
     // close the connection
-    disconnect(sockfd);
+    pool_destroy(pool);
 
     return 0;
 }
@@ -3,7 +3,8 @@
 * ===========================
 *
 * Server implementing the echo protocol (RFC 862)
-* & using the TCP library
+* & using the TCP library (one pinned event loop & listening shard per core,
+* no process per connection)
 *
 * launch as su
 *
@@ -25,8 +26,9 @@
 
 #include "constants.h"
 #include "tcp-util.h"
+#include "tcp-reactor.h"
 
-#define BACKLOG 10  // amount of pending connections allowed
+#define BACKLOG 128 // amount of pending connections allowed
 
 // Save errno after a child death
 void sigchld_handler(int s) {
@@ -36,19 +38,75 @@ void sigchld_handler(int s) {
     errno = saved_errno;
 }
 
+// New connection accepted by the reactor
+int echo_open(struct reactor_conn *conn) {
+    printf("[server] connection received from %s...\n", conn_peer(conn));
+    return 0;
+}
+
+// Data received: send it back until the socket is drained
+int echo_read(struct reactor_conn *conn) {
+    char msg[BUF_SIZE];         // message received and sent back
+    ssize_t bytes_received;     // number of bytes received
+
+    // stop reading while the client does not read its echo (resumed by the reactor)
+    while (conn_pending(conn) < REACTOR_MAX_PENDING) {
+        // receive the message
+        bytes_received = conn_read(conn, msg, BUF_SIZE);
+
+        if (bytes_received == ERR_TCP_WOULD_BLOCK) return 0;
+
+        if (bytes_received < 0) {
+            perror("[server] receiving data");
+            return -1;
+        }
+
+        // stop reading if the client has closed the connection
+        if (bytes_received == 0) return -1;
+
+        printf("[server:%s]\t%ld bytes received\n", conn_peer(conn), bytes_received);
+
+        // send back the message
+        if (conn_write(conn, msg, bytes_received) < 0) {
+            perror("[server] sending data");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Connection closed by the client or after an error
+void echo_close(struct reactor_conn *conn) {
+    printf("[server:%s] closing\n", conn_peer(conn));
+}
+
 int main() {
-    int sockfd, newfd;                  // listen on sockfd, new connection on newfd
-    char client_ip[INET6_ADDRSTRLEN];   // string containing a human readable ip address of the client
-    char msg[BUF_SIZE];                 // message received and sent back
-    ssize_t bytes_received;             // number of bytes received
-    struct sigaction sa;                
-    
-    // open a passive connection
-    if ((sockfd = server_listen(PORT, BACKLOG)) < 0) {
-        if (sockfd == -1) fprintf(stderr, "[server] creating the socket: %s\n", gai_strerror(errno));
-        else if (sockfd == -2) perror("[server] overriding socket options");
-        else if (sockfd == -3) perror("[server] binding\n");
-        else if (sockfd == -4) perror("[server] listening");
+    int *sockfds;                       // listening sockets (one per worker)
+    int rv;                             // return value
+    struct sigaction sa;
+    struct reactor *reactor;            // event loop serving the connections of a worker
+    struct reactor_handlers handlers = {
+        .on_open = echo_open,
+        .on_read = echo_read,
+        .on_close = echo_close,
+    };
+    long workers;                       // number of worker processes (one per core)
+    long i, worker;
+
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+    sockfds = malloc(workers * sizeof(int));
+    if (sockfds == NULL) {
+        perror("[server] allocating the listeners");
+        return 1;
+    }
+
+    // open a passive connection per core (SO_REUSEPORT shards)
+    if ((rv = server_listen_sharded(PORT, BACKLOG, workers, NULL, sockfds)) < 0) {
+        if (rv == -1) fprintf(stderr, "[server] creating the socket: %s\n", gai_strerror(errno));
+        else if (rv == -2) perror("[server] overriding socket options");
+        else if (rv == -3) perror("[server] binding\n");
+        else if (rv == -4) perror("[server] listening");
         return 1;
     }
 
@@ -63,50 +121,42 @@ int main() {
         return 1;
     }
 
-    printf("[server] waiting for connections...\n");
-
-    while(1) {
-        // get a new socket file descriptor for the incoming connection
-        newfd = server_accept(sockfd, client_ip);
-        if (newfd < 0) {
-            perror("[server] accepting incoming connection");
-            continue;
-        }
-
-        printf("[server] connection received from %s...\n", client_ip);
-        
-        // open a child process
+    // one event loop per core, pinned to it & serving its own listening socket:
+    // the parent process is the first worker
+    worker = 0;
+    for (i = 1; i < workers; i++) {
         if (!fork()) {
-            disconnect(sockfd); // child doesn't need the listener
-
-            while (1) {
-                // receive the message
-                bytes_received = receive_data(newfd, msg, BUF_SIZE);
-                
-                if (bytes_received < 0) {
-                    perror("[server] receiving data");
-                    disconnect(newfd);
-                    return 1;
-                }
-
-                // stop reading if the client has closed the connection
-                if (bytes_received == 0) break;
-
-                printf("[server:%s]\t%ld bytes received\n", client_ip, bytes_received);
-
-                // send back the message
-                if (send_data(newfd, msg, bytes_received) < 0) {
-                    perror("[server] sending data");
-                    disconnect(newfd);
-                    return 1;
-                }
-            }
-
-            printf("[server:%s] closing\n", client_ip);
-            disconnect(newfd);
-            return 0;
+            worker = i;
+            break;
         }
     }
 
+    if (tcp_pin_cpu(worker)) {
+        perror("[server] pinning the worker");
+    }
+
+    // the worker doesn't need the listeners of the others
+    for (i = 0; i < workers; i++) {
+        if (i != worker) disconnect(sockfds[i]);
+    }
+
+    reactor = reactor_create(&handlers, NULL);
+    if (reactor == NULL || reactor_add_listener(reactor, sockfds[worker])) {
+        perror("[server] creating the event loop");
+        return 1;
+    }
+
+    printf("[server] waiting for connections...\n");
+
+    if (reactor_run(reactor)) {
+        perror("[server] running the event loop");
+        reactor_destroy(reactor);
+        return 1;
+    }
+
+    reactor_destroy(reactor);
+    disconnect(sockfds[worker]);
+    free(sockfds);
+
     return 0;
 }
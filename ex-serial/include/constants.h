@@ -10,3 +10,7 @@
 
 #define PORT "8888"     // port number
 #define BUF_SIZE 1024   // max number of bytes we can get at once 
+#define SESSION_TIMEOUT 10000   // ms a client is served before being dropped
+#define FASTOPEN_QLEN   16      // connections accepted with data in their SYN (TCP Fast Open)
+#define DEFER_ACCEPT    5       // s a connection waits for the list before being accepted anyway
+#define ACCEPT_BATCH    16      // connections accepted per call
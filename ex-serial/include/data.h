@@ -10,6 +10,9 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
+
+struct tcp_stream;
 
 /** Data linked list structure */
 struct data_node {
@@ -45,43 +48,43 @@ struct data_node *create_node();
 void free_list(struct data_node *node);
 
 /**
- * Sends a data linked list
+ * Sends a data linked list & flushes the stream
  * 
- * @param sockfd: tcp connection socket file descriptor
+ * @param stream: buffered tcp connection stream
  * @param node: head node pointer
  * @param size: number of elements contained in the list
  * 
  * @return the amount of bytes sent or -1 if an error occured
  */
-ssize_t send_list(int sockfd, struct data_node *node, uint16_t size);
+ssize_t send_list(struct tcp_stream *stream, struct data_node *node, uint16_t size);
 
 /**
  * Receives a data linked list
  * 
- * @param sockfd: tcp connection socket file descriptor
+ * @param stream: buffered tcp connection stream
  * @param out_node: returned linked list pointer containing the data received
  * @param out_list_size: returned list size (number of nodes contained)
  * 
  * @return number of bytes received, -1 if an error occured
  */
-ssize_t receive_list(int sockfd, struct data_node **out_node, uint16_t *out_list_size);
+ssize_t receive_list(struct tcp_stream *stream, struct data_node **out_node, uint16_t *out_list_size);
 
 /**
- * Sends an acknowledgement containing the amount of data received
+ * Sends an acknowledgement containing the amount of data received & flushes the stream
  * 
- * @param sockfd: tcp connection socket file descriptor
+ * @param stream: buffered tcp connection stream
  * @param ack_bytes: amount of data received by the server
  * 
  * @return the return value of send (0 if all bytes have been send,
  *      -1 if an error occured & set errno)
  */
-int send_ack(int sockfd, ssize_t ack_bytes);
+int send_ack(struct tcp_stream *stream, ssize_t ack_bytes);
 
 /**
  * Receives an acknowledgement containing the amount of data received
  * 
- * @param sockfd: tcp connection socket file descriptor
+ * @param stream: buffered tcp connection stream
  * 
  * @return the amount of data received by the server or the error code from expect_data
  */
-ssize_t receive_ack(int sockfd);
\ No newline at end of file
+ssize_t receive_ack(struct tcp_stream *stream);
\ No newline at end of file
@@ -5,7 +5,8 @@
 * Client implementing the echo protocol (RFC 862)
 * & using the TCP library & the serial library
 *
-* arg : list size [1, UINT16_MAX]
+* args : hostname (or unix socket address of a same-host server, e.g. unix:/tmp/serial.sock,
+*        or its shared-memory address, e.g. shm:/tmp/serial.shm) & list size [1, UINT16_MAX]
 *
 * RI 2020 - Laura Binacchi - Fedora 32
 ****************************************************************************************/
@@ -19,17 +20,26 @@
 
 #include "constants.h"
 #include "data.h"
+#include "tcp-shm.h"
 #include "tcp-util.h"
+#include "tcp-stream.h"
 
 int main(int argc, char *argv[]) {
     char hostname[BUF_SIZE];        // server name or ip address (dot separated)
     int sockfd;                     // socket file descriptor & return value
+    struct tcp_stream *stream;      // buffered stream over the connection
+    struct tcp_shm *shm = NULL;     // shared-memory connection (shm: hostname)
+    struct tcp_options opts = {     // small frames sent at once,
+        .nodelay = 1,               // the start of the list carried by the SYN (Fast Open:
+        .fastopen = 1               // the handshake waits for it, the addresses are not raced)
+    };
     struct data_node *head = NULL;  // first node of the data linked list
     struct data_node *node;         // node of the linked list used for iteration
     size_t list_size;               // number of elements contained in the list
     size_t i;
     ssize_t bytes_sent;
     ssize_t bytes_received;
+    int fastopen;                   // 1 if the start of the list was carried by the SYN
 
     // seed the random
     srand(time(NULL));
@@ -58,17 +68,36 @@ int main(int argc, char *argv[]) {
     puts("\nData sent:");
     print_list(head, list_size);
 
-    // connect to the server
-    sockfd = client_connect(hostname, PORT);
-    if (sockfd < 0) {
+    // connect to the server through shared memory
+    if (!strncmp(hostname, TCP_SHM_PREFIX, strlen(TCP_SHM_PREFIX))) {
+        shm = shm_connect(hostname, 0);
+        if (shm == NULL) {
+            perror("[client] connecting to the server");
+            free_list(head);
+            return 1;
+        }
+        sockfd = -1;
+    } else {
+        sockfd = client_connect_opts(hostname, PORT, &opts);
+    }
+
+    if (shm == NULL && sockfd < 0) {
         if (sockfd == -1) fprintf(stderr, "[client] creating the socket: %s\n", gai_strerror(errno));
         else if (sockfd == -2) perror("[client] connecting to the server");
+        else if (sockfd == ERR_TCP_OVER_SOCK_OPT) perror("[client] overriding socket options");
+        free_list(head);
+        return 1;
+    }
+
+    stream = shm ? shm_stream_open(shm, 0) : tcp_stream_open(sockfd, 0);
+    if (stream == NULL) {
+        perror("[client] creating the stream");
         free_list(head);
         return 1;
     }
 
     // send the list
-    bytes_sent = send_list(sockfd, head, list_size);
+    bytes_sent = send_list(stream, head, list_size);
     free_list(head);
 
     if (bytes_sent <= 0) {
@@ -77,7 +106,7 @@ int main(int argc, char *argv[]) {
     }
 
     // receive acknowledgement from the server
-    bytes_received = receive_ack(sockfd);
+    bytes_received = receive_ack(stream);
     if (bytes_received < 0) {
         if (bytes_received == -1) fprintf(stderr, "[client] connection closed by the server before receiving acknowledgement\n");
         else perror("[client] receiving acknowledgement");
@@ -90,8 +119,16 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "server received %ld bytes on %ld bytes sent\n", bytes_received, bytes_sent);
     }
 
+    // the server cookie is known from the second connection on
+    if (sockfd >= 0 && (fastopen = tcp_fastopen_used(sockfd)) >= 0) {
+        printf("[client] handshake: %s\n", fastopen
+                    ? "data sent in the SYN (TCP Fast Open)" : "regular");
+    }
+
     // close the connection
-    disconnect(sockfd);
+    tcp_stream_free(stream);
+    if (shm) shm_close(shm);
+    else disconnect(sockfd);
 
     return 0;
 }
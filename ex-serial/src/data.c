@@ -7,14 +7,21 @@
 * RI 2020 - Laura Binacchi - Fedora 32
 ****************************************************************************************/
 
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "data.h"
 #include "constants.h"
 #include "serial-util.h"
-#include "tcp-util.h"
+#include "tcp-frame.h"
+#include "tcp-stream.h"
+
+#define FIELDS_SIZE 64  // buffer of the serialized node fields
+#define NODE_FIELDS 38  // fixed size fields & string length of a node
 
 /* PRIVATE FUNCTIONS */
 
@@ -88,77 +95,92 @@ void free_list(struct data_node *node) {
     }
 }
 
-ssize_t send_list(int sockfd, struct data_node *node, uint16_t size) {
-    char BUFFER[BUF_SIZE];
-    char *start, *buffer;
-    uint32_t node_size;
+ssize_t send_list(struct tcp_stream *stream, struct data_node *node, uint16_t size) {
+    char fields[FIELDS_SIZE];   // serialized node fields
+    struct iovec iov[2];        // serialized fields followed by the string of the node
+    char *buffer;
+    uint64_t str_len;
     ssize_t bytes_sent = 0;
 
-    start = buffer = BUFFER;
-
     // send a packet containing the number of nodes that will be sent
-    buffer = write_u16(size, buffer);
-    if(send_data(sockfd, start, buffer - start)) return -1;
+    buffer = write_u16(size, fields);
+    if (tcp_stream_write(stream, fields, buffer - fields)) return -1;
 
-    // send packet containing the node prefixed by its size (1 packet = 1 node)
+    // send a frame per node (the frame header is added by send_frame)
     while (node) {
-        // fill the packet with the node data
-        buffer = write_u16(node->int_16, start + sizeof(uint32_t)); // reserve space for the header
+        // fill the frame with the node data
+        buffer = write_u16(node->int_16, fields);
         buffer = write_u32(node->int_32, buffer);
         buffer = write_u64(node->int_64, buffer);
         buffer = write_f32(node->f, buffer);
         buffer = write_f64(node->d, buffer);
-        buffer = write_str(node->str, buffer);
 
-        // fill the packet header with the data size
-        node_size = buffer - start - sizeof(uint32_t);
-        write_u32(node_size, start);
+        // string prefixed by its size: the string itself is sent from the node
+        str_len = strlen(node->str);
+        buffer = write_u64(str_len, buffer);
 
-        // send the packet & stop sending if an error occured
-        if (send_data(sockfd, start, buffer - start)) return -1;
-        bytes_sent += node_size;
+        // send the frame & stop sending if an error occured
+        iov[0].iov_base = fields;
+        iov[0].iov_len = buffer - fields;
+        iov[1].iov_base = node->str;
+        iov[1].iov_len = str_len;
+        if (send_frame(stream, iov, 2)) return -1;
+        bytes_sent += iov[0].iov_len + str_len;
 
         node = node->next;
     }
 
+    // send the frames still combined in the stream buffer
+    if (tcp_stream_flush(stream)) return -1;
+
     return bytes_sent;
 }
 
-ssize_t receive_list(int sockfd, struct data_node **out_node, uint16_t *out_list_size) {
+ssize_t receive_list(struct tcp_stream *stream, struct data_node **out_node, uint16_t *out_list_size) {
     struct data_node *previous_node;
     struct data_node *node;
-    uint32_t node_size;
+    struct tcp_frame_buf frame = { 0 };  // receive buffer reused for every node
+    uint64_t str_len;
     uint16_t i;
     ssize_t bytes_received = 0;
-    char BUFFER[BUF_SIZE];
-    char *start, *buffer;
-    int rv;
+    char count[sizeof(uint16_t)];
+    char *buffer;
+    int tuned;                      // 1 if the low watermark follows the frames
+    ssize_t rv;
 
     *out_node = NULL;
-    start = buffer = BUFFER;
 
     // receive first packet: number of nodes contained in the list
-    rv = expect_data(sockfd, start, sizeof(uint16_t));
+    rv = tcp_stream_expect(stream, count, sizeof(uint16_t));
     if (rv) return rv;
 
     // fill the returned list size
-    read_u16(start, out_list_size);
+    read_u16(count, out_list_size);
 
-    // receive packet containing the node prefixed by its size (1 packet = 1 node)
-    for (i = 0; i < *out_list_size; i++) {
-        // receive the packet header containing the node size
-        rv = expect_data(sockfd, start, sizeof(uint32_t));
-        if (rv) return rv;
-        read_u32(start, &node_size);
+    // small frames: the reader only wakes up once a whole header or frame has come
+    // (over TCP, the shared-memory streams have no socket to tune)
+    tuned = tcp_stream_tune_rcvlowat(stream, 1) == 0;
 
-        rv = expect_data(sockfd, start, node_size);
-        if (rv) return rv;
-        bytes_received += node_size;
+    // receive a frame per node
+    for (i = 0; i < *out_list_size; i++) {
+        rv = recv_frame(stream, &frame, 0);
+        if (rv < 0) break;
+
+        // the string announced must fit in the frame
+        if (frame.len >= NODE_FIELDS) {
+            read_u64(frame.data + NODE_FIELDS - sizeof(uint64_t), &str_len);
+        }
+        if (frame.len < NODE_FIELDS || str_len > frame.len - NODE_FIELDS) {
+            errno = EPROTO;
+            rv = -1;
+            break;
+        }
+        bytes_received += frame.len;
 
         node = malloc(sizeof(struct data_node));
 
         // fill the node with the data received
-        buffer = read_u16(start, (uint16_t *) &node->int_16);
+        buffer = read_u16(frame.data, (uint16_t *) &node->int_16);
         buffer = read_u32(buffer, (uint32_t *) &node->int_32);
         buffer = read_u64(buffer, (uint64_t *) &node->int_64);
         buffer = read_f32(buffer, &node->f);
@@ -171,20 +193,31 @@ ssize_t receive_list(int sockfd, struct data_node **out_node, uint16_t *out_list
         previous_node = node;
     }
 
+    tcp_frame_buf_free(&frame);
+    if (tuned) tcp_stream_tune_rcvlowat(stream, 0);
+
+    // do not return a partial list
+    if (rv < 0) {
+        free_list(*out_node);
+        *out_node = NULL;
+        return rv;
+    }
+
     return bytes_received;
 }
 
-int send_ack(int sockfd, ssize_t ack_bytes) {
+int send_ack(struct tcp_stream *stream, ssize_t ack_bytes) {
     char ack[sizeof(uint64_t)];
     write_u64(ack_bytes, ack);
-    return send_data(sockfd, ack, sizeof(uint64_t));
+    if (tcp_stream_write(stream, ack, sizeof(uint64_t))) return -1;
+    return tcp_stream_flush(stream);
 }
 
-ssize_t receive_ack(int sockfd) {
+ssize_t receive_ack(struct tcp_stream *stream) {
     char ack[sizeof(uint64_t)];
     uint64_t bytes_received;
 
-    int rv = expect_data(sockfd, ack, sizeof(uint64_t));
+    int rv = tcp_stream_expect(stream, ack, sizeof(uint64_t));
     if (rv < 0) return rv;
 
     read_u64(ack, &bytes_received);
@@ -5,6 +5,11 @@
 * Server implementing the echo protocol (RFC 862)
 * & using the TCP library & the serial library
 *
+* arg (optional) : service, port number or unix socket address for same-host clients
+*                  (e.g. unix:/tmp/serial.sock), or shared-memory address for
+*                  same-host clients exchanging through shared rings (e.g. shm:/tmp/serial.shm),
+*                  PORT by default
+*
 * RI 2020 - Laura Binacchi - Fedora 32
 ****************************************************************************************/
 
@@ -12,12 +17,16 @@
 #include <netdb.h>          // gai_strerror
 #include <signal.h>         // sigaction
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>       // WNOHANG
 #include <unistd.h>         // fork
 
 #include "constants.h"
 #include "data.h"
+#include "tcp-shm.h"
 #include "tcp-util.h"
+#include "tcp-stream.h"
 
 #define BACKLOG 10  // amount of pending connections allowed
 
@@ -29,20 +38,57 @@ void sigchld_handler(int s) {
     errno = saved_errno;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     int sockfd, newfd;                  // listen on sockfd, new connection on newfd
+    struct tcp_stream *stream;          // buffered stream over the new connection
     char client_ip[INET6_ADDRSTRLEN];   // string containing a human readable ip address of the client
     struct data_node *node;             // data linked list received
     uint16_t list_size;                 // number of nodes contained in the data list
     ssize_t bytes_received;             // amount of bytes received
     struct sigaction sa;
+    int *sockfds;                       // listening sockets (one per acceptor)
+    long acceptors;                     // number of acceptor processes (one per core)
+    long i, acceptor;
+    int rv;
+    struct tcp_options opts = {         // the list is sent in small frames,
+        .nodelay = 1,                   // its start may come with the SYN (Fast Open),
+        .fastopen = FASTOPEN_QLEN,      // the acceptor only wakes up once it has come
+        .defer_accept = DEFER_ACCEPT
+    };
+    struct tcp_accepted accepted[ACCEPT_BATCH];  // connections taken from the backlog
+    int count, conn, other;
+    char *service = argc > 1 ? argv[1] : PORT;  // port number or unix socket address
+    int shm_mode;                       // 1 if the clients exchange through shared memory
+    struct tcp_shm *shm = NULL;         // shared-memory connection in shm mode
     
-    // open a passive connection
-    if ((sockfd = server_listen(PORT, BACKLOG)) < 0) {
-        if (sockfd == -1) fprintf(stderr, "[server] creating the socket: %s\n", gai_strerror(errno));
-        else if (sockfd == -2) perror("[server] overriding socket options");
-        else if (sockfd == -3) perror("[server] binding\n");
-        else if (sockfd == -4) perror("[server] listening");
+    acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+    sockfds = malloc(acceptors * sizeof(int));
+    if (sockfds == NULL) {
+        perror("[server] allocating the listeners");
+        return 1;
+    }
+
+    // open a passive connection per core (SO_REUSEPORT shards),
+    // or a rendezvous socket shared by the acceptors in shm mode
+    shm_mode = !strncmp(service, TCP_SHM_PREFIX, strlen(TCP_SHM_PREFIX));
+    if (shm_mode) {
+        rv = sockfds[0] = shm_listen(service, BACKLOG);
+        for (i = 1; rv >= 0 && i < acceptors; i++) {
+            if ((sockfds[i] = dup(sockfds[0])) < 0) {
+                perror("[server] sharing the rendezvous socket");
+                while (i-- > 0) close(sockfds[i]);
+                return 1;
+            }
+        }
+    } else {
+        rv = server_listen_sharded(service, BACKLOG, acceptors, &opts, sockfds);
+    }
+
+    if (rv < 0) {
+        if (rv == -1) fprintf(stderr, "[server] creating the socket: %s\n", gai_strerror(errno));
+        else if (rv == -2) perror("[server] overriding socket options");
+        else if (rv == -3) perror("[server] binding\n");
+        else if (rv == -4) perror("[server] listening");
         return 1;
     }
 
@@ -57,46 +103,104 @@ int main() {
         return 1;
     }
 
+    // one acceptor per core, pinned to it with its own listening socket:
+    // the connection children inherit the affinity (the parent is the first acceptor)
+    acceptor = 0;
+    for (i = 1; i < acceptors; i++) {
+        if (!fork()) {
+            acceptor = i;
+            break;
+        }
+    }
+
+    if (tcp_pin_cpu(acceptor)) {
+        perror("[server] pinning the acceptor");
+    }
+
+    for (i = 0; i < acceptors; i++) {
+        if (i != acceptor) disconnect(sockfds[i]);
+    }
+    sockfd = sockfds[acceptor];
+    free(sockfds);
+
     printf("[server] waiting for connections...\n");
 
     while(1) {
-        // get a new socket file descriptor for the incoming connection
-        newfd = server_accept(sockfd, client_ip);
-        if (newfd < 0) {
+        // take the incoming connections queued (at least one)
+        count = server_accept_batch(sockfd, accepted, ACCEPT_BATCH, SOCK_CLOEXEC, -1);
+        if (count < 0) {
             perror("[server] accepting incoming connection");
             continue;
         }
 
-        printf("[server] connection received from %s...\n", client_ip);
-        
-        // open a child process
-        if (!fork()) {
-            disconnect(sockfd); // child doesn't need the listener
-
-            // receive the data list
-            bytes_received = receive_list(newfd, &node, &list_size);
-
-            // stop if an error occured
-            if (bytes_received < 0) {
-                perror("[server] receiving data");
-                disconnect(newfd);
-                return 1;
-            }
-
-            // send back an acknowledgement to the client
-            if (send_ack(newfd, bytes_received)) {
-                perror("[server] sending acknowledgement");
+        for (conn = 0; conn < count; conn++) {
+            newfd = accepted[conn].fd;
+            server_accepted_ip(&accepted[conn], client_ip);
+
+            printf("[server] connection received from %s%s...\n", client_ip,
+                        tcp_fastopen_used(newfd) == 1 ? " (TCP Fast Open)" : "");
+            
+            // open a child process
+            if (!fork()) {
+                disconnect(sockfd); // child doesn't need the listener
+
+                // nor the connections accepted in the same batch after its own
+                for (other = conn + 1; other < count; other++) disconnect(accepted[other].fd);
+
+                if (shm_mode) {
+                    // the connection socket is owned by the shared-memory connection
+                    shm = shm_attach(newfd);
+                    if (shm == NULL) {
+                        perror("[server] attaching the shared memory");
+                        return 1;
+                    }
+                    stream = shm_stream_open(shm, 0);
+                } else {
+                    stream = tcp_stream_open(newfd, 0);
+                }
+
+                if (stream == NULL) {
+                    perror("[server] creating the stream");
+                    if (shm_mode) shm_close(shm);
+                    else disconnect(newfd);
+                    return 1;
+                }
+
+                // a stalled or slow client can not hold the process longer than the session
+                tcp_stream_set_deadline(stream, tcp_deadline(SESSION_TIMEOUT));
+
+                // receive the data list
+                bytes_received = receive_list(stream, &node, &list_size);
+
+                // stop if an error occured
+                if (bytes_received < 0) {
+                    perror("[server] receiving data");
+                    tcp_stream_free(stream);
+                    if (shm_mode) shm_close(shm);
+                    else disconnect(newfd);
+                    return 1;
+                }
+
+                // send back an acknowledgement to the client
+                if (send_ack(stream, bytes_received)) {
+                    perror("[server] sending acknowledgement");
+                }
+
+                // print the data received
+                printf("[server:%s]\t%u nodes received (%ld bytes)\n",
+                            client_ip, list_size, bytes_received);
+                print_list(node, list_size);
+
+                // close the socket
+                printf("[server:%s] closing\n", client_ip);
+                tcp_stream_free(stream);
+                if (shm_mode) shm_close(shm);
+                else disconnect(newfd);
+                return 0;
             }
 
-            // print the data received
-            printf("[server:%s]\t%u nodes received (%ld bytes)\n",
-                        client_ip, list_size, bytes_received);
-            print_list(node, list_size);
-
-            // close the socket
-            printf("[server:%s] closing\n", client_ip);
+            // the child serves the connection
             disconnect(newfd);
-            return 0;
         }
     }
 
@@ -0,0 +1,88 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Buffer pool shared by the connections: the I/O buffers (stream buffers, frames...)
+ * are rounded up to a size class (power of 2) & given back to the pool once used
+ *
+ * Each thread keeps a few free buffers per class, used without lock, the others are kept
+ * in shared lists, then returned to the system
+ * The large classes are mapped separately & can be backed by transparent huge pages
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+
+#define TCP_BUFPOOL_MIN_SHIFT   10      // smallest class: 1 KiB
+#define TCP_BUFPOOL_MAX_SHIFT   22      // largest class: 4 MiB, larger buffers are not pooled
+#define TCP_BUFPOOL_CLASSES     (TCP_BUFPOOL_MAX_SHIFT - TCP_BUFPOOL_MIN_SHIFT + 1)
+#define TCP_BUFPOOL_HUGE_SIZE   (2 << 20)   // classes mapped separately (huge page size)
+
+#define TCP_BUFPOOL_THREAD_CACHE    4   // free buffers kept per class by each thread by default
+#define TCP_BUFPOOL_SHARED_CACHE    64  // free buffers kept per class in the shared lists
+
+/** Pool tuning (see tcp_bufpool_configure) */
+struct tcp_bufpool_options {
+    int thread_cache;   // free buffers kept per class by each thread
+    int shared_cache;   // free buffers kept per class in the shared lists
+    int hugepages;      // 1 to back the classes >= TCP_BUFPOOL_HUGE_SIZE by huge pages
+};
+
+/** Counters of a size class */
+struct tcp_bufpool_class_stats {
+    unsigned long gets;             // buffers handed out
+    unsigned long thread_hits;      // served from the cache of the thread
+    unsigned long shared_hits;      // served from the shared lists
+    unsigned long allocs;           // allocated from the system
+    unsigned long releases;         // returned to the system
+    unsigned long in_use;           // handed out & not given back yet
+    unsigned long peak_in_use;      // highest in_use seen
+    unsigned long cached;           // free buffers kept (threads & shared lists)
+};
+
+/** Pool counters */
+struct tcp_bufpool_stats {
+    struct tcp_bufpool_class_stats classes[TCP_BUFPOOL_CLASSES];   // class i: 1 KiB << i
+    unsigned long oversize;         // buffers larger than the largest class (not pooled)
+    unsigned long huge_advised;     // mappings advised to use huge pages
+};
+
+/**
+ * Gets a buffer from the pool
+ *
+ * @param size: amount of bytes needed
+ * @param out_cap: returned size of the buffer (size rounded up to its class),
+ *      to give back with the buffer
+ *
+ * @return the buffer, NULL if an error occured (errno is set)
+ */
+void *tcp_buf_get(size_t size, size_t *out_cap);
+
+/**
+ * Gives a buffer back to the pool
+ *
+ * @param buf: buffer returned by tcp_buf_get, NULL is ignored
+ * @param cap: size of the buffer returned by tcp_buf_get
+ */
+void tcp_buf_put(void *buf, size_t cap);
+
+/**
+ * Tunes the pool (the buffers already cached above the new limits are kept until used)
+ *
+ * @param opts: pool tuning, NULL to restore the defaults
+ */
+void tcp_bufpool_configure(const struct tcp_bufpool_options *opts);
+
+/**
+ * Returns the free buffers of the shared lists & of the calling thread to the system
+ */
+void tcp_bufpool_trim(void);
+
+/**
+ * Gets a snapshot of the pool counters
+ *
+ * @param out_stats: returned counters
+ */
+void tcp_bufpool_snapshot(struct tcp_bufpool_stats *out_stats);
@@ -0,0 +1,90 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Coroutine scheduler for the TCP library: sequential protocol code
+ * (send_data, expect_data, the streams...) serves many connections in one thread
+ *
+ * Inside a coroutine, a library call which would block yields to the scheduler instead,
+ * the coroutine is resumed by an epoll loop once the socket is ready
+ * The connections are established blocking (client_connect), the shared-memory transport
+ * blocks the thread as well, a listening socket must be non-blocking to yield in accept
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+
+#include "tcp-util.h"
+
+#define CORO_STACK_SIZE     (256 * 1024)    // default stack size (reserved, not committed)
+#define CORO_MAX_EVENTS     256             // events fetched by each epoll_wait call
+
+struct coro_sched;
+
+/**
+ * Creates a scheduler, run by the thread calling coro_run
+ *
+ * @param stack_size: stack size of the coroutines, 0 to use CORO_STACK_SIZE
+ *
+ * @return the scheduler, NULL if an error occured (errno is set)
+ */
+struct coro_sched *coro_sched_create(size_t stack_size);
+
+/**
+ * Frees a scheduler which has no coroutine left
+ *
+ * @param sched: scheduler
+ */
+void coro_sched_destroy(struct coro_sched *sched);
+
+/**
+ * Creates a coroutine, started on the next turn of the scheduler
+ * Can be called from a coroutine of the same scheduler (e.g. an accepting loop)
+ *
+ * @param sched: scheduler
+ * @param fn: function run by the coroutine, the coroutine ends when it returns
+ * @param arg: argument given to the function
+ *
+ * @return either
+ *      0 if the coroutine has been created
+ *      -1 if an error occured
+ *      errno is set
+ */
+int coro_spawn(struct coro_sched *sched, void (*fn)(void *), void *arg);
+
+/**
+ * Runs the coroutines until they have all returned
+ *
+ * @param sched: scheduler
+ *
+ * @return either
+ *      0 if all the coroutines have returned
+ *      -1 if an error occured
+ *      errno is set
+ */
+int coro_run(struct coro_sched *sched);
+
+/**
+ * Gets the scheduler running the calling coroutine
+ *
+ * @return the scheduler, NULL if not called from a coroutine
+ */
+struct coro_sched *coro_self(void);
+
+/**
+ * Lets the other ready coroutines run before resuming the calling one
+ * (no effect outside a coroutine)
+ */
+void coro_yield(void);
+
+/**
+ * Suspends the calling coroutine for a while, the others keep running
+ * (outside a coroutine, the thread sleeps)
+ *
+ * @param timeout_ms: time to sleep in milliseconds
+ *
+ * @return 0 once the time has passed, -1 if an error occured (errno is set)
+ */
+int coro_sleep(int timeout_ms);
@@ -0,0 +1,78 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Fan-out queries: many (host, service) targets are resolved, connected, sent a request
+ * & read concurrently by a single call bounded by a global deadline
+ *
+ * The resolutions run in a few threads (through the resolver cache), the connections
+ * are driven by an epoll loop in the calling thread: the sweep lasts about as long
+ * as its slowest target instead of the sum of them
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <netinet/in.h>
+#include <stddef.h>
+
+#include "tcp-util.h"
+
+#define TCP_FANOUT_MAX_INFLIGHT 256     // connections open at once by default
+#define TCP_FANOUT_RESOLVERS    8       // resolution threads by default
+
+/** Target of a fan-out query & its result */
+struct tcp_fanout_target {
+    /* input */
+    char *host;                 // host name or ip address
+    char *service;              // port number or service name
+    const char *request;        // sent once connected, NULL to send nothing (e.g. daytime)
+    size_t request_len;         // request length
+    size_t expect;              // bytes of response awaited, 0 to read until the peer closes
+
+    /* result */
+    int status;                 // 0 if the response has been received, otherwise
+                                // ERR_TCP_CREATE_SOCK (resolution or socket),
+                                // ERR_TCP_ACTIVE_CONNECT, ERR_TCP_PEER_CLOSED (before
+                                // the expected response), ERR_TCP_RECV_DATA (request
+                                // or response failed) or ERR_TCP_TIMEOUT
+    int error;                  // errno of the failure, getaddrinfo error if not resolved
+    char ip[INET6_ADDRSTRLEN];  // address connected to
+    char *response;             // response received (null-terminated), freed by tcp_fanout_free
+    size_t response_len;        // response length
+    long long resolve_us;       // time spent resolving the host
+    long long connect_us;       // time spent establishing the connection
+    long long response_us;      // time from the request sent to the end of the response
+};
+
+/** Fan-out tuning (NULL for the defaults) */
+struct tcp_fanout_options {
+    int max_inflight;           // connections open at once, 0 for TCP_FANOUT_MAX_INFLIGHT
+    int resolvers;              // resolution threads, 0 for TCP_FANOUT_RESOLVERS
+    size_t response_max;        // maximal response kept per target, 0 for TCP_BUF_SIZE
+};
+
+/**
+ * Queries all the targets concurrently: each one is resolved, connected (its addresses
+ * are tried in turn), sent its request & read until its response is complete
+ * A resolution already started is not interrupted by the deadline
+ *
+ * @param targets: targets, their results are filled
+ * @param count: amount of targets
+ * @param opts: tuning, NULL for the defaults
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait without limit
+ *
+ * @return either
+ *      the amount of targets which succeeded
+ *      -1 if the query could not be started (errno is set)
+ */
+int tcp_fanout(struct tcp_fanout_target *targets, int count,
+               const struct tcp_fanout_options *opts, long long deadline);
+
+/**
+ * Frees the responses of the targets
+ *
+ * @param targets: targets queried by tcp_fanout
+ * @param count: amount of targets
+ */
+void tcp_fanout_free(struct tcp_fanout_target *targets, int count);
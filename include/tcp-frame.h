@@ -0,0 +1,78 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Length-prefixed framed messages over a stream: each frame is sent prefixed
+ * by its size (4 bytes, big endian)
+ *
+ * The header is combined with the payload in the stream output buffer, or sent along
+ * with it in one system call: a batch of frames is sent by a single tcp_stream_flush
+ * The frames are received in a growable buffer reused from frame to frame,
+ * bounded by a maximal frame size & taken from the buffer pool (see tcp-bufpool.h)
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "tcp-stream.h"
+#include "tcp-util.h"
+
+#define TCP_FRAME_HEADER_SIZE   sizeof(uint32_t)    // size prefix of each frame
+#define TCP_FRAME_MAX_SIZE      (1 << 20)           // default maximal size of a received frame
+#define TCP_FRAME_IOV_MAX       (TCP_STREAM_IOV_MAX - 2)    // buffers gathered in a frame
+
+/** Receive buffer, kept between the frames & grown when a larger frame comes */
+struct tcp_frame_buf {
+    char *data;     // payload of the last frame received
+    size_t len;     // size of the last frame received
+    size_t cap;     // allocated memory
+};
+
+/**
+ * Writes a frame gathered from several buffers in the stream: the frame is only
+ * buffered or sent with the pending output, the batch is sent by tcp_stream_flush
+ *
+ * @param stream: stream
+ * @param iov: buffers containing the payload
+ * @param iovcnt: amount of buffers, at most TCP_FRAME_IOV_MAX
+ *
+ * @return either
+ *      0 if the frame has been buffered or sent
+ *      ERR_TCP_FRAME_TOO_LARGE if the payload is larger than TCP_FRAME_MAX_SIZE,
+ *          nothing is written (errno is set to EMSGSIZE)
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed
+ *      -1 if an error occured
+ *      errno is set
+ */
+int send_frame(struct tcp_stream *stream, const struct iovec *iov, int iovcnt);
+
+/**
+ * Receives a frame in a reused buffer, grown if the frame does not fit
+ *
+ * @param stream: stream
+ * @param buf: receive buffer, zero-initialized before the first frame
+ * @param max_size: maximal payload size accepted, 0 to use TCP_FRAME_MAX_SIZE
+ *
+ * @return either
+ *      the payload size (buf->data & buf->len are filled)
+ *      ERR_TCP_FRAME_TOO_LARGE if the frame announced is larger than max_size, the stream
+ *          is left in the middle of the frame (errno is set to EMSGSIZE)
+ *      ERR_TCP_PEER_CLOSED if the remote closed the connection in the middle of a frame
+ *          (errno is not set)
+ *      ERR_TCP_RECV_DATA if an eror occured while receiving the data (errno is set)
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed (errno is set to ETIMEDOUT)
+ *      -1 if the buffer could not be grown (errno is set)
+ */
+ssize_t recv_frame(struct tcp_stream *stream, struct tcp_frame_buf *buf, size_t max_size);
+
+/**
+ * Gives the memory of a receive buffer back to the pool (it can be used again afterwards)
+ *
+ * @param buf: receive buffer
+ */
+void tcp_frame_buf_free(struct tcp_frame_buf *buf);
@@ -0,0 +1,71 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Listening socket handoff for restarts without downtime: the running server passes
+ * its listening sockets to the new instance over a unix socket (SCM_RIGHTS)
+ *
+ * The sockets stay open during the whole handoff: the connections arriving meanwhile
+ * wait in the backlog shared by both processes instead of being refused
+ * Once the new instance has acknowledged the sockets, the old one stops accepting,
+ * closes its copies & finishes serving its clients
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include "tcp-util.h"
+
+#define TCP_HANDOFF_MAX_FDS     64      // listening sockets passed at once
+
+/**
+ * Opens the handoff socket of a running server, on which a new instance asks
+ * for the listening sockets
+ *
+ * @param address: unix socket address ("unix:/path" or "unix:@name"), a socket file left
+ *      by the previous instance is replaced
+ *
+ * @return either
+ *      handoff socket file descriptor, readable when a new instance asks for the sockets
+ *      an error code returned by server_listen
+ */
+int server_handoff_listen(char *address);
+
+/**
+ * Passes the listening sockets to the new instance connecting on the handoff socket
+ * The caller keeps accepting until it returns, then stops & closes its copies
+ * (once taken over, the handoff socket refuses the connections: the new instance
+ * binds its address in turn)
+ *
+ * @param handoff_fd: handoff socket file descriptor
+ * @param fds: listening sockets to pass
+ * @param count: amount of sockets, at most TCP_HANDOFF_MAX_FDS
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait without limit
+ *
+ * @return either
+ *      0 if the new instance has taken the sockets over
+ *      ERR_TCP_PEER_CLOSED if the new instance left before acknowledging them
+ *          (the caller keeps serving, errno is not set)
+ *      ERR_TCP_TIMEOUT if the deadline has passed (errno is set to ETIMEDOUT)
+ *      -1 if an error occured (errno is set)
+ */
+int server_handoff(int handoff_fd, const int *fds, int count, long long deadline);
+
+/**
+ * Takes the listening sockets of the running server over
+ *
+ * @param address: handoff socket address of the running server
+ * @param out_fds: returned listening sockets (close-on-exec)
+ * @param max: amount of sockets the array can hold
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait without limit
+ *
+ * @return either
+ *      the amount of listening sockets taken over
+ *      ERR_TCP_ACTIVE_CONNECT if no server is running at that address
+ *          (ENOENT or ECONNREFUSED: the caller listens itself)
+ *      ERR_TCP_PEER_CLOSED if the server left before passing its sockets (errno is not set)
+ *      ERR_TCP_TIMEOUT if the deadline has passed (errno is set to ETIMEDOUT)
+ *      -1 if an error occured (EPROTO if the server did not pass listening sockets)
+ *      errno is set
+ */
+int server_takeover(char *address, int *out_fds, int max, long long deadline);
@@ -0,0 +1,76 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Keep-alive connection pool: idle established connections are reused
+ * per (host, service) by protocols running several exchanges on a connection
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include "tcp-util.h"
+
+#define TCP_POOL_MAX_IDLE       4       // idle connections kept per peer by default
+#define TCP_POOL_IDLE_TIMEOUT   30000   // ms an idle connection is kept by default
+
+struct tcp_pool;
+
+/** Pool counters */
+struct tcp_pool_stats {
+    unsigned long reused;           // connections handed out from the idle ones
+    unsigned long created;          // new connections opened
+    unsigned long closed_dead;      // idle connections found closed or unusable
+    unsigned long closed_expired;   // idle connections kept longer than the timeout
+    unsigned long closed_overflow;  // released connections above the idle limit
+};
+
+/**
+ * Creates a connection pool
+ *
+ * @param max_idle: idle connections kept per (host, service), 0 to use TCP_POOL_MAX_IDLE
+ * @param idle_timeout_ms: ms an idle connection is kept, 0 to use TCP_POOL_IDLE_TIMEOUT
+ *
+ * @return the pool, NULL if an error occured (errno is set)
+ */
+struct tcp_pool *pool_create(int max_idle, int idle_timeout_ms);
+
+/**
+ * Closes the idle connections & frees the pool
+ * (the connections handed out are not closed)
+ *
+ * @param pool: pool to free
+ */
+void pool_destroy(struct tcp_pool *pool);
+
+/**
+ * Gets a connection to a server: the most recently released idle connection
+ * still alive (no end of stream, no unread data), otherwise a new connection
+ *
+ * @param pool: pool
+ * @param host: url or ip address separated by dots
+ * @param service: port number or service
+ *
+ * @return either
+ *      socket file descriptor, to give back with pool_release
+ *      an error code returned by client_connect_timeout
+ */
+int pool_get(struct tcp_pool *pool, char *host, char *service);
+
+/**
+ * Gives back a connection obtained with pool_get
+ *
+ * @param pool: pool
+ * @param sockfd: socket file descriptor
+ * @param reusable: 1 if the exchange is complete & the connection can be reused,
+ *      0 to close it (error, protocol state unknown)
+ */
+void pool_release(struct tcp_pool *pool, int sockfd, int reusable);
+
+/**
+ * Gets the pool counters
+ *
+ * @param pool: pool
+ * @param out_stats: returned counters
+ */
+void pool_get_stats(struct tcp_pool *pool, struct tcp_pool_stats *out_stats);
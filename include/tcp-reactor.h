@@ -0,0 +1,188 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Event-driven connection reactor (edge-triggered epoll) for the TCP library:
+ * one process serves many non-blocking connections through callbacks
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <netinet/in.h>     // INET6_ADDRSTRLEN
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "tcp-util.h"
+
+#define REACTOR_MAX_EVENTS      256         // events fetched by each epoll_wait call
+#define REACTOR_MAX_PENDING     (1 << 20)   // buffered output above which reads are paused
+#define REACTOR_ACCEPT_BATCH    64          // connections taken by each accept batch
+
+struct reactor;
+
+/** Connection managed by the reactor */
+struct reactor_conn {
+    int fd;                         // non-blocking connection socket file descriptor
+    char ip[INET6_ADDRSTRLEN];      // human readable address of the remote host
+                                    // (empty until conn_peer formats it)
+    void *user;                     // user state, owned by the callbacks
+    struct reactor *reactor;        // reactor managing the connection
+
+    /* private: managed by the reactor */
+    char *out_buf;                  // output not accepted by the kernel yet
+    size_t out_off;                 // offset of the first byte to send in out_buf
+    size_t out_len;                 // end of the data to send in out_buf
+    size_t out_cap;                 // allocated size of out_buf
+    int listener;                   // 1 if the socket is a listening socket
+    int readable;                   // 1 until a read returned EAGAIN since the last edge
+    int closing;                    // 1 if the connection has to be closed
+    struct sockaddr_storage peer;   // address of an accepted connection, formatted on demand
+    struct reactor_conn *prev;      // connections list used to release them all
+    struct reactor_conn *next;
+};
+
+/**
+ * Callbacks called by the reactor, a NULL callback is ignored
+ *
+ * on_read is called on each readable edge and must read until conn_read returns
+ * ERR_TCP_WOULD_BLOCK or conn_pending reaches REACTOR_MAX_PENDING: the events being
+ * edge-triggered, data left in the socket would not be notified again
+ * (a paused connection is resumed when its output has been flushed)
+ *
+ * on_open, on_read & on_write return 0 to keep the connection, < 0 to close it
+ */
+struct reactor_handlers {
+    int (*on_open)(struct reactor_conn *conn);  // new connection accepted
+    int (*on_read)(struct reactor_conn *conn);  // data (or end of stream) to read
+    int (*on_write)(struct reactor_conn *conn); // writable with no output left buffered
+    void (*on_close)(struct reactor_conn *conn);// connection about to be closed
+};
+
+/**
+ * Creates a reactor
+ *
+ * @param handlers: callbacks called on the connections events
+ * @param ctx: user context, available through reactor_ctx
+ *
+ * @return the reactor, NULL if an error occured (errno is set)
+ */
+struct reactor *reactor_create(const struct reactor_handlers *handlers, void *ctx);
+
+/**
+ * Gets the user context given on the reactor creation
+ *
+ * @param reactor: reactor
+ *
+ * @return the user context
+ */
+void *reactor_ctx(struct reactor *reactor);
+
+/**
+ * Registers a listening socket: incoming connections are accepted by the reactor
+ * The socket may be shared by several reactors (in several processes),
+ * a connection then only wakes up one of them
+ *
+ * @param reactor: reactor
+ * @param sockfd: listening socket file descriptor (made non-blocking)
+ *
+ * @return either
+ *      0 if the socket has been registered
+ *      -1 if an error occured
+ *      errno is set
+ */
+int reactor_add_listener(struct reactor *reactor, int sockfd);
+
+/**
+ * Registers a connected socket (on_open is not called)
+ *
+ * @param reactor: reactor
+ * @param sockfd: connection socket file descriptor (made non-blocking)
+ * @param ip: human readable address of the remote host, can be NULL
+ *
+ * @return the connection, NULL if an error occured (errno is set)
+ */
+struct reactor_conn *reactor_add(struct reactor *reactor, int sockfd, char *ip);
+
+/**
+ * Runs the event loop until reactor_stop is called
+ *
+ * @param reactor: reactor
+ *
+ * @return either
+ *      0 if the reactor has been stopped
+ *      -1 if an error occured
+ *      errno is set
+ */
+int reactor_run(struct reactor *reactor);
+
+/**
+ * Stops the event loop after the events being processed
+ *
+ * @param reactor: reactor
+ */
+void reactor_stop(struct reactor *reactor);
+
+/**
+ * Closes all the connections & frees the reactor
+ * (the listening sockets are not closed)
+ *
+ * @param reactor: reactor
+ */
+void reactor_destroy(struct reactor *reactor);
+
+/**
+ * Reads the data available on a connection without blocking
+ *
+ * @param conn: connection
+ * @param out_buffer: returned buffer containing the data
+ * @param max_length: total allocated memory available for the buffer
+ *
+ * @return either
+ *      the amount of bytes received
+ *      0 if the remote host has closed the connection
+ *      ERR_TCP_WOULD_BLOCK if no data is available
+ *      -1 if an error occured (errno is set)
+ */
+ssize_t conn_read(struct reactor_conn *conn, char *out_buffer, ssize_t max_length);
+
+/**
+ * Sends data on a connection without blocking:
+ * the data the kernel can not accept yet is buffered and flushed by the reactor
+ *
+ * @param conn: connection
+ * @param buffer: buffer containing the data
+ * @param length: buffer length
+ *
+ * @return either
+ *      0 if the data has been sent or buffered
+ *      -1 if an error occured
+ *      errno is set
+ */
+int conn_write(struct reactor_conn *conn, char *buffer, ssize_t length);
+
+/**
+ * Gets the amount of output waiting to be flushed
+ *
+ * @param conn: connection
+ *
+ * @return the amount of bytes buffered
+ */
+size_t conn_pending(struct reactor_conn *conn);
+
+/**
+ * Gets the address of the remote host, formatted on the first call
+ * (the accepted connections are not formatted unless asked)
+ *
+ * @param conn: connection
+ *
+ * @return the human readable address, empty if unknown
+ */
+const char *conn_peer(struct reactor_conn *conn);
+
+/**
+ * Closes the connection once the current callback has returned
+ *
+ * @param conn: connection
+ */
+void conn_close(struct reactor_conn *conn);
@@ -0,0 +1,94 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Traffic recording: the data sent & received through the lib (send_data, receive_data,
+ * expect_data, their variants & the streams) is appended to a file with its timing,
+ * to be replayed later against a server as a benchmark workload (see bench/tcp-replay)
+ *
+ * Started with tcp_record_start or, without changing the program, by setting
+ * the TCP_RECORD environment variable to the file path. The children forked afterwards
+ * keep recording to the same file. The connections of tcp-reactor, tcp-fanout
+ * & tcp-zerocopy (raw system calls) are not recorded. A failed write (e.g. disk full)
+ * disables the recording of the process, the file ends with its last complete record
+ * (it stays open until tcp_record_stop)
+ *
+ * File format (integers big-endian):
+ *      header:  magic (u32 TCP_RECORD_MAGIC) | version (u16) | reserved (u16)
+ *      records: time (u64 us, monotonic clock) | pid (u32) | socket (u32)
+ *               | type (u8) | length (u32) | data (length bytes, sends only)
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+
+#include "tcp-util.h"
+
+#define TCP_RECORD_MAGIC        0x54435052  // "TCPR"
+#define TCP_RECORD_VERSION      1
+#define TCP_RECORD_FILE_HEADER  8           // bytes of the file header
+#define TCP_RECORD_HEADER       21          // bytes of a record header
+
+/** Kind of record */
+enum tcp_record_type {
+    TCP_RECORD_SEND,            // data sent (kept in the file)
+    TCP_RECORD_RECV,            // data received (only its length is kept)
+    TCP_RECORD_CLOSE            // connection closed with disconnect
+};
+
+/** Record read from a file */
+struct tcp_record {
+    long long time_us;          // time of the system call (monotonic clock)
+    unsigned int pid;           // process which issued it
+    int sockfd;                 // socket in that process, a connection lasts until its close
+    enum tcp_record_type type;
+    size_t length;              // bytes sent or received
+    const char *data;           // data sent, NULL otherwise (points in the loaded file)
+};
+
+/** Recording loaded by tcp_record_load */
+struct tcp_recording {
+    struct tcp_record *records; // records in the order they were written
+    size_t count;               // amount of records
+    char *raw;                  // file content
+};
+
+/**
+ * Starts recording the traffic of the process (and of its future children)
+ * The records are appended if the file already exists
+ *
+ * @param path: recording file path
+ *
+ * @return either
+ *      0 if the recording has started
+ *      -1 if an error occured (EBUSY if already recording, even if the recording has
+ *          failed, EPROTO if the file is not a recording), errno is set
+ */
+int tcp_record_start(const char *path);
+
+/**
+ * Stops recording the traffic of the process & closes the file
+ * (once no other thread sends or receives through the lib: it may be writing a record)
+ */
+void tcp_record_stop(void);
+
+/**
+ * Loads a recording
+ *
+ * @param path: recording file path
+ * @param out_recording: returned records, freed with tcp_record_free
+ *
+ * @return either
+ *      0 if the recording has been loaded (a record cut by the end of the file is dropped)
+ *      -1 if an error occured (EPROTO if the file is not a recording), errno is set
+ */
+int tcp_record_load(const char *path, struct tcp_recording *out_recording);
+
+/**
+ * Frees a loaded recording
+ *
+ * @param recording: recording loaded by tcp_record_load
+ */
+void tcp_record_free(struct tcp_recording *recording);
@@ -0,0 +1,134 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Shared-memory transport for co-located processes: two single-producer single-consumer
+ * rings in a memfd shared over a unix socket rendezvous (SCM_RIGHTS)
+ *
+ * The data is copied once into the ring & once out of it, without system call
+ * while the peer keeps up: the eventfd wakeups are only signalled to a waiting peer
+ * The rendezvous socket stays open to detect the death of the peer
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "tcp-stream.h"
+#include "tcp-util.h"
+
+#define TCP_SHM_PREFIX      "shm:"          // shared-memory address: "shm:/path" or "shm:@name"
+#define TCP_SHM_RING_SIZE   (4 << 20)       // default size of each ring (power of 2)
+#define TCP_SHM_MAX_RING    (1 << 30)       // largest ring accepted on both sides
+
+struct tcp_shm;
+
+/**
+ * Opens the rendezvous socket of a shared-memory server
+ *
+ * @param address: shared-memory address ("shm:/path", "shm:@name" for an abstract name)
+ * @param backlog: amount of pending connections allowed
+ *
+ * @return either
+ *      listening socket file descriptor, whose connections are accepted with server_accept
+ *          then attached with shm_attach
+ *      an error code returned by server_listen
+ */
+int shm_listen(char *address, int backlog);
+
+/**
+ * Connects to a shared-memory server: creates the rings & sends them to the server
+ *
+ * @param address: shared-memory address of the server ("shm:/path" or "shm:@name")
+ * @param ring_size: size of each ring, rounded up to a power of 2,
+ *      0 to use TCP_SHM_RING_SIZE, at most TCP_SHM_MAX_RING
+ *
+ * @return the connection, NULL if an error occured (EINVAL if the ring is too large),
+ *      errno is set
+ */
+struct tcp_shm *shm_connect(char *address, size_t ring_size);
+
+/**
+ * Attaches the rings sent by a client on a connection accepted on the rendezvous socket
+ *
+ * @param sockfd: connection socket file descriptor, owned by the connection
+ *      (closed as well if an error occured)
+ *
+ * @return the connection, NULL if an error occured (errno is set)
+ */
+struct tcp_shm *shm_attach(int sockfd);
+
+/**
+ * Closes the connection: the peer reads the end of the stream once it has read the data
+ *
+ * @param shm: connection to close
+ */
+void shm_close(struct tcp_shm *shm);
+
+/**
+ * Bounds the following sends & receives by an absolute deadline
+ *
+ * @param shm: connection
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to remove it
+ */
+void shm_set_deadline(struct tcp_shm *shm, long long deadline);
+
+/**
+ * Sends data to the peer, waits while its ring is full
+ *
+ * @param shm: connection
+ * @param buffer: buffer containing the data
+ * @param length: buffer length
+ *
+ * @return either
+ *      0 if all bytes have been sent
+ *      ERR_TCP_TIMEOUT if the deadline has passed
+ *      -1 if an error occured (EPIPE if the peer is gone)
+ *      errno is set
+ */
+int shm_send(struct tcp_shm *shm, char *buffer, ssize_t length);
+
+/**
+ * Receives the data available, waits until some data is available
+ *
+ * @param shm: connection
+ * @param out_buffer: returned buffer containing the data
+ * @param max_length: total allocated memory available for the buffer
+ *
+ * @return either
+ *      the amount of bytes received
+ *      0 if the peer has closed the connection
+ *      ERR_TCP_TIMEOUT if the deadline has passed
+ *      -1 if an error occured (errno is set)
+ */
+ssize_t shm_receive(struct tcp_shm *shm, char *out_buffer, ssize_t max_length);
+
+/**
+ * Expects a given amount of data from the peer
+ *
+ * @param shm: connection
+ * @param out_buffer: returned buffer containing the data
+ * @param length: blocks until that amount of bytes have been received
+ *
+ * @return either
+ *      0 if all the data expected have been received
+ *      ERR_TCP_PEER_CLOSED if the peer closed the connection before sending
+ *          the amount of bytes expected (errno is not set)
+ *      ERR_TCP_RECV_DATA if an eror occured while receiving the data (errno is set)
+ *      ERR_TCP_TIMEOUT if the deadline has passed
+ */
+int shm_expect(struct tcp_shm *shm, char *out_buffer, ssize_t length);
+
+/**
+ * Creates a buffered stream over the connection (see tcp-stream.h):
+ * the protocols written for the stream run unchanged over shared memory
+ * The stream deadline applies to the connection
+ *
+ * @param shm: connection, to close with shm_close after freeing the stream
+ * @param buf_size: size of each stream buffer, 0 to use TCP_STREAM_BUF_SIZE
+ *
+ * @return the stream, NULL if an error occured (errno is set)
+ */
+struct tcp_stream *shm_stream_open(struct tcp_shm *shm, size_t buf_size);
@@ -0,0 +1,67 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * TCP library instrumentation: per-process & per-socket counters of the data calls,
+ * the system calls they turned into & the time spent waiting in them
+ *
+ * Compiled in only when the library is built with TCP_STATS defined
+ * (make clean && make TCP_STATS=1), the hooks compile to nothing otherwise
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#define TCP_STATS_BUCKETS   24      // wait histogram buckets: bucket i counts waits < 2^i us
+#define TCP_STATS_MAX_FDS   1024    // sockets above this descriptor only count in the process
+
+/** Counters of one direction */
+struct tcp_io_stats {
+    unsigned long calls;            // library calls (send_data, expect_data...)
+    unsigned long syscalls;         // system calls issued by those calls
+    unsigned long bytes;            // bytes transferred
+    unsigned long short_ops;        // system calls transferring less than requested
+    unsigned long would_block;      // system calls returning EAGAIN (deadline variants)
+    unsigned long errors;           // system calls failing
+    unsigned long wait_hist[TCP_STATS_BUCKETS]; // time spent blocked per system call or poll
+                                                // (log2 of us, the last bucket has no limit)
+};
+
+/** Counters of a socket or of the process */
+struct tcp_stats {
+    struct tcp_io_stats send;       // send_data, send_datav & their deadline variants
+    struct tcp_io_stats recv;       // receive_data, expect_data(v) & the stream reads
+};
+
+/**
+ * Tells whether the instrumentation has been compiled in the library
+ *
+ * @return 1 if the counters are maintained, 0 otherwise
+ */
+int tcp_stats_enabled(void);
+
+/**
+ * Gets a snapshot of the counters
+ * The counters of a socket are reset when it is closed with disconnect
+ *
+ * @param sockfd: socket file descriptor, -1 for the whole process
+ * @param out_stats: returned counters
+ * @param reset: 1 to reset the counters once read
+ *
+ * @return either
+ *      0 if the counters have been read
+ *      -1 if an error occured: instrumentation not compiled in (ENOSYS)
+ *          or socket not tracked (EINVAL)
+ *      errno is set
+ */
+int tcp_stats_snapshot(int sockfd, struct tcp_stats *out_stats, int reset);
+
+/**
+ * Gets the wait time percentile estimated from a histogram (upper bound of its bucket)
+ *
+ * @param io: counters of one direction
+ * @param percentile: percentile wanted, between 0 & 100
+ *
+ * @return the upper bound of the bucket in us, 0 if nothing was recorded
+ */
+unsigned long tcp_stats_percentile(const struct tcp_io_stats *io, double percentile);
@@ -0,0 +1,207 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Buffered TCP stream: read-ahead ring buffer serving exact reads
+ * & write-combining buffer flushed explicitly
+ * The stream runs over a socket, or over any transport given as read & write operations
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "tcp-util.h"
+
+#define TCP_STREAM_BUF_SIZE     (64 * 1024)     // default size of each stream buffer
+#define TCP_STREAM_IOV_MAX      16              // buffers sent with the pending output at once
+
+struct tcp_stream;
+
+/** Transport operations of a stream (the deadline is the stream one) */
+struct tcp_stream_ops {
+    /**
+     * Reads the data available, blocks until some data is available
+     * @return the amount of bytes read, 0 at the end of the stream,
+     *      ERR_TCP_TIMEOUT if the deadline has passed, -1 if an error occured (errno is set)
+     */
+    ssize_t (*read)(struct tcp_stream *stream, struct iovec *iov, int iovcnt);
+
+    /**
+     * Writes all the data (the buffers may be modified)
+     * @return 0 if all the data has been written,
+     *      ERR_TCP_TIMEOUT if the deadline has passed, -1 if an error occured (errno is set)
+     */
+    int (*write)(struct tcp_stream *stream, struct iovec *iov, int iovcnt);
+};
+
+/** Buffered stream over a connected socket or another transport */
+struct tcp_stream {
+    int fd;             // connection socket file descriptor, -1 over another transport
+    void *transport;    // transport state (see tcp_stream_open_ops)
+    const struct tcp_stream_ops *ops;   // transport operations
+
+    /* private: read-ahead ring buffer */
+    char *rbuf;         // ring buffer memory
+    size_t rcap;        // ring buffer size
+    size_t rhead;       // offset of the first unread byte
+    size_t rlen;        // amount of unread bytes
+
+    /* private: write-combining buffer */
+    char *wbuf;         // pending output
+    size_t wcap;        // output buffer size
+    size_t wlen;        // amount of pending output
+
+    /* private: SO_RCVLOWAT tuning */
+    int tune_lowat;     // 1 if the low watermark follows the amount of data awaited
+    int lowat;          // current low watermark of the socket
+
+    /* private: I/O deadline */
+    long long deadline; // absolute deadline of all the I/O (see tcp_deadline), -1 if none
+};
+
+/**
+ * Creates a buffered stream over a connected socket
+ * The socket must then only be read & written through the stream
+ *
+ * @param sockfd: connection socket file descriptor
+ * @param buf_size: size of each buffer, 0 to use TCP_STREAM_BUF_SIZE
+ *      (rounded up to its class of the buffer pool, see tcp-bufpool.h)
+ *
+ * @return the stream, NULL if an error occured (errno is set)
+ */
+struct tcp_stream *tcp_stream_open(int sockfd, size_t buf_size);
+
+/**
+ * Creates a buffered stream over another transport than a socket
+ * (the SO_RCVLOWAT tuning is not available)
+ *
+ * @param ops: transport operations
+ * @param transport: transport state, available as stream->transport
+ * @param buf_size: size of each buffer, 0 to use TCP_STREAM_BUF_SIZE
+ *      (rounded up to its class of the buffer pool, see tcp-bufpool.h)
+ *
+ * @return the stream, NULL if an error occured (errno is set)
+ */
+struct tcp_stream *tcp_stream_open_ops(const struct tcp_stream_ops *ops, void *transport,
+                                        size_t buf_size);
+
+/**
+ * Frees the stream without flushing it (the socket or transport is not closed)
+ *
+ * @param stream: stream to free
+ */
+void tcp_stream_free(struct tcp_stream *stream);
+
+/**
+ * Expects a given amount of data: the data already read ahead is served first,
+ * then the socket is read by chunks as large as the ring buffer
+ *
+ * @param stream: stream
+ * @param out_buffer: returned buffer containing the data
+ * @param length: blocks until that amount of bytes have been received
+ *
+ * @return either
+ *      0 if all the data expected have been received
+ *      ERR_TCP_PEER_CLOSED if the remote closed the connection before sending
+ *          the amount of bytes expected (errno is not set)
+ *      ERR_TCP_RECV_DATA if an eror occured while receiving the data (errno is set)
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed (errno is set to ETIMEDOUT)
+ */
+int tcp_stream_expect(struct tcp_stream *stream, char *out_buffer, ssize_t length);
+
+/**
+ * Receives the data available: the data read ahead if any,
+ * otherwise blocks until some data is received
+ *
+ * @param stream: stream
+ * @param out_buffer: returned buffer containing the data
+ * @param max_length: total allocated memory available for the buffer
+ *
+ * @return either
+ *      the amount of bytes received
+ *      0 if the remote host has closed the connection
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed (errno is set to ETIMEDOUT)
+ *      -1 if an error occured (errno is set)
+ */
+ssize_t tcp_stream_receive(struct tcp_stream *stream, char *out_buffer, ssize_t max_length);
+
+/**
+ * Gets the amount of data read ahead & not consumed yet
+ *
+ * @param stream: stream
+ *
+ * @return the amount of bytes buffered
+ */
+size_t tcp_stream_buffered(struct tcp_stream *stream);
+
+/**
+ * Bounds all the following reads & writes of the stream by an absolute deadline:
+ * once it has passed, they fail with ERR_TCP_TIMEOUT
+ *
+ * @param stream: stream
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to remove it
+ */
+void tcp_stream_set_deadline(struct tcp_stream *stream, long long deadline);
+
+/**
+ * Enables the SO_RCVLOWAT tuning: while the ring buffer is empty, the socket
+ * only wakes the reader up once the whole awaited block (e.g. a header) is available
+ *
+ * @param stream: stream
+ * @param enable: 1 to enable the tuning, 0 to restore the default low watermark
+ *
+ * @return either
+ *      0 if the tuning has been changed
+ *      -1 if an error occured (ENOTSOCK over another transport)
+ *      errno is set
+ */
+int tcp_stream_tune_rcvlowat(struct tcp_stream *stream, int enable);
+
+/**
+ * Writes data in the stream: small writes are combined in the output buffer
+ * until it is full or flushed
+ *
+ * @param stream: stream
+ * @param buffer: buffer containing the data
+ * @param length: buffer length
+ *
+ * @return either
+ *      0 if the data has been buffered or sent
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed
+ *      -1 if an error occured
+ *      errno is set
+ */
+int tcp_stream_write(struct tcp_stream *stream, char *buffer, ssize_t length);
+
+/**
+ * Writes data gathered from several buffers in the stream: combined in the output
+ * buffer if it fits, otherwise sent along with the pending output in one system call
+ *
+ * @param stream: stream
+ * @param iov: buffers containing the data (modified when sent directly)
+ * @param iovcnt: amount of buffers
+ *
+ * @return either
+ *      0 if the data has been buffered or sent
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed
+ *      -1 if an error occured
+ *      errno is set
+ */
+int tcp_stream_writev(struct tcp_stream *stream, struct iovec *iov, int iovcnt);
+
+/**
+ * Sends all the buffered output
+ *
+ * @param stream: stream
+ *
+ * @return either
+ *      0 if all bytes have been sent
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed
+ *      -1 if an error occured
+ *      errno is set
+ */
+int tcp_stream_flush(struct tcp_stream *stream);
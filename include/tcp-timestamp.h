@@ -0,0 +1,91 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Kernel timestamps (SO_TIMESTAMPING): the time a segment reached the socket
+ * & the times the data sent left the stack or was acknowledged by the peer,
+ * to measure the network latency apart from the time spent in the application
+ *
+ * Software timestamps (no network card support needed), on the CLOCK_REALTIME clock
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "tcp-util.h"
+
+#define TCP_TS_RX       1       // timestamp the data received
+#define TCP_TS_TX       2       // report the times the data sent left the stack & was acked
+
+/** Kind of transmit timestamp */
+enum tcp_tx_kind {
+    TCP_TX_SCHED,               // entered the packet scheduler
+    TCP_TX_SENT,                // handed to the network device
+    TCP_TX_ACKED                // acknowledged by the peer (TCP only)
+};
+
+/** Transmit timestamp read from the error queue of a socket */
+struct tcp_tx_timestamp {
+    enum tcp_tx_kind kind;
+    unsigned int id;            // offset of the last byte of the send timestamped,
+                                // counted from the call to tcp_timestamping
+    struct timespec ts;         // kernel time (CLOCK_REALTIME)
+};
+
+/**
+ * Enables or disables the kernel timestamps of a socket
+ *
+ * @param sockfd: socket file descriptor
+ * @param flags: TCP_TS_RX and/or TCP_TS_TX, 0 to disable the timestamps
+ *
+ * @return either
+ *      0 if the timestamps have been enabled
+ *      -1 if an error occured (errno is set)
+ */
+int tcp_timestamping(int sockfd, int flags);
+
+/**
+ * Receives the data available with the time it reached the socket (see receive_data)
+ *
+ * @param sockfd: socket file descriptor, timestamping TCP_TS_RX
+ * @param out_buffer: returned buffer containing the data
+ * @param max_length: total allocated memory available for the buffer
+ * @param out_ts: returned kernel time of the data, zero if it was not timestamped
+ *
+ * @return either
+ *      the amount of bytes received
+ *      0 if the remote host has closed the connection
+ *      -1 if an error occured (errno is set)
+ */
+ssize_t receive_data_ts(int sockfd, char *out_buffer, ssize_t max_length,
+                        struct timespec *out_ts);
+
+/**
+ * Reads the transmit timestamps reported so far, waits for the first one if none is
+ *
+ * @param sockfd: socket file descriptor, timestamping TCP_TS_TX
+ * @param out_ts: returned timestamps, in the order they were reported
+ * @param max: amount of timestamps the array can hold
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait without limit,
+ *      0 not to wait
+ *
+ * @return either
+ *      the amount of timestamps read
+ *      ERR_TCP_WOULD_BLOCK if none is reported & the deadline is 0
+ *      ERR_TCP_TIMEOUT if none was reported before the deadline (errno is set to ETIMEDOUT)
+ *      -1 if an error occured (errno is set)
+ */
+int tcp_tx_timestamps(int sockfd, struct tcp_tx_timestamp *out_ts, int max, long long deadline);
+
+/**
+ * Computes the time elapsed between two timestamps
+ *
+ * @param from: earlier time
+ * @param to: later time
+ *
+ * @return the time elapsed in microseconds
+ */
+long long tcp_ts_elapsed_us(const struct timespec *from, const struct timespec *to);
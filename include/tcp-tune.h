@@ -0,0 +1,106 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Connection metrics sampled from the kernel (TCP_INFO) & socket buffer autotuning
+ * from the bandwidth-delay product measured during a bulk transfer
+ *
+ * The kernel defaults cap the data in flight at the size of the socket buffers:
+ * on a long fat pipe (high bandwidth & high rtt) the sender waits for the acks with
+ * an empty window. The autotuner grows the buffers to the measured BDP (never below what
+ * the kernel has already chosen, within net.core.wmem_max/rmem_max) & the chunks
+ * transferred per system call along with them; once it has resized a buffer,
+ * the kernel stops autotuning that buffer & the later samples keep it in step
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+
+#include "tcp-util.h"
+
+#define TCP_TUNE_SEND           1       // the connection mostly sends (SO_SNDBUF)
+#define TCP_TUNE_RECV           2       // the connection mostly receives (SO_RCVBUF)
+
+#define TCP_TUNE_INTERVAL_MS    50      // minimal time between two samples by default
+#define TCP_TUNE_MIN_CHUNK      (64 * 1024)         // chunk sizes by default
+#define TCP_TUNE_MAX_CHUNK      (4 * 1024 * 1024)
+#define TCP_TUNE_MAX_BUF        (64 * 1024 * 1024)  // socket buffer limit by default
+
+/** Connection metrics read from TCP_INFO */
+struct tcp_info_sample {
+    unsigned int rtt_us;                // smoothed round-trip time
+    unsigned int rttvar_us;             // round-trip time variation
+    unsigned int min_rtt_us;            // minimal round-trip time seen, 0 if not reported
+    unsigned int rcv_rtt_us;            // round-trip time estimated by the receiver
+    unsigned int snd_cwnd;              // congestion window in segments
+    unsigned int snd_mss;               // sender maximal segment size
+    unsigned int retransmits;           // segments retransmitted since the connection start
+    unsigned long long delivery_rate;   // bytes/s delivered to the peer, 0 if not reported
+    int app_limited;                    // 1 if the rate was limited by the application
+    unsigned long long bytes_acked;     // bytes sent & acknowledged by the peer
+    unsigned long long bytes_received;  // bytes received from the peer
+};
+
+/** Autotuner tuning (NULL for the defaults) */
+struct tcp_autotune_options {
+    int interval_ms;                    // minimal time between two samples (at least an rtt
+                                        // is waited), 0 for TCP_TUNE_INTERVAL_MS
+    size_t min_chunk;                   // chunk size before the first sample,
+                                        // 0 for TCP_TUNE_MIN_CHUNK
+    size_t max_chunk;                   // chunk size limit, 0 for TCP_TUNE_MAX_CHUNK
+    size_t max_buf;                     // socket buffer limit, 0 for TCP_TUNE_MAX_BUF
+};
+
+/** Autotuner state of a transfer */
+struct tcp_autotune {
+    int fd;                             // socket file descriptor
+    int dir;                            // TCP_TUNE_SEND or TCP_TUNE_RECV
+    struct tcp_autotune_options opts;   // tuning, defaults filled
+    size_t chunk;                       // bytes to transfer per system call
+    size_t buf;                         // current socket buffer size (as reported by the kernel)
+    size_t bdp;                         // last bandwidth-delay product measured in bytes
+    unsigned long long rate;            // last rate measured in bytes/s
+    unsigned int adjustments;           // times the socket buffer has been grown
+    struct tcp_info_sample last;        // previous sample
+    long long last_us;                  // time of the previous sample
+};
+
+/**
+ * Samples the connection metrics
+ *
+ * @param sockfd: connected socket file descriptor
+ * @param out_sample: returned metrics
+ *
+ * @return either
+ *      0 if the metrics have been read
+ *      -1 if an error occured (errno is set)
+ */
+int tcp_info_sample(int sockfd, struct tcp_info_sample *out_sample);
+
+/**
+ * Starts tuning a transfer: takes the first sample & the current buffer size
+ *
+ * @param tune: returned autotuner state
+ * @param sockfd: connected socket file descriptor
+ * @param dir: TCP_TUNE_SEND or TCP_TUNE_RECV
+ * @param opts: tuning, NULL for the defaults
+ *
+ * @return either
+ *      0 if the autotuner has been started
+ *      -1 if an error occured (errno is set)
+ */
+int tcp_autotune_init(struct tcp_autotune *tune, int sockfd, int dir,
+                      const struct tcp_autotune_options *opts);
+
+/**
+ * Samples the connection if the interval has passed & resizes the socket buffer &
+ * the chunk size from the bandwidth-delay product measured since the previous sample
+ * Called between the system calls of the transfer, cheap when no sample is due
+ *
+ * @param tune: autotuner state
+ *
+ * @return the amount of bytes to transfer per system call (tune->chunk)
+ */
+size_t tcp_autotune_step(struct tcp_autotune *tune);
@@ -5,10 +5,21 @@
  *
  * TCP/IP (v4 & v6) communication library
  *
+ * Same-host peers may use a unix domain socket instead, with the address
+ * "unix:/path" (stream) or "unixpacket:/path" (SOCK_SEQPACKET, message boundaries kept)
+ * given as url to client_connect & as service to server_listen
+ * ("unix:@name" uses the abstract namespace, no file is created)
+ * With "unixpacket:", each send is a message & a receive shorter than the message
+ * drops its end: the reader buffers (e.g. the stream buffer) must hold the largest message
+ *
  * RI 2020 - Laura Binacchi - Fedora 32
  ****************************************************************************************/
 
+#include <netdb.h>
+#include <poll.h>           // POLLIN, POLLOUT (wait_io)
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define TCP_BUF_SIZE          1024
 
@@ -19,28 +30,210 @@
 #define ERR_TCP_PASSIVE_CONNECT -5
 #define ERR_TCP_PEER_CLOSED     -6
 #define ERR_TCP_RECV_DATA       -7
+#define ERR_TCP_WOULD_BLOCK     -8
+#define ERR_TCP_TIMEOUT         -9
+#define ERR_TCP_FRAME_TOO_LARGE -10
+
+#define TCP_CONNECT_ATTEMPT_DELAY   250 // ms before racing the next address (RFC 8305)
+
+#define TCP_RESOLVER_CACHE_SIZE     64  // (host, service) resolutions kept in cache
+#define TCP_RESOLVER_TTL            60  // s a successful resolution is kept by default
+#define TCP_RESOLVER_NEGATIVE_TTL   5   // s a failed resolution is kept by default
+
+#define TCP_UNIX_PREFIX             "unix:"         // unix domain stream socket address
+#define TCP_UNIXPACKET_PREFIX       "unixpacket:"   // unix domain seqpacket socket address
+
+#define TCP_CA_NAME_MAX             16  // congestion control algorithm name size
+
+/**
+ * Socket tuning options: a field left to 0 (or an empty string) keeps the default
+ * (the TCP level options, nodelay & congestion, are ignored on a unix socket)
+ */
+struct tcp_options {
+    int nodelay;                        // 1 to send small segments at once (TCP_NODELAY)
+    int sndbuf;                         // send buffer size in bytes (SO_SNDBUF)
+    int rcvbuf;                         // receive buffer size in bytes (SO_RCVBUF)
+    char congestion[TCP_CA_NAME_MAX];   // congestion control algorithm (TCP_CONGESTION)
+    int connect_timeout_ms;             // client only: race the addresses with this deadline
+                                        // (see client_connect_timeout), < 0 without deadline,
+                                        // ignored with fastopen (mutually exclusive)
+    int fastopen;                       // TCP Fast Open (see tcp_fastopen_used)
+                                        // client: 1 to carry the first data sent in the SYN
+                                        // once the server cookie is known (TCP_FASTOPEN_CONNECT)
+                                        // server: length of the queue of the connections
+                                        // accepted with data in their SYN (TCP_FASTOPEN)
+    int defer_accept;                   // server only: wake the acceptor once the client has
+                                        // sent data, waiting up to this amount of seconds
+                                        // (TCP_DEFER_ACCEPT), for client-speaks-first protocols
+};
+
+/** Connection accepted by server_accept_batch */
+struct tcp_accepted {
+    int fd;                             // connection socket file descriptor
+    struct sockaddr_storage addr;       // address of the client (see server_accepted_ip)
+};
+
+/** Resolver cache counters */
+struct resolver_stats {
+    unsigned long hits;             // resolutions served from the cache
+    unsigned long negative_hits;    // failures served from the cache (counted in hits)
+    unsigned long misses;           // resolutions asked to getaddrinfo
+    unsigned long evictions;        // valid entries replaced to make room
+};
+
+/**
+ * Gets the IPv4 or IPv6 address
+ *
+ * @param *sa: sockaddr structure
+ *
+ * @return the pointer to the sockaddr_in (IPv4) or sockaddr_in6 (IPv6) address
+ */
+void *get_in_addr(struct sockaddr *sa);
+
+/**
+ * Switches a socket between blocking and non-blocking mode
+ *
+ * @param sockfd: socket file descriptor
+ * @param enable: 1 to make the socket non-blocking, 0 to make it blocking
+ *
+ * @return either
+ *      0 if the mode has been changed
+ *      -1 if an error occured
+ *      errno is set
+ */
+int set_nonblocking(int sockfd, int enable);
+
+/**
+ * Computes an absolute deadline for the *_deadline functions
+ *
+ * @param timeout_ms: ms from now, < 0 for no deadline
+ *
+ * @return the deadline (ms on the monotonic clock), -1 for no deadline
+ */
+long long tcp_deadline(int timeout_ms);
+
+/**
+ * Waits until a socket is ready or the deadline has passed
+ * (in a coroutine, the other coroutines run meanwhile: see tcp-coro.h)
+ *
+ * @param sockfd: socket file descriptor
+ * @param events: poll events awaited (POLLIN, POLLOUT)
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait indefinitely
+ *
+ * @return either
+ *      0 if the socket is ready (or has an error pending)
+ *      ERR_TCP_TIMEOUT if the deadline has passed (errno is set to ETIMEDOUT)
+ *      -1 if an error occured (errno is set)
+ */
+int wait_io(int sockfd, short events, long long deadline);
+
+/**
+ * Resolves a (host, service) pair for an active TCP connection through the cache:
+ * a resolution (or a definitive failure) is reused until its time to live expires
+ * Used by client_connect & client_connect_timeout
+ *
+ * @param host: url or ip address separated by dots
+ * @param service: port number or service
+ * @param out_info: returned copy of the addresses, to free with resolve_free
+ *
+ * @return 0 if the host was resolved, the getaddrinfo error code otherwise
+ */
+int resolve_cached(char *host, char *service, struct addrinfo **out_info);
+
+/**
+ * Frees a list of addresses returned by resolve_cached
+ *
+ * @param info: addresses list
+ */
+void resolve_free(struct addrinfo *info);
+
+/**
+ * Sets the time to live of the cache entries
+ *
+ * @param ttl: seconds a successful resolution is kept, 0 disables the cache
+ * @param negative_ttl: seconds a failed resolution is kept, 0 disables the negative cache
+ */
+void resolver_configure(int ttl, int negative_ttl);
+
+/**
+ * Invalidates cache entries
+ *
+ * @param host: host of the entries to invalidate, NULL for all the hosts
+ * @param service: service of the entries to invalidate, NULL for all the services
+ */
+void resolver_invalidate(char *host, char *service);
+
+/**
+ * Gets the cache counters
+ *
+ * @param out_stats: returned counters
+ * @param reset: 1 to reset the counters after reading them
+ */
+void resolver_get_stats(struct resolver_stats *out_stats, int reset);
 
 /**
  * Initiates an active TCP connection :
  * creates the socket & connects to a server listening
  *
- * @param url: url or ip address separated by dots
- * @param service: port number or service
+ * @param url: url or ip address separated by dots,
+ *      or unix socket address ("unix:/path" or "unixpacket:/path")
+ * @param service: port number or service (ignored for a unix socket)
  *
  * @return either
  *      socket file descriptor if it was successfully created
  *      ERR_TCP_CREATE_SOCK if an error occured on socket creation
- *          (errno is set with the gai error)
+ *          (errno is set with the gai error, or ENAMETOOLONG for a unix path too long)
  *      ERR_TCP_ACTIVE_CONNECT if an error occured while connecting to the server
  *          (errno is set)
  */
 int client_connect(char *url, char *service);
 
+/**
+ * Initiates an active TCP connection racing the server addresses (Happy Eyeballs, RFC 8305):
+ * the addresses are interleaved by family & a new non-blocking connection attempt
+ * is started every TCP_CONNECT_ATTEMPT_DELAY ms (or as soon as an attempt fails),
+ * the first attempt to succeed wins
+ *
+ * @param url: url or ip address separated by dots
+ * @param service: port number or service
+ * @param timeout_ms: overall deadline in milliseconds, < 0 to wait indefinitely
+ *      (a unix socket is connected at once, as with client_connect)
+ *
+ * @return either
+ *      (blocking) socket file descriptor if it was successfully created
+ *      ERR_TCP_CREATE_SOCK if an error occured on socket creation
+ *          (errno is set with the gai error)
+ *      ERR_TCP_ACTIVE_CONNECT if all the addresses failed (errno is set)
+ *      ERR_TCP_TIMEOUT if no attempt succeeded before the deadline
+ */
+int client_connect_timeout(char *url, char *service, int timeout_ms);
+
+/**
+ * Initiates an active TCP connection with tuned socket options:
+ * all the options are applied on the socket before connecting
+ *
+ * @param url: url or ip address separated by dots
+ * @param service: port number or service
+ * @param opts: options to apply, NULL to keep the defaults (same as client_connect);
+ *      with a connect_timeout_ms the addresses are raced as in client_connect_timeout,
+ *      unless fastopen is set: connect returns before the handshake, which starts with
+ *      the first data sent, the first address is used
+ *
+ * @return either
+ *      socket file descriptor if it was successfully created
+ *      ERR_TCP_OVER_SOCK_OPT if an option could not be applied (errno is set)
+ *      an error code returned by client_connect or client_connect_timeout
+ */
+int client_connect_opts(char *url, char *service, const struct tcp_options *opts);
+
 /**
  * Initiates a passive TCP connection :
  * creates the socket & listens for active connections
  *
- * @param service: port number or service
+ * @param service: port number or service,
+ *      or unix socket address ("unix:/path" or "unixpacket:/path"):
+ *      a stale socket file left at that path is replaced (EADDRINUSE if a server still
+ *      accepts connections on it)
  * @param backlog: amount of pending connections allowed
  *
  * @return either
@@ -53,11 +246,94 @@ int client_connect(char *url, char *service);
  */
 int server_listen(char *service, int backlog);
 
+/**
+ * Initiates a passive TCP connection with tuned socket options:
+ * all the options are applied on the socket before listening
+ * & are inherited by the connections accepted
+ *
+ * @param service: port number or service
+ * @param backlog: amount of pending connections allowed
+ * @param opts: options to apply (connect_timeout_ms is ignored), NULL to keep the defaults
+ *
+ * @return see server_listen (ERR_TCP_OVER_SOCK_OPT if an option could not be applied)
+ */
+int server_listen_opts(char *service, int backlog, const struct tcp_options *opts);
+
+/**
+ * Initiates passive TCP connections sharded by core:
+ * creates several listening sockets on the same port (SO_REUSEPORT),
+ * each one having its own accept queue to be served by its own worker
+ * The connections are steered to the socket of the cpu receiving them when the kernel
+ * allows it (SO_INCOMING_CPU & reuseport cpu program), otherwise by hash
+ *
+ * @param service: port number or service (a unix socket address gives a single socket
+ *      shared by all the workers: out_fds are duplicates of it)
+ * @param backlog: amount of pending connections allowed per socket
+ * @param shards: amount of sockets (one per worker, socket i is served on cpu i)
+ * @param opts: options applied on each socket before listening, can be NULL
+ * @param out_fds: returned array of shards socket file descriptors
+ *
+ * @return either
+ *      0 if all the sockets were successfully created
+ *      an error code returned by server_listen (no socket is left open)
+ *      errno is set
+ */
+int server_listen_sharded(char *service, int backlog, int shards,
+                            const struct tcp_options *opts, int *out_fds);
+
+/**
+ * Reads back the tuning options applied on a socket
+ * (the buffer sizes are the ones reserved by the kernel, usually the double of the request)
+ *
+ * @param sockfd: socket file descriptor
+ * @param out_opts: returned options (connect_timeout_ms is set to 0,
+ *      fastopen is the queue length of a listening socket)
+ *
+ * @return either
+ *      0 if the options have been read
+ *      -1 if an error occured
+ *      errno is set
+ */
+int tcp_get_options(int sockfd, struct tcp_options *out_opts);
+
+/**
+ * Tells whether a connection saved the handshake round trip with TCP Fast Open:
+ * its SYN carried data which has been accepted by the server
+ *
+ * The client needs the server cookie, received on a previous connection:
+ * the first connection to a server never uses it
+ * The system must allow it (net.ipv4.tcp_fastopen: 1 for the client, 2 for the server)
+ * Before a client has received any answer, the connection is not established yet:
+ * an unreachable server is reported by the first receive
+ *
+ * @param sockfd: connection socket file descriptor, after the first answer received
+ *
+ * @return either
+ *      1 if the data of the SYN has been accepted
+ *      0 if the connection used a regular handshake
+ *      -1 if an error occured (errno is set)
+ */
+int tcp_fastopen_used(int sockfd);
+
+/**
+ * Pins the calling process (and its future children) to a cpu
+ *
+ * @param cpu: cpu index
+ *
+ * @return either
+ *      0 if the affinity has been set
+ *      -1 if an error occured
+ *      errno is set
+ */
+int tcp_pin_cpu(int cpu);
+
 /**
  * Accepts the connection from a client
+ * (in a coroutine, a non-blocking listening socket yields until a client connects)
  *
  * @param sockfd: server socket file descriptor
- * @param out_client_ip: returned client ip address
+ * @param out_client_ip: returned client ip address (INET6_ADDRSTRLEN bytes),
+ *      "unix:<pid>" for a unix socket peer (its process id, "unix" if unknown)
  *
  * @return either
  *      the active connection socket file descriptor
@@ -66,6 +342,36 @@ int server_listen(char *service, int backlog);
  */
 int server_accept(int sockfd, char *out_client_ip);
 
+/**
+ * Accepts the pending connections of a listening socket in a single call:
+ * waits for the first connection, then takes the ones already queued behind it
+ * The client addresses are only formatted on demand (server_accepted_ip)
+ *
+ * @param sockfd: server socket file descriptor (made non-blocking)
+ * @param out_conns: returned connections
+ * @param max: maximum amount of connections returned
+ * @param flags: flags of the connection sockets, 0 or SOCK_NONBLOCK | SOCK_CLOEXEC
+ * @param deadline: absolute deadline given by tcp_deadline to wait for the first connection,
+ *      -1 to wait indefinitely, 0 to only take the connections already queued
+ *
+ * @return either
+ *      the amount of connections accepted (at least 1)
+ *      ERR_TCP_WOULD_BLOCK if no connection was queued (deadline 0)
+ *      ERR_TCP_TIMEOUT if the deadline has passed (errno is set to ETIMEDOUT)
+ *      -1 if an error occured (errno is set)
+ */
+int server_accept_batch(int sockfd, struct tcp_accepted *out_conns, int max, int flags,
+                        long long deadline);
+
+/**
+ * Formats the address of a connection accepted by server_accept_batch
+ *
+ * @param conn: accepted connection
+ * @param out_client_ip: returned client ip address (INET6_ADDRSTRLEN bytes),
+ *      "unix:<pid>" for a unix socket peer
+ */
+void server_accepted_ip(struct tcp_accepted *conn, char *out_client_ip);
+
 /**
  * Sends data to the remote host
  *
@@ -80,6 +386,51 @@ int server_accept(int sockfd, char *out_client_ip);
  */
 int send_data(int sockfd, char *buffer, ssize_t length);
 
+/**
+ * Sends data gathered from several buffers to the remote host
+ * in as few system calls as possible (no copy into a contiguous buffer)
+ *
+ * @param sockfd: socket file descriptor
+ * @param iov: buffers containing the data, consumed in place
+ *      (the array is modified when a send is partial)
+ * @param iovcnt: amount of buffers
+ *
+ * @return either
+ *      0 if all bytes have been sent
+ *      -1 if an error occured
+ *      errno is set
+ */
+int send_datav(int sockfd, struct iovec *iov, int iovcnt);
+
+/**
+ * Sends data to the remote host, giving up once the deadline has passed
+ * (the socket does not need to be non-blocking)
+ *
+ * @param sockfd: socket file descriptor
+ * @param buffer: buffer containing the data
+ * @param length: buffer length
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait indefinitely
+ *
+ * @return either
+ *      0 if all bytes have been sent
+ *      ERR_TCP_TIMEOUT if the deadline passed before all bytes were sent
+ *      -1 if an error occured
+ *      errno is set
+ */
+int send_data_deadline(int sockfd, char *buffer, ssize_t length, long long deadline);
+
+/**
+ * Sends data gathered from several buffers, giving up once the deadline has passed
+ *
+ * @param sockfd: socket file descriptor
+ * @param iov: buffers containing the data, consumed in place
+ * @param iovcnt: amount of buffers
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait indefinitely
+ *
+ * @return see send_data_deadline
+ */
+int send_datav_deadline(int sockfd, struct iovec *iov, int iovcnt, long long deadline);
+
 /**
  * Receives data from the remote host
  *
@@ -109,6 +460,41 @@ ssize_t receive_data(int sockfd, char *out_buffer, ssize_t max_length);
  */
 int expect_data(int sockfd, char *out_buffer, ssize_t length);
 
+/**
+ * Expects a given amount of data from the remote host, giving up once the deadline has passed
+ * (the socket does not need to be non-blocking)
+ *
+ * @param sockfd: socket file descriptor
+ * @param out_buffer: returned buffer containing the data
+ * @param length: amount of bytes expected
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait indefinitely
+ *
+ * @return either
+ *      0 if all the data expected have been received
+ *      ERR_TCP_PEER_CLOSED if the remote closed the connection before sending
+ *          the amount of bytes expected (errno is not set)
+ *      ERR_TCP_RECV_DATA if an eror occured while receiving the data (errno is set)
+ *      ERR_TCP_TIMEOUT if the deadline passed before all the data was received
+ *          (errno is set to ETIMEDOUT)
+ */
+int expect_data_deadline(int sockfd, char *out_buffer, ssize_t length, long long deadline);
+
+/**
+ * Expects a given amount of data scattered into several buffers
+ *
+ * @param sockfd: socket file descriptor
+ * @param iov: returned buffers filled with the data, consumed in place
+ *      (the array is modified when a receive is partial)
+ * @param iovcnt: amount of buffers, blocks until they all have been filled
+ *
+ * @return either
+ *      0 if all the data expected have been received
+ *      ERR_TCP_PEER_CLOSED if the remote closed the connection before receiving
+ *          the amount of bytes expected (errno is not set)
+ *      ERR_TCP_RECV_DATA if an eror occured while receiving the data (errno is set)
+ */
+int expect_datav(int sockfd, struct iovec *iov, int iovcnt);
+
 /**
  * Closes the socket
  *
@@ -0,0 +1,96 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Zero-copy send (MSG_ZEROCOPY): large buffers are sent from the user memory,
+ * the kernel notifies through the socket error queue when they can be reused
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "tcp-util.h"
+
+#define TCP_ZEROCOPY_THRESHOLD  (16 * 1024) // buffers sent with a copy below this size
+
+struct tcp_zerocopy;
+
+/** Zero-copy counters */
+struct tcp_zerocopy_stats {
+    unsigned long zerocopy_bytes;   // bytes sent with MSG_ZEROCOPY
+    unsigned long copy_bytes;       // bytes sent with an ordinary send (small or fallback)
+    unsigned long completions;      // notifications read from the error queue
+    unsigned long kernel_copied;    // notifications where the kernel copied the data anyway
+                                    // (e.g. loopback): zero-copy is not worth it on that path
+};
+
+/**
+ * Enables zero-copy sends on a connected socket
+ * If the kernel does not support it, all the sends fall back to an ordinary send
+ *
+ * @param sockfd: connection socket file descriptor
+ * @param threshold: size below which a buffer is copied, 0 to use TCP_ZEROCOPY_THRESHOLD
+ *
+ * @return the zero-copy state, NULL if an error occured (errno is set)
+ */
+struct tcp_zerocopy *zerocopy_create(int sockfd, size_t threshold);
+
+/**
+ * Frees the zero-copy state (the socket is not closed)
+ * The buffers not completed yet may still be read by the kernel until the socket is closed
+ *
+ * @param zc: zero-copy state to free
+ */
+void zerocopy_destroy(struct tcp_zerocopy *zc);
+
+/**
+ * Sends a whole buffer, without copy if it is at least as large as the threshold
+ * The buffer must not be modified nor freed until zerocopy_done returns 1 for the ticket
+ *
+ * @param zc: zero-copy state
+ * @param buffer: buffer containing the data
+ * @param length: buffer length
+ *
+ * @return either
+ *      the ticket of the buffer (>= 0), to check with zerocopy_done or zerocopy_wait
+ *      -1 if an error occured (errno is set)
+ */
+long long zerocopy_send(struct tcp_zerocopy *zc, char *buffer, ssize_t length);
+
+/**
+ * Reads the completion notifications available & checks if a buffer can be reused
+ *
+ * @param zc: zero-copy state
+ * @param ticket: ticket returned by zerocopy_send
+ *
+ * @return either
+ *      1 if the buffer can be reused
+ *      0 if the kernel still holds the buffer
+ *      -1 if an error occured (errno is set)
+ */
+int zerocopy_done(struct tcp_zerocopy *zc, long long ticket);
+
+/**
+ * Waits until a buffer can be reused
+ *
+ * @param zc: zero-copy state
+ * @param ticket: ticket returned by zerocopy_send
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait indefinitely
+ *
+ * @return either
+ *      0 if the buffer can be reused
+ *      ERR_TCP_TIMEOUT if the deadline has passed
+ *      -1 if an error occured (EPIPE if the connection is shut down), errno is set
+ */
+int zerocopy_wait(struct tcp_zerocopy *zc, long long ticket, long long deadline);
+
+/**
+ * Gets the zero-copy counters
+ *
+ * @param zc: zero-copy state
+ * @param out_stats: returned counters
+ */
+void zerocopy_get_stats(struct tcp_zerocopy *zc, struct tcp_zerocopy_stats *out_stats);
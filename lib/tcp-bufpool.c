@@ -0,0 +1,345 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Buffer pool shared by the connections: size classes, per-thread caches
+ * & shared free lists
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "tcp-bufpool.h"
+
+// counters updated with relaxed atomics: exact totals, no ordering needed
+#define COUNT(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define LOAD(value) __atomic_load_n(&(value), __ATOMIC_RELAXED)
+
+/** Free buffer: the link to the next one is stored in the buffer itself */
+struct free_buf {
+    struct free_buf *next;
+};
+
+/** Free buffers of a class kept by a thread (no lock) */
+struct thread_cache {
+    struct free_buf *head[TCP_BUFPOOL_CLASSES];
+    int count[TCP_BUFPOOL_CLASSES];
+    int registered;         // 1 once the cache is flushed at the thread exit
+};
+
+/** Free buffers of a class shared by the threads */
+struct shared_list {
+    pthread_mutex_t lock;
+    struct free_buf *head;
+    int count;
+};
+
+static struct tcp_bufpool_options options = {
+    TCP_BUFPOOL_THREAD_CACHE, TCP_BUFPOOL_SHARED_CACHE, 0
+};
+static struct shared_list shared[TCP_BUFPOOL_CLASSES];
+static struct tcp_bufpool_stats stats;
+static __thread struct thread_cache cache;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;      // flushes the cache of an exiting thread
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Gets the class of a buffer size
+ *
+ * @param size: buffer size
+ *
+ * @return the class index, -1 if the size is larger than the largest class
+ */
+static int size_class(size_t size) {
+    int shift = TCP_BUFPOOL_MIN_SHIFT;
+
+    if (size > (1UL << TCP_BUFPOOL_MAX_SHIFT)) {
+        return -1;
+    }
+
+    if (size > (1UL << TCP_BUFPOOL_MIN_SHIFT)) {
+        shift = 64 - __builtin_clzl(size - 1);
+    }
+
+    return shift - TCP_BUFPOOL_MIN_SHIFT;
+}
+
+/**
+ * Allocates a buffer from the system: the large ones are mapped on huge page
+ * boundaries, so that they can be backed by huge pages
+ *
+ * @param cap: buffer size
+ *
+ * @return the buffer, NULL if an error occured (errno is set)
+ */
+static void *sys_alloc(size_t cap) {
+    char *map, *buf;
+    size_t head;
+
+    if (cap < TCP_BUFPOOL_HUGE_SIZE) {
+        return malloc(cap);
+    }
+
+    // over-map to align the buffer, then unmap what is around it
+    map = mmap(NULL, cap + TCP_BUFPOOL_HUGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    head = -(uintptr_t) map & (TCP_BUFPOOL_HUGE_SIZE - 1);
+    buf = map + head;
+    if (head) munmap(map, head);
+    munmap(buf + cap, TCP_BUFPOOL_HUGE_SIZE - head);
+
+    if (LOAD(options.hugepages) && madvise(buf, cap, MADV_HUGEPAGE) == 0) {
+        COUNT(stats.huge_advised, 1);
+    }
+
+    return buf;
+}
+
+/**
+ * Returns a buffer to the system
+ *
+ * @param buf: buffer allocated by sys_alloc
+ * @param cap: buffer size
+ */
+static void sys_free(void *buf, size_t cap) {
+    if (cap < TCP_BUFPOOL_HUGE_SIZE) {
+        free(buf);
+    } else {
+        munmap(buf, cap);
+    }
+}
+
+/**
+ * Keeps a free buffer in the shared list of its class, returns it to the system
+ * if the list is full
+ *
+ * @param buf: free buffer
+ * @param class: class of the buffer
+ */
+static void shared_put(struct free_buf *buf, int class) {
+    struct shared_list *list = &shared[class];
+
+    pthread_mutex_lock(&list->lock);
+    if (list->count < LOAD(options.shared_cache)) {
+        buf->next = list->head;
+        list->head = buf;
+        list->count++;
+        pthread_mutex_unlock(&list->lock);
+        return;
+    }
+    pthread_mutex_unlock(&list->lock);
+
+    sys_free(buf, 1UL << (class + TCP_BUFPOOL_MIN_SHIFT));
+    COUNT(stats.classes[class].releases, 1);
+    COUNT(stats.classes[class].cached, -1);
+}
+
+/**
+ * Returns a list of free buffers to the system
+ *
+ * @param buf: first buffer of the list
+ * @param class: class of the buffers
+ */
+static void release_list(struct free_buf *buf, int class) {
+    struct free_buf *next;
+
+    for (; buf != NULL; buf = next) {
+        next = buf->next;
+        sys_free(buf, 1UL << (class + TCP_BUFPOOL_MIN_SHIFT));
+        COUNT(stats.classes[class].releases, 1);
+        COUNT(stats.classes[class].cached, -1);
+    }
+}
+
+/**
+ * Flushes the cache of an exiting thread in the shared lists
+ *
+ * @param arg: cache of the thread
+ */
+static void flush_cache(void *arg) {
+    struct thread_cache *tc = arg;
+    struct free_buf *buf;
+    int class;
+
+    for (class = 0; class < TCP_BUFPOOL_CLASSES; class++) {
+        while ((buf = tc->head[class]) != NULL) {
+            tc->head[class] = buf->next;
+            shared_put(buf, class);
+        }
+        tc->count[class] = 0;
+    }
+}
+
+/**
+ * Initializes the shared lists & the thread exit hook
+ */
+static void init(void) {
+    int class;
+
+    for (class = 0; class < TCP_BUFPOOL_CLASSES; class++) {
+        pthread_mutex_init(&shared[class].lock, NULL);
+    }
+
+    pthread_key_create(&exit_key, flush_cache);
+}
+
+/**
+ * Counts a buffer handed out & updates the peak
+ *
+ * @param cs: counters of the class
+ */
+static void count_get(struct tcp_bufpool_class_stats *cs) {
+    unsigned long in_use = COUNT(cs->in_use, 1) + 1;
+    unsigned long peak = LOAD(cs->peak_in_use);
+
+    COUNT(cs->gets, 1);
+    while (in_use > peak && !__atomic_compare_exchange_n(&cs->peak_in_use, &peak, in_use, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+void *tcp_buf_get(size_t size, size_t *out_cap) {
+    int class = size_class(size);
+    struct tcp_bufpool_class_stats *cs;
+    struct shared_list *list;
+    struct free_buf *buf;
+    size_t cap;
+
+    // not pooled: mapped as a whole number of huge pages
+    if (class < 0) {
+        COUNT(stats.oversize, 1);
+        *out_cap = (size + TCP_BUFPOOL_HUGE_SIZE - 1) & -(size_t) TCP_BUFPOOL_HUGE_SIZE;
+        return sys_alloc(*out_cap);
+    }
+
+    pthread_once(&init_once, init);
+    cs = &stats.classes[class];
+    cap = 1UL << (class + TCP_BUFPOOL_MIN_SHIFT);
+    *out_cap = cap;
+
+    // cache of the thread
+    if ((buf = cache.head[class]) != NULL) {
+        cache.head[class] = buf->next;
+        cache.count[class]--;
+        COUNT(cs->thread_hits, 1);
+        COUNT(cs->cached, -1);
+        count_get(cs);
+        return buf;
+    }
+
+    // shared list
+    list = &shared[class];
+    pthread_mutex_lock(&list->lock);
+    if ((buf = list->head) != NULL) {
+        list->head = buf->next;
+        list->count--;
+    }
+    pthread_mutex_unlock(&list->lock);
+
+    if (buf != NULL) {
+        COUNT(cs->shared_hits, 1);
+        COUNT(cs->cached, -1);
+        count_get(cs);
+        return buf;
+    }
+
+    // system
+    if ((buf = sys_alloc(cap)) == NULL) {
+        return NULL;
+    }
+    COUNT(cs->allocs, 1);
+    count_get(cs);
+    return buf;
+}
+
+void tcp_buf_put(void *buf, size_t cap) {
+    int class = size_class(cap);
+    struct free_buf *fb = buf;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    if (class < 0) {
+        sys_free(buf, cap);
+        return;
+    }
+
+    pthread_once(&init_once, init);
+    COUNT(stats.classes[class].in_use, -1);
+    COUNT(stats.classes[class].cached, 1);
+
+    if (cache.count[class] < LOAD(options.thread_cache)) {
+        // the cache of the thread is flushed at its exit
+        if (!cache.registered) {
+            pthread_setspecific(exit_key, &cache);
+            cache.registered = 1;
+        }
+
+        fb->next = cache.head[class];
+        cache.head[class] = fb;
+        cache.count[class]++;
+        return;
+    }
+
+    shared_put(fb, class);
+}
+
+void tcp_bufpool_configure(const struct tcp_bufpool_options *opts) {
+    struct tcp_bufpool_options defaults = {
+        TCP_BUFPOOL_THREAD_CACHE, TCP_BUFPOOL_SHARED_CACHE, 0
+    };
+
+    if (opts == NULL) {
+        opts = &defaults;
+    }
+
+    __atomic_store_n(&options.thread_cache, opts->thread_cache, __ATOMIC_RELAXED);
+    __atomic_store_n(&options.shared_cache, opts->shared_cache, __ATOMIC_RELAXED);
+    __atomic_store_n(&options.hugepages, opts->hugepages, __ATOMIC_RELAXED);
+}
+
+void tcp_bufpool_trim(void) {
+    struct free_buf *buf;
+    int class;
+
+    pthread_once(&init_once, init);
+
+    for (class = 0; class < TCP_BUFPOOL_CLASSES; class++) {
+        // detach the shared list, then free it outside of the lock
+        pthread_mutex_lock(&shared[class].lock);
+        buf = shared[class].head;
+        shared[class].head = NULL;
+        shared[class].count = 0;
+        pthread_mutex_unlock(&shared[class].lock);
+        release_list(buf, class);
+
+        release_list(cache.head[class], class);
+        cache.head[class] = NULL;
+        cache.count[class] = 0;
+    }
+}
+
+void tcp_bufpool_snapshot(struct tcp_bufpool_stats *out_stats) {
+    // the structure only holds unsigned long counters
+    unsigned long *src = (unsigned long *) &stats;
+    unsigned long *dst = (unsigned long *) out_stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(struct tcp_bufpool_stats) / sizeof(unsigned long); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
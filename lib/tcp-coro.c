@@ -0,0 +1,536 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Coroutine scheduler for the TCP library: stackful coroutines (ucontext) resumed
+ * by a one-shot epoll loop when the socket they wait for is ready
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include "tcp-coro.h"
+#include "tcp-internal.h"
+
+/** Coroutine */
+struct coro {
+    ucontext_t ctx;             // saved registers & stack of the coroutine
+    struct coro_sched *sched;   // scheduler running the coroutine
+    void (*fn)(void *);         // function run, NULL once it has returned
+    void *arg;                  // argument of the function
+    char *stack;                // stack mapping, starting with a guard page
+    int fd;                     // socket waited for, -1 if not waiting
+    short events;               // poll events waited for
+    long long deadline;         // deadline of the wait, -1 if none
+    size_t timer;               // position in the timers heap + 1, 0 if not in it
+    int wait_rv;                // result of the wait: 0 or ERR_TCP_TIMEOUT
+    struct coro *next;          // next coroutine in the run queue or in the free list
+};
+
+#define WAIT_READ   0           // waiting slots of a socket: any event but POLLOUT
+#define WAIT_WRITE  1           // POLLOUT
+
+/** Coroutines waiting for a socket: one reading & one writing at a time */
+struct coro_fd {
+    struct coro *waiters[2];    // indexed by WAIT_READ & WAIT_WRITE
+};
+
+/** Scheduler state */
+struct coro_sched {
+    int epfd;                   // epoll instance file descriptor
+    size_t stack_size;          // usable stack size of the coroutines
+    size_t guard_size;          // inaccessible page below each stack
+    ucontext_t main_ctx;        // context of coro_run, resumed when a coroutine suspends
+    struct coro *run_head;      // coroutines ready to run, in order
+    struct coro *run_tail;
+    struct coro *free;          // returned coroutines kept with their stack for reuse
+    struct coro_fd *fds;        // waiting coroutines indexed by socket file descriptor
+    int fds_cap;
+    struct coro **timers;       // waiting coroutines with a deadline (min-heap)
+    size_t timers_len;
+    size_t timers_cap;
+    int live;                   // coroutines not returned yet
+};
+
+// coroutine running in the thread, NULL in the scheduler loop & outside a scheduler
+__thread struct coro *coro_running;
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Appends a coroutine to the run queue
+ *
+ * @param sched: scheduler
+ * @param c: coroutine ready to run
+ */
+static void enqueue(struct coro_sched *sched, struct coro *c) {
+    c->next = NULL;
+    if (sched->run_tail) sched->run_tail->next = c;
+    else sched->run_head = c;
+    sched->run_tail = c;
+}
+
+/**
+ * Registers the events awaited on a socket by its waiting coroutines
+ * One-shot: the registration is disarmed once reported, rearmed by the next wait
+ *
+ * @param sched: scheduler
+ * @param sockfd: socket file descriptor
+ *
+ * @return 0 if no error occured, -1 otherwise (errno is set)
+ */
+static int arm(struct coro_sched *sched, int sockfd) {
+    struct coro_fd *entry = &sched->fds[sockfd];
+    struct epoll_event ev;
+    int slot;
+
+    ev.events = EPOLLONESHOT;
+    ev.data.fd = sockfd;
+    for (slot = WAIT_READ; slot <= WAIT_WRITE; slot++) {
+        if (entry->waiters[slot]) ev.events |= (unsigned short) entry->waiters[slot]->events;
+    }
+
+    // nobody waiting anymore (expired wait): the registration must not fire later
+    // (a waiter with no event still waits for the errors & hang ups, always reported)
+    if (entry->waiters[WAIT_READ] == NULL && entry->waiters[WAIT_WRITE] == NULL) {
+        epoll_ctl(sched->epfd, EPOLL_CTL_DEL, sockfd, NULL);
+        return 0;
+    }
+
+    // a closed & reused descriptor is not registered anymore
+    if (epoll_ctl(sched->epfd, EPOLL_CTL_MOD, sockfd, &ev)) {
+        if (errno != ENOENT) return -1;
+        return epoll_ctl(sched->epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    }
+
+    return 0;
+}
+
+/**
+ * Makes room in the waiting table for a socket
+ *
+ * @param sched: scheduler
+ * @param sockfd: socket file descriptor
+ *
+ * @return 0 if no error occured, -1 otherwise (errno is set)
+ */
+static int reserve_fd(struct coro_sched *sched, int sockfd) {
+    struct coro_fd *fds;
+    int cap = sched->fds_cap ? sched->fds_cap : 64;
+
+    if (sockfd < sched->fds_cap) {
+        return 0;
+    }
+
+    while (cap <= sockfd) cap *= 2;
+
+    fds = realloc(sched->fds, cap * sizeof(struct coro_fd));
+    if (fds == NULL) {
+        return -1;
+    }
+
+    memset(fds + sched->fds_cap, 0, (cap - sched->fds_cap) * sizeof(struct coro_fd));
+    sched->fds = fds;
+    sched->fds_cap = cap;
+    return 0;
+}
+
+/**
+ * Swaps two entries of the timers heap
+ *
+ * @param sched: scheduler
+ * @param i: first position
+ * @param j: second position
+ */
+static void timer_swap(struct coro_sched *sched, size_t i, size_t j) {
+    struct coro *c = sched->timers[i];
+
+    sched->timers[i] = sched->timers[j];
+    sched->timers[j] = c;
+    sched->timers[i]->timer = i + 1;
+    sched->timers[j]->timer = j + 1;
+}
+
+/**
+ * Restores the heap order around an entry whose deadline moved
+ *
+ * @param sched: scheduler
+ * @param i: position of the entry
+ */
+static void timer_sift(struct coro_sched *sched, size_t i) {
+    struct coro **t = sched->timers;
+    size_t child;
+
+    // up while earlier than the parent
+    while (i > 0 && t[i]->deadline < t[(i - 1) / 2]->deadline) {
+        timer_swap(sched, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    // down while later than the earliest child
+    while ((child = 2 * i + 1) < sched->timers_len) {
+        if (child + 1 < sched->timers_len && t[child + 1]->deadline < t[child]->deadline) {
+            child++;
+        }
+        if (t[i]->deadline <= t[child]->deadline) break;
+
+        timer_swap(sched, i, child);
+        i = child;
+    }
+}
+
+/**
+ * Adds a waiting coroutine to the timers
+ *
+ * @param sched: scheduler
+ * @param c: coroutine whose deadline is set
+ *
+ * @return 0 if no error occured, -1 otherwise (errno is set)
+ */
+static int timer_add(struct coro_sched *sched, struct coro *c) {
+    struct coro **timers;
+    size_t cap;
+
+    if (sched->timers_len == sched->timers_cap) {
+        cap = sched->timers_cap ? 2 * sched->timers_cap : 64;
+        timers = realloc(sched->timers, cap * sizeof(struct coro *));
+        if (timers == NULL) return -1;
+
+        sched->timers = timers;
+        sched->timers_cap = cap;
+    }
+
+    sched->timers[sched->timers_len] = c;
+    c->timer = ++sched->timers_len;
+    timer_sift(sched, c->timer - 1);
+    return 0;
+}
+
+/**
+ * Removes a coroutine from the timers
+ *
+ * @param sched: scheduler
+ * @param c: coroutine in the timers
+ */
+static void timer_remove(struct coro_sched *sched, struct coro *c) {
+    size_t i = c->timer - 1;
+    size_t last = --sched->timers_len;
+
+    c->timer = 0;
+    if (i == last) return;
+
+    // the last entry takes the place of the removed one
+    sched->timers[i] = sched->timers[last];
+    sched->timers[i]->timer = i + 1;
+    timer_sift(sched, i);
+}
+
+/**
+ * Entry point of the coroutines: returns to the scheduler through uc_link
+ */
+static void trampoline(void) {
+    struct coro *c = coro_running;
+
+    c->fn(c->arg);
+    c->fn = NULL;
+}
+
+/**
+ * Sets up the context of a coroutine to start in the trampoline on its own stack
+ * (kept out of coro_spawn: getcontext returns twice, the locals of its caller
+ * might be clobbered)
+ *
+ * @param sched: scheduler
+ * @param c: coroutine with its stack mapped
+ *
+ * @return 0 if the context is ready, -1 if an error occured (errno is set)
+ */
+static int prepare_context(struct coro_sched *sched, struct coro *c) {
+    if (getcontext(&c->ctx)) {
+        return -1;
+    }
+    c->ctx.uc_stack.ss_sp = c->stack + sched->guard_size;
+    c->ctx.uc_stack.ss_size = sched->stack_size;
+    c->ctx.uc_link = &sched->main_ctx;
+    makecontext(&c->ctx, trampoline, 0);
+    return 0;
+}
+
+/**
+ * Runs a coroutine until it suspends or returns
+ * (swapcontext also saves the signal mask: one system call per switch)
+ *
+ * @param sched: scheduler
+ * @param c: coroutine to resume
+ */
+static void resume(struct coro_sched *sched, struct coro *c) {
+    coro_running = c;
+    swapcontext(&sched->main_ctx, &c->ctx);
+    coro_running = NULL;
+
+    // returned: the stack is kept for the next coroutine
+    if (c->fn == NULL) {
+        c->next = sched->free;
+        sched->free = c;
+        sched->live--;
+    }
+}
+
+/**
+ * Resumes a waiting coroutine on the next turn
+ *
+ * @param sched: scheduler
+ * @param c: waiting coroutine
+ * @param slot: WAIT_READ or WAIT_WRITE
+ * @param rv: result of the wait
+ */
+static void wake(struct coro_sched *sched, struct coro *c, int slot, int rv) {
+    if (c->fd >= 0) sched->fds[c->fd].waiters[slot] = NULL;
+    if (c->timer) timer_remove(sched, c);
+    c->wait_rv = rv;
+    enqueue(sched, c);
+}
+
+
+/* INTERNAL FUNCTIONS */
+
+int coro_wait(int sockfd, short events, long long deadline) {
+    struct coro *c = coro_running;
+    struct coro_sched *sched = c->sched;
+    int slot = events & POLLOUT ? WAIT_WRITE : WAIT_READ;
+
+    if (deadline >= 0 && deadline <= monotonic_ms()) {
+        errno = ETIMEDOUT;
+        return ERR_TCP_TIMEOUT;
+    }
+
+    if (sockfd < 0 || reserve_fd(sched, sockfd)) {
+        if (sockfd < 0) errno = EBADF;
+        return -1;
+    }
+
+    // another coroutine already waits in the same direction
+    if (sched->fds[sockfd].waiters[slot] != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    c->fd = sockfd;
+    c->events = events;
+    c->deadline = deadline;
+    sched->fds[sockfd].waiters[slot] = c;
+
+    if (arm(sched, sockfd) || (deadline >= 0 && timer_add(sched, c))) {
+        sched->fds[sockfd].waiters[slot] = NULL;
+        arm(sched, sockfd);
+        return -1;
+    }
+
+    swapcontext(&c->ctx, &sched->main_ctx);
+
+    c->fd = -1;
+    if (c->wait_rv == ERR_TCP_TIMEOUT) {
+        errno = ETIMEDOUT;
+    }
+    return c->wait_rv;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+struct coro_sched *coro_sched_create(size_t stack_size) {
+    struct coro_sched *sched = calloc(1, sizeof(struct coro_sched));
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (sched == NULL) {
+        return NULL;
+    }
+
+    sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epfd < 0) {
+        free(sched);
+        return NULL;
+    }
+
+    if (stack_size == 0) {
+        stack_size = CORO_STACK_SIZE;
+    }
+
+    sched->guard_size = page;
+    sched->stack_size = (stack_size + page - 1) / page * page;
+
+    return sched;
+}
+
+void coro_sched_destroy(struct coro_sched *sched) {
+    struct coro *c;
+
+    while ((c = sched->free) != NULL) {
+        sched->free = c->next;
+        munmap(c->stack, sched->guard_size + sched->stack_size);
+        free(c);
+    }
+
+    free(sched->fds);
+    free(sched->timers);
+    close(sched->epfd);
+    free(sched);
+}
+
+int coro_spawn(struct coro_sched *sched, void (*fn)(void *), void *arg) {
+    struct coro *c = sched->free;
+
+    if (c != NULL) {
+        sched->free = c->next;
+    } else {
+        c = calloc(1, sizeof(struct coro));
+        if (c == NULL) {
+            return -1;
+        }
+
+        // only the pages touched are committed: thousands of stacks stay cheap
+        c->stack = mmap(NULL, sched->guard_size + sched->stack_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (c->stack == MAP_FAILED) {
+            free(c);
+            return -1;
+        }
+
+        // a stack overflow faults on the guard page instead of corrupting the heap
+        if (mprotect(c->stack, sched->guard_size, PROT_NONE)) {
+            munmap(c->stack, sched->guard_size + sched->stack_size);
+            free(c);
+            return -1;
+        }
+        c->sched = sched;
+    }
+
+    if (prepare_context(sched, c)) {
+        c->next = sched->free;
+        sched->free = c;
+        return -1;
+    }
+
+    c->fn = fn;
+    c->arg = arg;
+    c->fd = -1;
+    c->timer = 0;
+
+    enqueue(sched, c);
+    sched->live++;
+    return 0;
+}
+
+int coro_run(struct coro_sched *sched) {
+    struct epoll_event events[CORO_MAX_EVENTS];
+    long long remaining, now;
+    struct coro_fd *entry;
+    struct coro *c;
+    int timeout, n, i, fd;
+
+    // the scheduler loop runs on the thread stack only
+    if (coro_running != NULL) {
+        errno = EDEADLK;
+        return -1;
+    }
+
+    while (sched->live > 0) {
+        // run the ready coroutines, including the ones they spawn
+        while ((c = sched->run_head) != NULL) {
+            sched->run_head = c->next;
+            if (sched->run_head == NULL) sched->run_tail = NULL;
+            resume(sched, c);
+        }
+
+        if (sched->live == 0) {
+            break;
+        }
+
+        // sleep until a socket is ready or the earliest deadline
+        timeout = -1;
+        if (sched->timers_len > 0) {
+            remaining = sched->timers[0]->deadline - monotonic_ms();
+            timeout = remaining < 0 ? 0 : remaining > INT_MAX ? INT_MAX : (int) remaining;
+        }
+
+        n = epoll_wait(sched->epfd, events, CORO_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            entry = &sched->fds[fd];
+
+            // errors & hang ups wake both directions, reported by the next call
+            c = entry->waiters[WAIT_READ];
+            if (c && (events[i].events & ~EPOLLOUT)) wake(sched, c, WAIT_READ, 0);
+
+            c = entry->waiters[WAIT_WRITE];
+            if (c && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                wake(sched, c, WAIT_WRITE, 0);
+            }
+
+            // the other direction still waits: rearm for it
+            if ((entry->waiters[WAIT_READ] || entry->waiters[WAIT_WRITE]) && arm(sched, fd)) {
+                return -1;
+            }
+        }
+
+        // expired waits
+        now = monotonic_ms();
+        while (sched->timers_len > 0 && sched->timers[0]->deadline <= now) {
+            c = sched->timers[0];
+            fd = c->fd;
+            wake(sched, c, c->events & POLLOUT ? WAIT_WRITE : WAIT_READ, ERR_TCP_TIMEOUT);
+            if (fd >= 0 && arm(sched, fd)) return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct coro_sched *coro_self(void) {
+    return coro_running != NULL ? coro_running->sched : NULL;
+}
+
+void coro_yield(void) {
+    struct coro *c = coro_running;
+
+    if (c == NULL) {
+        return;
+    }
+
+    enqueue(c->sched, c);
+    swapcontext(&c->ctx, &c->sched->main_ctx);
+}
+
+int coro_sleep(int timeout_ms) {
+    struct coro *c = coro_running;
+
+    if (c == NULL) {
+        return poll(NULL, 0, timeout_ms) < 0 && errno != EINTR ? -1 : 0;
+    }
+
+    // a wait on no socket: only the timer wakes it
+    c->fd = -1;
+    c->events = 0;
+    c->deadline = monotonic_ms() + timeout_ms;
+    if (timer_add(c->sched, c)) {
+        return -1;
+    }
+
+    swapcontext(&c->ctx, &c->sched->main_ctx);
+    return 0;
+}
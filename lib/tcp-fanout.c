@@ -0,0 +1,479 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Fan-out queries: concurrent resolution, connection, request & response
+ * of many targets
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tcp-fanout.h"
+#include "tcp-internal.h"
+
+#define FANOUT_EVENTS   64          // events fetched by each epoll_wait call
+
+/** Progress of a target */
+enum fanout_state {
+    STATE_RESOLVING,                // not resolved yet
+    STATE_CONNECTING,               // handshake in progress
+    STATE_SENDING,                  // request partially sent
+    STATE_READING,                  // waiting for the response
+    STATE_DONE                      // result filled
+};
+
+/** Connection state of a target */
+struct fanout_conn {
+    enum fanout_state state;
+    int fd;                         // socket file descriptor, -1 if none
+    struct addrinfo *info;          // resolved addresses, NULL if the resolution failed
+    struct addrinfo **addrs;        // addresses in the order they are tried
+    int addr_count;                 // amount of addresses
+    int next_addr;                  // index of the next address to try
+    size_t sent;                    // amount of the request sent
+    long long start_us;             // start of the current step
+};
+
+/** Fan-out query state */
+struct fanout {
+    struct tcp_fanout_target *targets;
+    struct fanout_conn *conns;
+    int count;                      // amount of targets
+    size_t response_max;            // maximal response kept per target
+    long long deadline;             // absolute deadline (ms), -1 without limit
+    int epfd;                       // epoll instance of the connections
+    int wakefd;                     // eventfd signalled by the resolvers
+
+    /* shared with the resolvers */
+    pthread_mutex_t lock;
+    int next_resolve;               // index of the next target to resolve
+    int *resolved;                  // targets in the order they have been resolved
+    int resolved_count;             // amount of targets resolved (or failed)
+    int stop;                       // 1 once the query is over
+};
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Resolves the targets one after another, with the other resolution threads
+ *
+ * @param arg: fan-out query
+ *
+ * @return NULL
+ */
+static void *resolver_run(void *arg) {
+    struct fanout *f = arg;
+    struct tcp_fanout_target *t;
+    struct fanout_conn *c;
+    uint64_t one = 1;
+    long long start;
+    int i, err;
+
+    for (;;) {
+        pthread_mutex_lock(&f->lock);
+        i = f->next_resolve < f->count && !f->stop ? f->next_resolve++ : -1;
+        pthread_mutex_unlock(&f->lock);
+
+        if (i < 0) {
+            return NULL;
+        }
+
+        t = &f->targets[i];
+        c = &f->conns[i];
+
+        // the resolution already started is not interrupted, the next ones are skipped
+        if (f->deadline < 0 || monotonic_ms() < f->deadline) {
+            start = monotonic_ns() / 1000;
+            err = resolve_cached(t->host, t->service, &c->info);
+            t->resolve_us = monotonic_ns() / 1000 - start;
+
+            if (err) {
+                t->status = ERR_TCP_CREATE_SOCK;
+                t->error = err == EAI_SYSTEM ? errno : err;
+            } else if ((c->addrs = interleave_families(c->info, &c->addr_count)) == NULL) {
+                t->status = ERR_TCP_CREATE_SOCK;
+                t->error = ENOMEM;
+                resolve_free(c->info);
+                c->info = NULL;
+            }
+        }
+
+        // hand the target over to the connection loop
+        pthread_mutex_lock(&f->lock);
+        f->resolved[f->resolved_count++] = i;
+        pthread_mutex_unlock(&f->lock);
+        if (write(f->wakefd, &one, sizeof one) < 0) {
+            // the counter cannot overflow: the loop is woken up anyway
+        }
+    }
+}
+
+/**
+ * Ends the query of a target
+ *
+ * @param f: fan-out query
+ * @param i: target index
+ * @param status: result of the target (see tcp_fanout_target)
+ * @param error: errno of the failure
+ */
+static void finish(struct fanout *f, int i, int status, int error) {
+    struct tcp_fanout_target *t = &f->targets[i];
+    struct fanout_conn *c = &f->conns[i];
+
+    if (c->fd >= 0) {
+        close(c->fd);   // removed from the epoll instance as well
+        c->fd = -1;
+    }
+
+    if (t->response != NULL) {
+        t->response[t->response_len] = '\0';
+    }
+    if (status == 0) {
+        t->response_us = monotonic_ns() / 1000 - c->start_us;
+    }
+
+    t->status = status;
+    t->error = error;
+    c->state = STATE_DONE;
+}
+
+/**
+ * Starts a connection to the next address of a target
+ *
+ * @param f: fan-out query
+ * @param i: target index
+ *
+ * @return 0 if a connection is in progress, -1 if every address failed (target finished)
+ */
+static int try_connect(struct fanout *f, int i) {
+    struct tcp_fanout_target *t = &f->targets[i];
+    struct fanout_conn *c = &f->conns[i];
+    struct epoll_event ev;
+    struct addrinfo *p;
+    int error = ECONNREFUSED;
+
+    while (c->next_addr < c->addr_count) {
+        p = c->addrs[c->next_addr++];
+
+        c->fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       p->ai_protocol);
+        if (c->fd < 0) {
+            error = errno;
+            continue;
+        }
+
+        if (connect(c->fd, p->ai_addr, p->ai_addrlen) && errno != EINPROGRESS) {
+            // failed immediately: try the next address
+            error = errno;
+            close(c->fd);
+            c->fd = -1;
+            continue;
+        }
+
+        // writable once the handshake is over (immediately if already connected)
+        ev.events = EPOLLOUT;
+        ev.data.u32 = i;
+        if (epoll_ctl(f->epfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+            error = errno;
+            close(c->fd);
+            c->fd = -1;
+            continue;
+        }
+
+        inet_ntop(p->ai_family, get_in_addr(p->ai_addr), t->ip, sizeof t->ip);
+        c->state = STATE_CONNECTING;
+        c->start_us = monotonic_ns() / 1000;
+        return 0;
+    }
+
+    finish(f, i, ERR_TCP_ACTIVE_CONNECT, error);
+    return -1;
+}
+
+/**
+ * Sends the rest of the request of a target, then waits for its response
+ *
+ * @param f: fan-out query
+ * @param i: target index
+ */
+static void send_request(struct fanout *f, int i) {
+    struct tcp_fanout_target *t = &f->targets[i];
+    struct fanout_conn *c = &f->conns[i];
+    struct epoll_event ev;
+    ssize_t bytes_sent;
+
+    while (c->sent < t->request_len) {
+        bytes_sent = send(c->fd, t->request + c->sent, t->request_len - c->sent,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            finish(f, i, ERR_TCP_RECV_DATA, errno);
+            return;
+        }
+        c->sent += bytes_sent;
+    }
+
+    // the response time starts once the request is sent
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(f->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+        finish(f, i, ERR_TCP_RECV_DATA, errno);
+        return;
+    }
+    c->state = STATE_READING;
+    c->start_us = monotonic_ns() / 1000;
+}
+
+/**
+ * Handles the readiness of a target connection
+ *
+ * @param f: fan-out query
+ * @param i: target index
+ */
+static void handle(struct fanout *f, int i) {
+    struct tcp_fanout_target *t = &f->targets[i];
+    struct fanout_conn *c = &f->conns[i];
+    size_t limit = t->expect && t->expect < f->response_max ? t->expect : f->response_max;
+    ssize_t bytes_read;
+    socklen_t len = sizeof(int);
+    int err;
+
+    switch (c->state) {
+    case STATE_CONNECTING:
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len)) err = errno;
+
+        if (err) {
+            // refused: try the next address
+            close(c->fd);
+            c->fd = -1;
+            if (c->next_addr < c->addr_count) {
+                try_connect(f, i);
+            } else {
+                finish(f, i, ERR_TCP_ACTIVE_CONNECT, err);
+            }
+            return;
+        }
+
+        t->connect_us = monotonic_ns() / 1000 - c->start_us;
+        t->response = malloc(f->response_max + 1);
+        if (t->response == NULL) {
+            finish(f, i, ERR_TCP_RECV_DATA, errno);
+            return;
+        }
+
+        c->state = STATE_SENDING;
+        send_request(f, i);
+        return;
+
+    case STATE_SENDING:
+        send_request(f, i);
+        return;
+
+    case STATE_READING:
+        do bytes_read = recv(c->fd, t->response + t->response_len,
+                             limit - t->response_len, MSG_DONTWAIT);
+        while (bytes_read < 0 && errno == EINTR);
+
+        if (bytes_read < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                finish(f, i, ERR_TCP_RECV_DATA, errno);
+            }
+            return;
+        }
+
+        // closed by the peer: complete unless a longer response was expected
+        if (bytes_read == 0) {
+            finish(f, i, t->expect && t->response_len < t->expect ? ERR_TCP_PEER_CLOSED : 0, 0);
+            return;
+        }
+
+        t->response_len += bytes_read;
+        if (t->response_len >= limit) {
+            finish(f, i, 0, 0);
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+int tcp_fanout(struct tcp_fanout_target *targets, int count,
+               const struct tcp_fanout_options *opts, long long deadline) {
+    struct epoll_event events[FANOUT_EVENTS];
+    struct epoll_event ev;
+    struct fanout f;
+    pthread_t *threads;
+    int max_inflight = opts && opts->max_inflight ? opts->max_inflight : TCP_FANOUT_MAX_INFLIGHT;
+    int resolvers = opts && opts->resolvers ? opts->resolvers : TCP_FANOUT_RESOLVERS;
+    int started = 0;                // threads started
+    int taken = 0;                  // resolved targets taken by the connection loop
+    int inflight = 0;               // connections open
+    int done = 0;                   // targets finished
+    int succeeded = 0;
+    int available, ready, wait, i, j;
+    uint64_t wakeups;
+    long long now;
+
+    memset(&f, 0, sizeof f);
+    f.targets = targets;
+    f.count = count;
+    f.response_max = opts && opts->response_max ? opts->response_max : TCP_BUF_SIZE;
+    f.deadline = deadline;
+    f.conns = calloc(count ? count : 1, sizeof(struct fanout_conn));
+    f.resolved = malloc((count ? count : 1) * sizeof(int));
+    f.epfd = epoll_create1(EPOLL_CLOEXEC);
+    f.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    threads = malloc(resolvers * sizeof(pthread_t));
+    pthread_mutex_init(&f.lock, NULL);
+
+    // the targets not reached before the deadline keep the timeout result
+    for (i = 0; i < count; i++) {
+        f.conns[i].fd = -1;
+        targets[i].status = ERR_TCP_TIMEOUT;
+        targets[i].error = ETIMEDOUT;
+        targets[i].ip[0] = '\0';
+        targets[i].response = NULL;
+        targets[i].response_len = 0;
+        targets[i].resolve_us = targets[i].connect_us = targets[i].response_us = 0;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX;
+    if (f.conns == NULL || f.resolved == NULL || threads == NULL || f.epfd < 0
+            || f.wakefd < 0 || epoll_ctl(f.epfd, EPOLL_CTL_ADD, f.wakefd, &ev)) {
+        goto error;
+    }
+
+    for (; started < resolvers && started < count; started++) {
+        if (pthread_create(&threads[started], NULL, resolver_run, &f)) {
+            break;
+        }
+    }
+    if (started == 0 && count > 0) {
+        errno = EAGAIN;
+        goto error;
+    }
+
+    while (done < count) {
+        // connect the targets resolved while connections are available
+        pthread_mutex_lock(&f.lock);
+        available = f.resolved_count;
+        pthread_mutex_unlock(&f.lock);
+
+        while (taken < available && inflight < max_inflight) {
+            i = f.resolved[taken++];
+            if (f.conns[i].info == NULL) {
+                // resolution failed or skipped: result already filled
+                f.conns[i].state = STATE_DONE;
+                done++;
+            } else if (try_connect(&f, i)) {
+                done++;
+            } else {
+                inflight++;
+            }
+        }
+
+        if (done == count) {
+            break;
+        }
+
+        now = monotonic_ms();
+        if (deadline >= 0 && now >= deadline) {
+            break;
+        }
+        wait = deadline >= 0 ? (int) (deadline - now) : -1;
+
+        ready = epoll_wait(f.epfd, events, FANOUT_EVENTS, wait);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (j = 0; j < ready; j++) {
+            if (events[j].data.u32 == UINT32_MAX) {
+                if (read(f.wakefd, &wakeups, sizeof wakeups) < 0) {
+                    // already reset by a previous wake-up
+                }
+                continue;
+            }
+
+            i = events[j].data.u32;
+            if (f.conns[i].state == STATE_DONE) {
+                continue;
+            }
+
+            handle(&f, i);
+            if (f.conns[i].state == STATE_DONE) {
+                inflight--;
+                done++;
+            }
+        }
+    }
+
+    // stop the resolvers: the targets not resolved yet are skipped
+    pthread_mutex_lock(&f.lock);
+    f.stop = 1;
+    pthread_mutex_unlock(&f.lock);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < count; i++) {
+        // the connections still open have timed out
+        if (f.conns[i].fd >= 0) {
+            finish(&f, i, ERR_TCP_TIMEOUT, ETIMEDOUT);
+        }
+        if (targets[i].status == 0) {
+            succeeded++;
+        }
+
+        free(f.conns[i].addrs);
+        resolve_free(f.conns[i].info);
+    }
+
+    free(threads);
+    free(f.conns);
+    free(f.resolved);
+    close(f.epfd);
+    close(f.wakefd);
+    pthread_mutex_destroy(&f.lock);
+    return succeeded;
+
+error:
+    i = errno;
+    free(threads);
+    free(f.conns);
+    free(f.resolved);
+    if (f.epfd >= 0) close(f.epfd);
+    if (f.wakefd >= 0) close(f.wakefd);
+    pthread_mutex_destroy(&f.lock);
+    errno = i;
+    return -1;
+}
+
+void tcp_fanout_free(struct tcp_fanout_target *targets, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(targets[i].response);
+        targets[i].response = NULL;
+        targets[i].response_len = 0;
+    }
+}
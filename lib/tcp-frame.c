@@ -0,0 +1,122 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Length-prefixed framed messages over a stream
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+
+#include "tcp-bufpool.h"
+#include "tcp-frame.h"
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Grows a receive buffer to hold a frame: the buffer is swapped for one
+ * of a larger class of the pool
+ *
+ * @param buf: receive buffer
+ * @param size: payload size to hold
+ *
+ * @return either
+ *      0 if the buffer is large enough
+ *      -1 if an error occured (errno is set)
+ */
+static int reserve(struct tcp_frame_buf *buf, size_t size) {
+    size_t cap;
+    char *data;
+
+    if (size <= buf->cap && buf->data != NULL) {
+        return 0;
+    }
+
+    // the previous payload is not kept: no copy needed
+    data = tcp_buf_get(size, &cap);
+    if (data == NULL) {
+        return -1;
+    }
+
+    tcp_buf_put(buf->data, buf->cap);
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+int send_frame(struct tcp_stream *stream, const struct iovec *iov, int iovcnt) {
+    struct iovec out_iov[TCP_FRAME_IOV_MAX + 1];    // header followed by the payload
+    uint32_t header;
+    size_t size = 0;
+    int i;
+
+    if (iovcnt < 0 || iovcnt > TCP_FRAME_IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+
+    // the receivers refuse anything larger
+    if (size > TCP_FRAME_MAX_SIZE) {
+        errno = EMSGSIZE;
+        return ERR_TCP_FRAME_TOO_LARGE;
+    }
+
+    // the header is written with the payload: one copy or one system call for both
+    header = htobe32(size);
+    out_iov[0].iov_base = &header;
+    out_iov[0].iov_len = sizeof header;
+    memcpy(out_iov + 1, iov, iovcnt * sizeof(struct iovec));
+
+    return tcp_stream_writev(stream, out_iov, iovcnt + 1);
+}
+
+ssize_t recv_frame(struct tcp_stream *stream, struct tcp_frame_buf *buf, size_t max_size) {
+    uint32_t header;
+    size_t size;
+    int rv;
+
+    if (max_size == 0) {
+        max_size = TCP_FRAME_MAX_SIZE;
+    }
+
+    rv = tcp_stream_expect(stream, (char *) &header, sizeof header);
+    if (rv) {
+        return rv;
+    }
+
+    // refuse the frame before allocating anything for it
+    size = be32toh(header);
+    if (size > max_size) {
+        errno = EMSGSIZE;
+        return ERR_TCP_FRAME_TOO_LARGE;
+    }
+
+    if (reserve(buf, size)) {
+        return -1;
+    }
+
+    rv = tcp_stream_expect(stream, buf->data, size);
+    if (rv) {
+        return rv;
+    }
+
+    buf->len = size;
+    return size;
+}
+
+void tcp_frame_buf_free(struct tcp_frame_buf *buf) {
+    tcp_buf_put(buf->data, buf->cap);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
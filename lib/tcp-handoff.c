@@ -0,0 +1,198 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Listening socket handoff between two instances of a server
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#define _GNU_SOURCE     // accept4
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tcp-handoff.h"
+
+#define HANDOFF_MAGIC   0x54435048  // "TCPH"
+#define HANDOFF_VERSION 1
+
+/** Message carrying the listening sockets */
+struct handoff_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;         // amount of sockets attached
+};
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Checks that a socket is listening
+ *
+ * @param sockfd: socket file descriptor
+ *
+ * @return 1 if the socket is listening, 0 otherwise
+ */
+static int is_listening(int sockfd) {
+    int listening = 0;
+    socklen_t len = sizeof listening;
+
+    return !getsockopt(sockfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) && listening;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+int server_handoff_listen(char *address) {
+    // one new instance at a time
+    return server_listen(address, 1);
+}
+
+int server_handoff(int handoff_fd, const int *fds, int count, long long deadline) {
+    char control[CMSG_SPACE(TCP_HANDOFF_MAX_FDS * sizeof(int))];
+    struct handoff_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    char ack;
+    int connfd, rv;
+
+    if (count <= 0 || count > TCP_HANDOFF_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // wait for the new instance
+    if ((rv = wait_io(handoff_fd, POLLIN, deadline))) {
+        return rv;
+    }
+
+    do connfd = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    while (connfd < 0 && errno == EINTR);
+    if (connfd < 0) {
+        return -1;
+    }
+
+    // pass the sockets
+    hello.magic = HANDOFF_MAGIC;
+    hello.version = HANDOFF_VERSION;
+    hello.count = count;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof hello;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    if (sendmsg(connfd, &msg, MSG_NOSIGNAL) != sizeof hello) {
+        close(connfd);
+        return -1;
+    }
+
+    // the new instance accepts on the sockets once it has acknowledged them
+    rv = expect_data_deadline(connfd, &ack, 1, deadline);
+
+    // taken over: refuse the next connections before releasing the new instance,
+    // which binds the handoff address in turn (a stale socket file)
+    if (rv == 0) shutdown(handoff_fd, SHUT_RDWR);
+    close(connfd);
+
+    if (rv == ERR_TCP_RECV_DATA && errno == ECONNRESET) {
+        return ERR_TCP_PEER_CLOSED;
+    }
+    return rv == ERR_TCP_RECV_DATA ? -1 : rv;
+}
+
+int server_takeover(char *address, int *out_fds, int max, long long deadline) {
+    char control[CMSG_SPACE(TCP_HANDOFF_MAX_FDS * sizeof(int))];
+    int fds[TCP_HANDOFF_MAX_FDS];   // sockets received
+    struct handoff_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t bytes_read;
+    int connfd, count, i, rv;
+    char eof;                       // end of the connection, sent by the running server
+
+    connfd = client_connect(address, NULL);
+    if (connfd < 0) {
+        return ERR_TCP_ACTIVE_CONNECT;
+    }
+
+    if ((rv = wait_io(connfd, POLLIN, deadline))) {
+        close(connfd);
+        return rv;
+    }
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof hello;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    do bytes_read = recvmsg(connfd, &msg, MSG_CMSG_CLOEXEC);
+    while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+        close(connfd);
+        return bytes_read == 0 ? ERR_TCP_PEER_CLOSED : -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (bytes_read != sizeof hello || cmsg == NULL
+            || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        close(connfd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+    // only listening sockets, all of them kept
+    rv = hello.magic == HANDOFF_MAGIC && hello.version == HANDOFF_VERSION
+            && (int) hello.count == count && count <= max;
+    for (i = 0; rv && i < count; i++) {
+        rv = is_listening(fds[i]);
+    }
+
+    if (!rv) {
+        for (i = 0; i < count; i++) close(fds[i]);
+        close(connfd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    // acknowledge: the running server stops accepting
+    if (send_data(connfd, "", 1)) {
+        for (i = 0; i < count; i++) close(fds[i]);
+        close(connfd);
+        return -1;
+    }
+
+    // the running server closes the connection once its handoff socket refuses
+    // the connections: its address can be bound again (best effort)
+    if (wait_io(connfd, POLLIN, deadline) == 0) {
+        bytes_read = recv(connfd, &eof, 1, 0);
+    }
+
+    close(connfd);
+    memcpy(out_fds, fds, count * sizeof(int));
+    return count;
+}
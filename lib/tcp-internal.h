@@ -0,0 +1,332 @@
+#pragma once
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Helpers shared by the TCP library modules (not exported)
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#define TCP_INTERNAL __attribute__((visibility("hidden")))
+
+/**
+ * Gets the time elapsed on a monotonic clock
+ *
+ * @return the current time in milliseconds
+ */
+TCP_INTERNAL long long monotonic_ms(void);
+
+/**
+ * Gets the time elapsed on a monotonic clock, to measure durations
+ *
+ * @return the current time in nanoseconds
+ */
+TCP_INTERNAL long long monotonic_ns(void);
+
+struct sockaddr_storage;
+
+/**
+ * Formats the address of an accepted connection:
+ * ip address, or "unix:<pid>" for a unix socket peer
+ *
+ * @param sockfd: connection socket file descriptor
+ * @param addr: address returned by accept
+ * @param out_ip: returned human readable address (INET6_ADDRSTRLEN bytes)
+ */
+TCP_INTERNAL void format_peer(int sockfd, struct sockaddr_storage *addr, char *out_ip);
+
+struct addrinfo;
+
+/**
+ * Orders the addresses alternating the families, starting with the first one returned
+ * (RFC 8305 section 4)
+ *
+ * @param server_info: linked list filled by getaddrinfo
+ * @param out_count: returned amount of addresses
+ *
+ * @return the array of addresses (to free), NULL if an error occured
+ */
+TCP_INTERNAL struct addrinfo **interleave_families(struct addrinfo *server_info,
+                                                    int *out_count);
+
+/**
+ * Tells whether both directions of a connection are shut down: poll keeps reporting
+ * POLLHUP, a wait on the error queue (POLLERR) would return at once
+ *
+ * @param sockfd: socket file descriptor
+ *
+ * @return 1 if poll reports a hangup, 0 otherwise
+ */
+TCP_INTERNAL int hung_up(int sockfd);
+
+
+/* INSTRUMENTATION HOOKS (see tcp-stats.h) */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TCP_STATS_SEND  0   // direction of a counted operation
+#define TCP_STATS_RECV  1
+
+#ifdef TCP_STATS
+
+// time used to measure the system calls & the waits
+#define stats_clock_ns()                                monotonic_ns()
+
+/**
+ * Counts a library call
+ *
+ * @param sockfd: socket file descriptor
+ * @param dir: TCP_STATS_SEND or TCP_STATS_RECV
+ */
+TCP_INTERNAL void stats_call(int sockfd, int dir);
+
+/**
+ * Counts a system call & the time spent in it
+ *
+ * @param sockfd: socket file descriptor
+ * @param dir: TCP_STATS_SEND or TCP_STATS_RECV
+ * @param rv: value returned by the system call
+ * @param requested: amount of bytes requested
+ * @param start_ns: time given by stats_clock_ns before the system call
+ */
+TCP_INTERNAL void stats_syscall(int sockfd, int dir, ssize_t rv, size_t requested,
+                                long long start_ns);
+
+/**
+ * Counts the time spent waiting for a socket to be ready
+ *
+ * @param sockfd: socket file descriptor
+ * @param dir: TCP_STATS_SEND or TCP_STATS_RECV
+ * @param start_ns: time given by stats_clock_ns before the wait
+ */
+TCP_INTERNAL void stats_wait(int sockfd, int dir, long long start_ns);
+
+/**
+ * Resets the counters of a socket being closed
+ *
+ * @param sockfd: socket file descriptor
+ */
+TCP_INTERNAL void stats_forget(int sockfd);
+
+/**
+ * Computes the amount of bytes of a buffers list
+ *
+ * @param iov: buffers
+ * @param iovcnt: amount of buffers
+ *
+ * @return the total length of the buffers
+ */
+TCP_INTERNAL size_t stats_iov_len(const struct iovec *iov, size_t iovcnt);
+
+#else
+
+// disabled: the hooks & their arguments compile to nothing
+#define stats_clock_ns()                                0LL
+#define stats_call(sockfd, dir)                         ((void) 0)
+#define stats_syscall(sockfd, dir, rv, requested, s)    ((void) (s))
+#define stats_wait(sockfd, dir, s)                      ((void) (s))
+#define stats_forget(sockfd)                            ((void) 0)
+
+#endif
+
+/* RECORDING HOOKS (see tcp-record.h) */
+
+// recording file descriptor, -1 when the traffic is not recorded (or the recording has
+// failed): read atomically, the file itself is only closed by tcp_record_stop
+TCP_INTERNAL extern int record_fd;
+
+/**
+ * Tells whether the traffic is recorded
+ *
+ * @return the recording file descriptor, -1 if the traffic is not recorded
+ */
+static inline int recording(void) {
+    return __atomic_load_n(&record_fd, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records data sent
+ *
+ * @param sockfd: socket file descriptor
+ * @param buffer: data sent
+ * @param length: amount of bytes sent
+ */
+TCP_INTERNAL void record_send(int sockfd, const void *buffer, size_t length);
+
+/**
+ * Records data sent from a buffers list
+ *
+ * @param sockfd: socket file descriptor
+ * @param iov: buffers sent
+ * @param iovcnt: amount of buffers
+ * @param length: amount of bytes sent, from the first buffer
+ */
+TCP_INTERNAL void record_sendv(int sockfd, const struct iovec *iov, size_t iovcnt,
+                               size_t length);
+
+/**
+ * Records data received (its length only)
+ *
+ * @param sockfd: socket file descriptor
+ * @param length: amount of bytes received
+ */
+TCP_INTERNAL void record_recv(int sockfd, size_t length);
+
+/**
+ * Records the end of a connection
+ *
+ * @param sockfd: socket file descriptor being closed
+ */
+TCP_INTERNAL void record_close(int sockfd);
+
+/* COROUTINES (see tcp-coro.h) */
+
+#include <errno.h>
+#include <poll.h>
+
+#include "tcp-util.h"
+
+struct coro;
+
+// coroutine running in the thread, NULL outside a coroutine
+TCP_INTERNAL extern __thread struct coro *coro_running;
+
+/**
+ * Suspends the running coroutine until the socket is ready (see wait_io)
+ *
+ * @param sockfd: socket file descriptor
+ * @param events: poll events waited for
+ * @param deadline: absolute deadline given by tcp_deadline, -1 to wait without limit
+ *
+ * @return either
+ *      0 if the socket is ready
+ *      ERR_TCP_TIMEOUT if the deadline has passed
+ *      -1 if an error occured
+ *      errno is set
+ */
+TCP_INTERNAL int coro_wait(int sockfd, short events, long long deadline);
+
+/**
+ * Tells whether a system call has to be issued non-blocking to yield instead of blocking:
+ * in a coroutine, unless the caller already handles EAGAIN itself
+ *
+ * @param flags: flags of the system call
+ *
+ * @return 1 if the call yields on EAGAIN, 0 otherwise
+ */
+static inline int io_yields(int flags) {
+    return coro_running != NULL && !(flags & MSG_DONTWAIT);
+}
+
+/**
+ * Waits for the socket after a system call which would have blocked
+ *
+ * @param rv: value returned by the system call
+ * @param yield: value returned by io_yields for the call
+ * @param sockfd: socket file descriptor
+ * @param events: poll events waited for
+ *
+ * @return 1 if the system call has to be issued again, 0 if rv is the result
+ */
+static inline int io_retry(ssize_t rv, int yield, int sockfd, short events) {
+    return rv < 0 && yield && (errno == EAGAIN || errno == EWOULDBLOCK)
+        && wait_io(sockfd, events, -1) == 0;
+}
+
+/* Data system calls of the library, counted by the instrumentation
+ * In a coroutine, a call which would block yields until the socket is ready */
+
+static inline ssize_t io_send(int sockfd, const void *buffer, size_t length, int flags) {
+    int yield = io_yields(flags);
+    long long start;
+    ssize_t rv;
+
+    if (yield) flags |= MSG_DONTWAIT;
+
+    do {
+        start = stats_clock_ns();
+        rv = send(sockfd, buffer, length, flags);
+        stats_syscall(sockfd, TCP_STATS_SEND, rv, length, start);
+    } while (io_retry(rv, yield, sockfd, POLLOUT));
+
+    if (recording() >= 0 && rv > 0) record_send(sockfd, buffer, rv);
+    return rv;
+}
+
+static inline ssize_t io_recv(int sockfd, void *buffer, size_t length, int flags) {
+    int yield = io_yields(flags);
+    long long start;
+    ssize_t rv;
+
+    if (yield) flags |= MSG_DONTWAIT;
+
+    do {
+        start = stats_clock_ns();
+        rv = recv(sockfd, buffer, length, flags);
+        stats_syscall(sockfd, TCP_STATS_RECV, rv, length, start);
+    } while (io_retry(rv, yield, sockfd, POLLIN));
+
+    if (recording() >= 0 && rv > 0 && !(flags & MSG_PEEK)) record_recv(sockfd, rv);
+    return rv;
+}
+
+static inline ssize_t io_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+    int yield = io_yields(flags);
+    long long start;
+    ssize_t rv;
+
+    if (yield) flags |= MSG_DONTWAIT;
+
+    do {
+        start = stats_clock_ns();
+        rv = sendmsg(sockfd, msg, flags);
+        stats_syscall(sockfd, TCP_STATS_SEND, rv, stats_iov_len(msg->msg_iov, msg->msg_iovlen),
+                      start);
+    } while (io_retry(rv, yield, sockfd, POLLOUT));
+
+    if (recording() >= 0 && rv > 0) record_sendv(sockfd, msg->msg_iov, msg->msg_iovlen, rv);
+    return rv;
+}
+
+static inline ssize_t io_recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    int yield = io_yields(flags);
+    long long start;
+    ssize_t rv;
+
+    if (yield) flags |= MSG_DONTWAIT;
+
+    do {
+        start = stats_clock_ns();
+        rv = recvmsg(sockfd, msg, flags);
+        stats_syscall(sockfd, TCP_STATS_RECV, rv, stats_iov_len(msg->msg_iov, msg->msg_iovlen),
+                      start);
+    } while (io_retry(rv, yield, sockfd, POLLIN));
+
+    if (recording() >= 0 && rv > 0 && !(flags & (MSG_PEEK | MSG_ERRQUEUE))) {
+        record_recv(sockfd, rv);
+    }
+    return rv;
+}
+
+static inline ssize_t io_readv(int sockfd, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg = { 0 };
+    long long start;
+    ssize_t rv;
+
+    // readv has no flags: a coroutine reads the socket with recvmsg to yield
+    if (coro_running != NULL) {
+        msg.msg_iov = (struct iovec *) iov;
+        msg.msg_iovlen = iovcnt;
+        return io_recvmsg(sockfd, &msg, 0);
+    }
+
+    start = stats_clock_ns();
+    rv = readv(sockfd, iov, iovcnt);
+    stats_syscall(sockfd, TCP_STATS_RECV, rv, stats_iov_len(iov, iovcnt), start);
+
+    if (recording() >= 0 && rv > 0) record_recv(sockfd, rv);
+    return rv;
+}
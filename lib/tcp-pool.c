@@ -0,0 +1,287 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Keep-alive connection pool: idle established connections are reused
+ * per (host, service) by protocols running several exchanges on a connection
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tcp-internal.h"
+#include "tcp-pool.h"
+
+/** Idle connection kept in the pool */
+struct pool_idle {
+    int fd;                 // socket file descriptor
+    long long since;        // ms (monotonic) of the release
+};
+
+/** Connections of a (host, service) pair */
+struct pool_peer {
+    char *host;
+    char *service;
+    int idle_count;                 // amount of idle connections
+    struct pool_peer *next;
+    struct pool_idle idle[];        // idle connections, the most recent last
+};
+
+/** Connection handed out by the pool */
+struct pool_lease {
+    int fd;                         // socket file descriptor
+    struct pool_peer *peer;         // peer the connection is opened to
+    struct pool_lease *next;
+};
+
+/** Pool state */
+struct tcp_pool {
+    int max_idle;                   // idle connections kept per peer
+    int idle_timeout;               // ms an idle connection is kept
+    struct pool_peer *peers;        // known peers
+    struct pool_lease *leases;      // connections handed out
+    struct tcp_pool_stats stats;
+    pthread_mutex_t lock;
+};
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Checks that an idle connection can be reused: the remote has not closed it,
+ * no error is pending & no unexpected data has been received
+ *
+ * @param sockfd: socket file descriptor
+ *
+ * @return 1 if the connection is alive, 0 otherwise
+ */
+static int is_alive(int sockfd) {
+    char c;
+    ssize_t rv = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * Finds the peer of a (host, service) pair, creates it if unknown
+ *
+ * @param pool: pool
+ * @param host: host name
+ * @param service: service name
+ *
+ * @return the peer, NULL if an error occured
+ */
+static struct pool_peer *get_peer(struct tcp_pool *pool, char *host, char *service) {
+    struct pool_peer *peer;
+
+    for (peer = pool->peers; peer != NULL; peer = peer->next) {
+        if (!strcmp(peer->host, host) && !strcmp(peer->service, service)) {
+            return peer;
+        }
+    }
+
+    peer = calloc(1, sizeof(struct pool_peer) + pool->max_idle * sizeof(struct pool_idle));
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    peer->host = strdup(host);
+    peer->service = strdup(service);
+    if (peer->host == NULL || peer->service == NULL) {
+        free(peer->host);
+        free(peer->service);
+        free(peer);
+        return NULL;
+    }
+
+    peer->next = pool->peers;
+    pool->peers = peer;
+    return peer;
+}
+
+/**
+ * Closes the idle connections of a peer kept longer than the timeout
+ *
+ * @param pool: pool
+ * @param peer: peer
+ * @param now: current monotonic time in ms
+ */
+static void expire_idle(struct tcp_pool *pool, struct pool_peer *peer, long long now) {
+    int i, kept = 0;
+
+    for (i = 0; i < peer->idle_count; i++) {
+        if (now - peer->idle[i].since > pool->idle_timeout) {
+            close(peer->idle[i].fd);
+            pool->stats.closed_expired++;
+        } else {
+            peer->idle[kept++] = peer->idle[i];
+        }
+    }
+
+    peer->idle_count = kept;
+}
+
+/**
+ * Records a connection handed out
+ *
+ * @param pool: pool
+ * @param sockfd: socket file descriptor
+ * @param peer: peer the connection is opened to
+ *
+ * @return 0 if the lease was recorded, -1 if an error occured
+ */
+static int add_lease(struct tcp_pool *pool, int sockfd, struct pool_peer *peer) {
+    struct pool_lease *lease = malloc(sizeof(struct pool_lease));
+
+    if (lease == NULL) {
+        return -1;
+    }
+
+    lease->fd = sockfd;
+    lease->peer = peer;
+    lease->next = pool->leases;
+    pool->leases = lease;
+    return 0;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+struct tcp_pool *pool_create(int max_idle, int idle_timeout_ms) {
+    struct tcp_pool *pool = calloc(1, sizeof(struct tcp_pool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->max_idle = max_idle > 0 ? max_idle : TCP_POOL_MAX_IDLE;
+    pool->idle_timeout = idle_timeout_ms > 0 ? idle_timeout_ms : TCP_POOL_IDLE_TIMEOUT;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+void pool_destroy(struct tcp_pool *pool) {
+    struct pool_peer *peer;
+    struct pool_lease *lease;
+    int i;
+
+    while ((peer = pool->peers)) {
+        pool->peers = peer->next;
+        for (i = 0; i < peer->idle_count; i++) close(peer->idle[i].fd);
+        free(peer->host);
+        free(peer->service);
+        free(peer);
+    }
+
+    while ((lease = pool->leases)) {
+        pool->leases = lease->next;
+        free(lease);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int pool_get(struct tcp_pool *pool, char *host, char *service) {
+    struct pool_peer *peer;
+    int sockfd;
+
+    pthread_mutex_lock(&pool->lock);
+
+    peer = get_peer(pool, host, service);
+    if (peer == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return ERR_TCP_CREATE_SOCK;
+    }
+
+    expire_idle(pool, peer, monotonic_ms());
+
+    // reuse the most recently released connection still alive
+    while (peer->idle_count > 0) {
+        sockfd = peer->idle[--peer->idle_count].fd;
+
+        if (!is_alive(sockfd)) {
+            close(sockfd);
+            pool->stats.closed_dead++;
+            continue;
+        }
+
+        if (add_lease(pool, sockfd, peer)) {
+            close(sockfd);
+            break;
+        }
+
+        pool->stats.reused++;
+        pthread_mutex_unlock(&pool->lock);
+        return sockfd;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    // no idle connection: open a new one (without holding the lock)
+    sockfd = client_connect_timeout(host, service, -1);
+    if (sockfd < 0) {
+        return sockfd;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (add_lease(pool, sockfd, peer)) {
+        pthread_mutex_unlock(&pool->lock);
+        close(sockfd);
+        return ERR_TCP_CREATE_SOCK;
+    }
+    pool->stats.created++;
+    pthread_mutex_unlock(&pool->lock);
+
+    return sockfd;
+}
+
+void pool_release(struct tcp_pool *pool, int sockfd, int reusable) {
+    struct pool_lease **p, *lease = NULL;
+    struct pool_peer *peer;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (p = &pool->leases; *p != NULL; p = &(*p)->next) {
+        if ((*p)->fd == sockfd) {
+            lease = *p;
+            *p = lease->next;
+            break;
+        }
+    }
+
+    // unknown connection or state unknown: closed
+    if (lease == NULL || !reusable) {
+        pthread_mutex_unlock(&pool->lock);
+        free(lease);
+        close(sockfd);
+        return;
+    }
+
+    peer = lease->peer;
+    free(lease);
+
+    if (peer->idle_count >= pool->max_idle) {
+        pool->stats.closed_overflow++;
+        close(sockfd);
+    } else {
+        peer->idle[peer->idle_count].fd = sockfd;
+        peer->idle[peer->idle_count].since = monotonic_ms();
+        peer->idle_count++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_get_stats(struct tcp_pool *pool, struct tcp_pool_stats *out_stats) {
+    pthread_mutex_lock(&pool->lock);
+    *out_stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,405 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Event-driven connection reactor (edge-triggered epoll) for the TCP library
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tcp-bufpool.h"
+#include "tcp-internal.h"
+#include "tcp-reactor.h"
+
+/** Reactor state */
+struct reactor {
+    int epfd;                           // epoll instance file descriptor
+    struct reactor_handlers handlers;   // user callbacks
+    void *ctx;                          // user context
+    int stop;                           // 1 if the loop has to stop
+    struct reactor_conn *conns;         // registered sockets (connections & listeners)
+    struct reactor_conn *closing;       // connections to close at the end of the batch
+};
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Removes a connection from the list it belongs to
+ *
+ * @param head: list head pointer
+ * @param conn: connection to remove
+ */
+static void unlink_conn(struct reactor_conn **head, struct reactor_conn *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else *head = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/**
+ * Adds a connection at the head of a list
+ *
+ * @param head: list head pointer
+ * @param conn: connection to add
+ */
+static void link_conn(struct reactor_conn **head, struct reactor_conn *conn) {
+    conn->prev = NULL;
+    conn->next = *head;
+    if (*head) (*head)->prev = conn;
+    *head = conn;
+}
+
+/**
+ * Registers a socket in the epoll instance & in the list of connections
+ *
+ * @param reactor: reactor
+ * @param sockfd: non-blocking socket file descriptor
+ * @param events: epoll events watched
+ * @param listener: 1 if the socket is a listening socket
+ *
+ * @return the connection, NULL if an error occured (errno is set)
+ */
+static struct reactor_conn *register_socket(struct reactor *reactor, int sockfd,
+                                            uint32_t events, int listener) {
+    struct reactor_conn *conn;
+    struct epoll_event ev;
+
+    conn = calloc(1, sizeof(struct reactor_conn));
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    conn->fd = sockfd;
+    conn->reactor = reactor;
+    conn->listener = listener;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sockfd, &ev)) {
+        free(conn);
+        return NULL;
+    }
+
+    link_conn(&reactor->conns, conn);
+    return conn;
+}
+
+/**
+ * Sends the buffered output until the kernel stops accepting data
+ *
+ * @param conn: connection
+ *
+ * @return 0 if no error occured (the output may remain partially buffered),
+ *      -1 if an error occured (errno is set)
+ */
+static int flush_output(struct reactor_conn *conn) {
+    ssize_t bytes_sent;
+
+    while (conn->out_off < conn->out_len) {
+        bytes_sent = send(conn->fd, conn->out_buf + conn->out_off,
+                            conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->out_off += bytes_sent;
+    }
+
+    // drained: the buffer goes back to the pool while the connection is idle
+    tcp_buf_put(conn->out_buf, conn->out_cap);
+    conn->out_buf = NULL;
+    conn->out_off = conn->out_len = conn->out_cap = 0;
+    return 0;
+}
+
+/**
+ * Accepts all the pending connections of a listening socket
+ *
+ * @param reactor: reactor
+ * @param listener: listening socket
+ */
+static void accept_connections(struct reactor *reactor, struct reactor_conn *listener) {
+    struct tcp_accepted accepted[REACTOR_ACCEPT_BATCH];
+    struct reactor_conn *conn;
+    int count, i;
+
+    do {
+        // connections already non-blocking, their address formatted on demand
+        count = server_accept_batch(listener->fd, accepted, REACTOR_ACCEPT_BATCH,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        for (i = 0; i < count; i++) {
+            conn = register_socket(reactor, accepted[i].fd,
+                                    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, 0);
+            if (conn == NULL) {
+                close(accepted[i].fd);
+                continue;
+            }
+            conn->peer = accepted[i].addr;
+
+            if (reactor->handlers.on_open && reactor->handlers.on_open(conn) < 0) {
+                conn_close(conn);
+            }
+        }
+
+    // a full batch may leave connections queued: backlog drained (ERR_TCP_WOULD_BLOCK)
+    // or resources exhausted otherwise, wait for the next edge
+    } while (count == REACTOR_ACCEPT_BATCH);
+}
+
+/**
+ * Calls the callbacks matching the events received on a connection
+ *
+ * @param reactor: reactor
+ * @param conn: connection
+ * @param events: epoll events received
+ */
+static void dispatch(struct reactor *reactor, struct reactor_conn *conn, uint32_t events) {
+    if (events & EPOLLOUT) {
+        if (flush_output(conn)) {
+            conn_close(conn);
+            return;
+        }
+        if (conn->out_len == 0 && reactor->handlers.on_write
+                && reactor->handlers.on_write(conn) < 0) {
+            conn_close(conn);
+            return;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        conn->readable = 1;
+    }
+
+    // also resumes a connection paused until its output was flushed
+    if (conn->readable && conn_pending(conn) < REACTOR_MAX_PENDING) {
+        if (reactor->handlers.on_read == NULL) {
+            if (events & (EPOLLHUP | EPOLLERR)) conn_close(conn);
+        } else if (reactor->handlers.on_read(conn) < 0) {
+            conn_close(conn);
+        }
+    }
+}
+
+/**
+ * Closes & frees the connections marked as closing
+ *
+ * @param reactor: reactor
+ */
+static void release_closing(struct reactor *reactor) {
+    struct reactor_conn *conn;
+
+    while ((conn = reactor->closing)) {
+        unlink_conn(&reactor->closing, conn);
+        if (reactor->handlers.on_close) reactor->handlers.on_close(conn);
+        close(conn->fd);
+        tcp_buf_put(conn->out_buf, conn->out_cap);
+        free(conn);
+    }
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+struct reactor *reactor_create(const struct reactor_handlers *handlers, void *ctx) {
+    struct reactor *reactor = calloc(1, sizeof(struct reactor));
+
+    if (reactor == NULL) {
+        return NULL;
+    }
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd < 0) {
+        free(reactor);
+        return NULL;
+    }
+
+    if (handlers) reactor->handlers = *handlers;
+    reactor->ctx = ctx;
+
+    return reactor;
+}
+
+void *reactor_ctx(struct reactor *reactor) {
+    return reactor->ctx;
+}
+
+int reactor_add_listener(struct reactor *reactor, int sockfd) {
+    if (set_nonblocking(sockfd, 1)) {
+        return -1;
+    }
+
+    // exclusive wake up: a connection wakes a single reactor sharing the socket
+    return register_socket(reactor, sockfd, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, 1) ? 0 : -1;
+}
+
+struct reactor_conn *reactor_add(struct reactor *reactor, int sockfd, char *ip) {
+    struct reactor_conn *conn;
+
+    if (set_nonblocking(sockfd, 1)) {
+        return NULL;
+    }
+
+    conn = register_socket(reactor, sockfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, 0);
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    if (ip) {
+        strncpy(conn->ip, ip, INET6_ADDRSTRLEN - 1);
+    }
+
+    return conn;
+}
+
+int reactor_run(struct reactor *reactor) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct reactor_conn *conn;
+    int count, i;
+
+    reactor->stop = 0;
+
+    while (!reactor->stop) {
+        count = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        for (i = 0; i < count; i++) {
+            conn = events[i].data.ptr;
+
+            // a connection closed earlier in the batch is only released after it
+            if (conn->closing) continue;
+
+            if (conn->listener) accept_connections(reactor, conn);
+            else dispatch(reactor, conn, events[i].events);
+        }
+
+        release_closing(reactor);
+    }
+
+    return 0;
+}
+
+void reactor_stop(struct reactor *reactor) {
+    reactor->stop = 1;
+}
+
+void reactor_destroy(struct reactor *reactor) {
+    struct reactor_conn *conn;
+
+    while ((conn = reactor->conns)) {
+        unlink_conn(&reactor->conns, conn);
+        if (conn->listener) {
+            // the listening socket belongs to the caller
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            free(conn);
+        } else {
+            conn->closing = 1;
+            link_conn(&reactor->closing, conn);
+        }
+    }
+    release_closing(reactor);
+
+    close(reactor->epfd);
+    free(reactor);
+}
+
+ssize_t conn_read(struct reactor_conn *conn, char *out_buffer, ssize_t max_length) {
+    ssize_t bytes_read;
+
+    do bytes_read = recv(conn->fd, out_buffer, max_length, 0);
+    while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // socket drained: wait for the next edge
+        conn->readable = 0;
+        return ERR_TCP_WOULD_BLOCK;
+    }
+
+    return bytes_read;
+}
+
+int conn_write(struct reactor_conn *conn, char *buffer, ssize_t length) {
+    ssize_t bytes_sent;
+    size_t new_cap;
+    char *new_buf;
+
+    // send directly while no output is waiting (keeps the data ordered)
+    if (conn->out_off == conn->out_len) {
+        conn->out_off = conn->out_len = 0;
+
+        while (length > 0) {
+            bytes_sent = send(conn->fd, buffer, length, MSG_NOSIGNAL);
+            if (bytes_sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            buffer += bytes_sent;
+            length -= bytes_sent;
+        }
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    // buffer the remaining data: first reuse the space already flushed
+    if (conn->out_off > 0 && conn->out_len + length > conn->out_cap) {
+        memmove(conn->out_buf, conn->out_buf + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+
+    // swapped for a buffer of a larger class of the pool
+    if (conn->out_len + length > conn->out_cap) {
+        new_buf = tcp_buf_get(conn->out_len + length, &new_cap);
+        if (new_buf == NULL) {
+            return -1;
+        }
+        if (conn->out_len) memcpy(new_buf, conn->out_buf, conn->out_len);
+        tcp_buf_put(conn->out_buf, conn->out_cap);
+        conn->out_buf = new_buf;
+        conn->out_cap = new_cap;
+    }
+
+    memcpy(conn->out_buf + conn->out_len, buffer, length);
+    conn->out_len += length;
+
+    return 0;
+}
+
+size_t conn_pending(struct reactor_conn *conn) {
+    return conn->out_len - conn->out_off;
+}
+
+const char *conn_peer(struct reactor_conn *conn) {
+    if (conn->ip[0] == '\0' && conn->peer.ss_family != AF_UNSPEC) {
+        format_peer(conn->fd, &conn->peer, conn->ip);
+    }
+
+    return conn->ip;
+}
+
+void conn_close(struct reactor_conn *conn) {
+    struct reactor *reactor = conn->reactor;
+
+    if (conn->closing) {
+        return;
+    }
+
+    conn->closing = 1;
+    unlink_conn(&reactor->conns, conn);
+    link_conn(&reactor->closing, conn);
+}
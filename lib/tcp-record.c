@@ -0,0 +1,339 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Traffic recording & loading of the recordings
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tcp-internal.h"
+#include "tcp-record.h"
+
+#define RECORD_STACK_IOV    16      // buffers recorded without gathering them first
+
+int record_fd = -1;
+static int record_file = -1;        // file opened by tcp_record_start, until tcp_record_stop
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Fills a record header
+ *
+ * @param out_header: returned header (TCP_RECORD_HEADER bytes)
+ * @param sockfd: socket file descriptor
+ * @param type: kind of record
+ * @param length: amount of bytes sent or received
+ */
+static void fill_header(char *out_header, int sockfd, enum tcp_record_type type, size_t length) {
+    uint64_t time_us;
+    uint32_t u32;
+
+    time_us = htobe64(monotonic_ns() / 1000);
+    memcpy(out_header, &time_us, sizeof time_us);
+    u32 = htobe32(getpid());
+    memcpy(out_header + 8, &u32, sizeof u32);
+    u32 = htobe32(sockfd);
+    memcpy(out_header + 12, &u32, sizeof u32);
+    out_header[16] = type;
+    u32 = htobe32(length);
+    memcpy(out_header + 17, &u32, sizeof u32);
+}
+
+/**
+ * Appends a record: a single write, the records of several threads
+ * or processes do not interleave (O_APPEND)
+ * A write which fails (e.g. ENOSPC) disables the recording of the process: a record cut
+ * by a short write is truncated, unless another process has appended after it
+ * (the file stays open: the other threads may still be writing to it)
+ *
+ * @param iov: header & data of the record
+ * @param iovcnt: amount of buffers
+ */
+static void append_record(const struct iovec *iov, int iovcnt) {
+    int fd = recording();
+    size_t length = 0;
+    struct stat st;
+    ssize_t rv;
+    off_t end;
+    int i;
+
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < iovcnt; i++) length += iov[i].iov_len;
+
+    // a failed recording must not fail the traffic: the record is lost
+    do rv = writev(fd, iov, iovcnt);
+    while (rv < 0 && errno == EINTR);
+
+    if (rv >= 0 && (size_t) rv == length) {
+        return;
+    }
+
+    // the file offset follows the end of the data appended by this write
+    if (rv > 0 && (end = lseek(fd, 0, SEEK_CUR)) >= rv
+            && !fstat(fd, &st) && st.st_size == end) {
+        rv = ftruncate(fd, end - rv);
+    }
+    __atomic_store_n(&record_fd, -1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Starts recording if the TCP_RECORD environment variable is set, once the lib is loaded
+ */
+__attribute__((constructor))
+static void record_from_env(void) {
+    const char *path = getenv("TCP_RECORD");
+    int saved_errno = errno;
+
+    if (path != NULL && *path) {
+        tcp_record_start(path);
+    }
+    errno = saved_errno;
+}
+
+
+/* INTERNAL HOOKS */
+
+void record_send(int sockfd, const void *buffer, size_t length) {
+    char header[TCP_RECORD_HEADER];
+    struct iovec iov[2];
+    int saved_errno = errno;
+
+    fill_header(header, sockfd, TCP_RECORD_SEND, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = (void *) buffer;
+    iov[1].iov_len = length;
+    append_record(iov, 2);
+    errno = saved_errno;
+}
+
+void record_sendv(int sockfd, const struct iovec *iov, size_t iovcnt, size_t length) {
+    char header[TCP_RECORD_HEADER];
+    struct iovec out_iov[RECORD_STACK_IOV + 1];
+    char *gathered = NULL;          // data sent, if spread over too many buffers
+    size_t i, len, offset = 0;
+    int count = 1;
+    int saved_errno = errno;
+
+    fill_header(header, sockfd, TCP_RECORD_SEND, length);
+    out_iov[0].iov_base = header;
+    out_iov[0].iov_len = sizeof header;
+
+    if (iovcnt > RECORD_STACK_IOV && (gathered = malloc(length)) == NULL) {
+        errno = saved_errno;
+        return;
+    }
+
+    // only the bytes actually sent
+    for (i = 0; i < iovcnt && offset < length; i++) {
+        len = iov[i].iov_len < length - offset ? iov[i].iov_len : length - offset;
+        if (gathered) {
+            memcpy(gathered + offset, iov[i].iov_base, len);
+        } else {
+            out_iov[count].iov_base = iov[i].iov_base;
+            out_iov[count].iov_len = len;
+            count++;
+        }
+        offset += len;
+    }
+    if (gathered) {
+        out_iov[1].iov_base = gathered;
+        out_iov[1].iov_len = length;
+        count = 2;
+    }
+
+    append_record(out_iov, count);
+    free(gathered);
+    errno = saved_errno;
+}
+
+void record_recv(int sockfd, size_t length) {
+    char header[TCP_RECORD_HEADER];
+    struct iovec iov;
+    int saved_errno = errno;
+
+    fill_header(header, sockfd, TCP_RECORD_RECV, length);
+    iov.iov_base = header;
+    iov.iov_len = sizeof header;
+    append_record(&iov, 1);
+    errno = saved_errno;
+}
+
+void record_close(int sockfd) {
+    char header[TCP_RECORD_HEADER];
+    struct iovec iov;
+    int saved_errno = errno;
+
+    fill_header(header, sockfd, TCP_RECORD_CLOSE, 0);
+    iov.iov_base = header;
+    iov.iov_len = sizeof header;
+    append_record(&iov, 1);
+    errno = saved_errno;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+int tcp_record_start(const char *path) {
+    char header[TCP_RECORD_FILE_HEADER];
+    uint32_t magic = htobe32(TCP_RECORD_MAGIC);
+    uint16_t version = htobe16(TCP_RECORD_VERSION);
+    struct stat st;
+    int fd;
+
+    if (record_file >= 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // new file: write its header, otherwise it must be a recording
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        memset(header, 0, sizeof header);
+        memcpy(header, &magic, sizeof magic);
+        memcpy(header + 4, &version, sizeof version);
+        if (write(fd, header, sizeof header) != sizeof header) {
+            close(fd);
+            return -1;
+        }
+    } else if (pread(fd, header, sizeof header, 0) != sizeof header
+            || memcmp(header, &magic, sizeof magic)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    record_file = fd;
+    __atomic_store_n(&record_fd, fd, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void tcp_record_stop(void) {
+    __atomic_store_n(&record_fd, -1, __ATOMIC_RELAXED);
+    if (record_file >= 0) {
+        close(record_file);
+        record_file = -1;
+    }
+}
+
+int tcp_record_load(const char *path, struct tcp_recording *out_recording) {
+    struct tcp_record *records = NULL, *grown;
+    size_t cap = 0, count = 0, offset;
+    uint64_t time_us;
+    uint32_t u32;
+    uint16_t version;
+    ssize_t bytes_read = 0;
+    struct stat st;
+    char *raw, *header;
+    int fd;
+
+    memset(out_recording, 0, sizeof *out_recording);
+
+    // the whole file is kept: the records point to the data sent
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) || (raw = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    for (offset = 0; offset < (size_t) st.st_size; offset += bytes_read) {
+        bytes_read = read(fd, raw + offset, st.st_size - offset);
+        if (bytes_read <= 0) {
+            if (bytes_read < 0 && errno == EINTR) {
+                bytes_read = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    close(fd);
+    if (offset < (size_t) st.st_size) {
+        free(raw);
+        if (bytes_read == 0) errno = EIO;
+        return -1;
+    }
+
+    if (st.st_size >= TCP_RECORD_FILE_HEADER) {
+        memcpy(&u32, raw, sizeof u32);
+        memcpy(&version, raw + 4, sizeof version);
+    }
+    if (st.st_size < TCP_RECORD_FILE_HEADER || be32toh(u32) != TCP_RECORD_MAGIC
+            || be16toh(version) != TCP_RECORD_VERSION) {
+        free(raw);
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (offset = TCP_RECORD_FILE_HEADER; offset + TCP_RECORD_HEADER <= (size_t) st.st_size; ) {
+        if (count == cap) {
+            cap = cap ? 2 * cap : 1024;
+            if ((grown = realloc(records, cap * sizeof(struct tcp_record))) == NULL) {
+                free(records);
+                free(raw);
+                return -1;
+            }
+            records = grown;
+        }
+
+        header = raw + offset;
+        memcpy(&time_us, header, sizeof time_us);
+        records[count].time_us = be64toh(time_us);
+        memcpy(&u32, header + 8, sizeof u32);
+        records[count].pid = be32toh(u32);
+        memcpy(&u32, header + 12, sizeof u32);
+        records[count].sockfd = be32toh(u32);
+        records[count].type = (unsigned char) header[16];
+        memcpy(&u32, header + 17, sizeof u32);
+        records[count].length = be32toh(u32);
+        records[count].data = NULL;
+        offset += TCP_RECORD_HEADER;
+
+        if (records[count].type > TCP_RECORD_CLOSE) {
+            free(records);
+            free(raw);
+            errno = EPROTO;
+            return -1;
+        }
+
+        // only the sends carry their data, a record cut by the end of the file is dropped
+        if (records[count].type == TCP_RECORD_SEND) {
+            if (offset + records[count].length > (size_t) st.st_size) break;
+            records[count].data = raw + offset;
+            offset += records[count].length;
+        }
+        count++;
+    }
+
+    out_recording->records = records;
+    out_recording->count = count;
+    out_recording->raw = raw;
+    return 0;
+}
+
+void tcp_record_free(struct tcp_recording *recording) {
+    free(recording->records);
+    free(recording->raw);
+    memset(recording, 0, sizeof *recording);
+}
@@ -0,0 +1,658 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Shared-memory transport for co-located processes: two single-producer single-consumer
+ * rings in a memfd shared over a unix socket rendezvous (SCM_RIGHTS)
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#define _GNU_SOURCE     // memfd_create, F_ADD_SEALS, POLLRDHUP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "tcp-internal.h"
+#include "tcp-shm.h"
+
+#define SHM_MAGIC       0x4c42524dU     // rendezvous message tag
+#define SHM_VERSION     1
+#define SHM_HEADER_SIZE 4096            // ring headers page, the rings data follow it
+#define SHM_CACHE_LINE  64
+#define SHM_SEALS       (F_SEAL_SHRINK | F_SEAL_SEAL)   // the mapped size cannot shrink
+
+// acquire/release accesses to the fields shared between the processes
+#define LOAD(field)             __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define STORE(field, value)     __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define FENCE()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/** Ring header in the shared memory, each index on its own cache line */
+struct shm_ring {
+    uint64_t head __attribute__((aligned(SHM_CACHE_LINE)));     // bytes consumed (reader)
+    uint64_t tail __attribute__((aligned(SHM_CACHE_LINE)));     // bytes produced (writer)
+    int reader_waiting __attribute__((aligned(SHM_CACHE_LINE)));// 1 if the reader sleeps
+    int writer_waiting;         // 1 if the writer sleeps
+    int closed;                 // 1 once the writer has closed
+};
+
+/** Rendezvous message sent by the client along with the file descriptors */
+struct shm_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;
+};
+
+/** File descriptors sent by the client, in order */
+enum { FD_MEM, FD_C2S_DATA, FD_C2S_SPACE, FD_S2C_DATA, FD_S2C_SPACE, FD_COUNT };
+
+/** Connection state */
+struct tcp_shm {
+    int sockfd;                 // rendezvous socket, kept to detect the death of the peer
+    char *map;                  // shared memory mapping
+    size_t map_size;
+    uint64_t ring_size;         // size of each ring (power of 2)
+    struct shm_ring *tx;        // ring written by this process
+    struct shm_ring *rx;        // ring read by this process
+    char *tx_data;
+    char *rx_data;
+    int tx_data_efd;            // signalled to the peer: data written in tx
+    int tx_space_efd;           // signalled by the peer: space freed in tx
+    int rx_data_efd;            // signalled by the peer: data written in rx
+    int rx_space_efd;           // signalled to the peer: space freed in rx
+    int peer_gone;              // 1 once the rendezvous socket has been hung up
+    long long deadline;         // absolute deadline of the sends & receives, -1 if none
+};
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Translates a shared-memory address into the unix address of its rendezvous socket
+ *
+ * @param address: shared-memory address ("shm:/path" or "shm:@name")
+ * @param out_address: returned unix socket address
+ * @param size: size of out_address
+ *
+ * @return 0 if the address was translated, -1 otherwise (errno is set)
+ */
+static int rendezvous_address(char *address, char *out_address, size_t size) {
+    if (strncmp(address, TCP_SHM_PREFIX, strlen(TCP_SHM_PREFIX))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((size_t) snprintf(out_address, size, "%s%s", TCP_UNIX_PREFIX,
+                            address + strlen(TCP_SHM_PREFIX)) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Maps the shared memory & sets the rings of each side
+ *
+ * @param shm: connection, its ring_size being set (at most TCP_SHM_MAX_RING: the size
+ *      of the mapping can not overflow)
+ * @param memfd: shared memory file descriptor
+ * @param server: 1 on the server side (reads the client to server ring)
+ *
+ * @return 0 if the memory is mapped, -1 otherwise (errno is set)
+ */
+static int map_rings(struct tcp_shm *shm, int memfd, int server) {
+    struct shm_ring *c2s, *s2c;
+
+    shm->map_size = SHM_HEADER_SIZE + 2 * shm->ring_size;
+    shm->map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm->map == MAP_FAILED) {
+        shm->map = NULL;
+        return -1;
+    }
+
+    c2s = (struct shm_ring *) shm->map;
+    s2c = (struct shm_ring *) (shm->map + SHM_HEADER_SIZE / 2);
+
+    shm->tx = server ? s2c : c2s;
+    shm->rx = server ? c2s : s2c;
+    shm->tx_data = shm->map + SHM_HEADER_SIZE + (server ? shm->ring_size : 0);
+    shm->rx_data = shm->map + SHM_HEADER_SIZE + (server ? 0 : shm->ring_size);
+
+    return 0;
+}
+
+/**
+ * Allocates a connection state with no resource attached
+ *
+ * @return the connection, NULL if an error occured (errno is set)
+ */
+static struct tcp_shm *alloc_shm(void) {
+    struct tcp_shm *shm = calloc(1, sizeof(struct tcp_shm));
+
+    if (shm != NULL) {
+        shm->sockfd = shm->tx_data_efd = shm->tx_space_efd = -1;
+        shm->rx_data_efd = shm->rx_space_efd = -1;
+        shm->deadline = -1;
+    }
+
+    return shm;
+}
+
+/**
+ * Releases the resources of a connection
+ *
+ * @param shm: connection
+ */
+static void free_shm(struct tcp_shm *shm) {
+    int saved_errno = errno;
+
+    if (shm->map) munmap(shm->map, shm->map_size);
+    if (shm->sockfd >= 0) close(shm->sockfd);
+    if (shm->tx_data_efd >= 0) close(shm->tx_data_efd);
+    if (shm->tx_space_efd >= 0) close(shm->tx_space_efd);
+    if (shm->rx_data_efd >= 0) close(shm->rx_data_efd);
+    if (shm->rx_space_efd >= 0) close(shm->rx_space_efd);
+    free(shm);
+
+    errno = saved_errno;
+}
+
+/**
+ * Closes the file descriptors received with a message which is rejected
+ *
+ * @param msg: message returned by recvmsg
+ */
+static void close_received(struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    int *fds;
+    size_t i, count;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        fds = (int *) CMSG_DATA(cmsg);
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) close(fds[i]);
+    }
+}
+
+/**
+ * Wakes the peer up
+ *
+ * @param efd: eventfd the peer waits on
+ */
+static void signal_peer(int efd) {
+    uint64_t one = 1;
+    ssize_t rv;
+
+    // no error to report: EAGAIN means the counter is full & wakes the peer up anyway
+    rv = write(efd, &one, sizeof one);
+    (void) rv;
+}
+
+/**
+ * Waits for a wakeup from the peer, the death of the peer or the deadline
+ *
+ * @param shm: connection
+ * @param efd: eventfd signalled by the peer
+ *
+ * @return either
+ *      0 if the peer signalled the eventfd
+ *      1 if the peer is gone
+ *      ERR_TCP_TIMEOUT if the deadline has passed
+ *      -1 if an error occured (errno is set)
+ */
+static int wait_peer(struct tcp_shm *shm, int efd) {
+    struct pollfd pfds[2];
+    long long remaining;
+    uint64_t count;
+    int rv;
+
+    pfds[0].fd = efd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = shm->sockfd;
+    pfds[1].events = POLLRDHUP;
+
+    while (1) {
+        if (shm->deadline < 0) {
+            remaining = -1;
+        } else if ((remaining = shm->deadline - monotonic_ms()) <= 0) {
+            errno = ETIMEDOUT;
+            return ERR_TCP_TIMEOUT;
+        }
+
+        rv = poll(pfds, 2, remaining > INT_MAX ? INT_MAX : (int) remaining);
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            // reset the counter (non-blocking)
+            if (read(efd, &count, sizeof count) < 0 && errno != EAGAIN) return -1;
+            return 0;
+        }
+
+        if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Reads the data available in the receiving ring, waits until some data is available
+ *
+ * @param shm: connection
+ * @param iov: buffers to fill
+ * @param iovcnt: amount of buffers
+ *
+ * @return see shm_receive
+ */
+static ssize_t ring_read(struct tcp_shm *shm, struct iovec *iov, int iovcnt) {
+    struct shm_ring *ring = shm->rx;
+    uint64_t head = ring->head, tail;
+    size_t available, copied = 0, chunk, offset;
+    int i, rv;
+
+    // wait for data: announce the sleep, then check again before sleeping
+    while ((tail = LOAD(ring->tail)) == head) {
+        if (LOAD(ring->closed) || shm->peer_gone) {
+            return 0;
+        }
+
+        STORE(ring->reader_waiting, 1);
+        FENCE();
+        if (LOAD(ring->tail) != head || LOAD(ring->closed)) {
+            STORE(ring->reader_waiting, 0);
+            continue;
+        }
+
+        rv = wait_peer(shm, shm->rx_data_efd);
+        STORE(ring->reader_waiting, 0);
+
+        if (rv == 1) {
+            // the data written before the death is still read
+            shm->peer_gone = 1;
+        } else if (rv) {
+            return rv;
+        }
+    }
+
+    available = tail - head;
+
+    for (i = 0; i < iovcnt && available > 0; i++) {
+        size_t length = iov[i].iov_len < available ? iov[i].iov_len : available;
+        char *dest = iov[i].iov_base;
+
+        // copy in up to two parts (wrap around the end of the ring)
+        while (length > 0) {
+            offset = (head + copied) & (shm->ring_size - 1);
+            chunk = shm->ring_size - offset;
+            if (chunk > length) chunk = length;
+
+            memcpy(dest, shm->rx_data + offset, chunk);
+            dest += chunk;
+            copied += chunk;
+            length -= chunk;
+            available -= chunk;
+        }
+    }
+
+    // give the space back, wake the writer up if it waits for it
+    STORE(ring->head, head + copied);
+    FENCE();
+    if (LOAD(ring->writer_waiting)) {
+        signal_peer(shm->rx_space_efd);
+    }
+
+    return copied;
+}
+
+/**
+ * Writes all the data in the sending ring, waits while it is full
+ *
+ * @param shm: connection
+ * @param iov: buffers containing the data
+ * @param iovcnt: amount of buffers
+ *
+ * @return see shm_send
+ */
+static int ring_write(struct tcp_shm *shm, struct iovec *iov, int iovcnt) {
+    struct shm_ring *ring = shm->tx;
+    uint64_t head, tail = ring->tail;
+    size_t space, length, chunk, offset;
+    char *src;
+    int i, rv;
+
+    for (i = 0; i < iovcnt; i++) {
+        src = iov[i].iov_base;
+        length = iov[i].iov_len;
+
+        while (length > 0) {
+            if (shm->peer_gone) {
+                errno = EPIPE;
+                return -1;
+            }
+
+            head = LOAD(ring->head);
+            space = shm->ring_size - (tail - head);
+
+            // ring full: announce the sleep, then check again before sleeping
+            if (space == 0) {
+                STORE(ring->writer_waiting, 1);
+                FENCE();
+                if (LOAD(ring->head) != head) {
+                    STORE(ring->writer_waiting, 0);
+                    continue;
+                }
+
+                rv = wait_peer(shm, shm->tx_space_efd);
+                STORE(ring->writer_waiting, 0);
+
+                if (rv == 1) shm->peer_gone = 1;
+                else if (rv) return rv;
+                continue;
+            }
+
+            offset = tail & (shm->ring_size - 1);
+            chunk = shm->ring_size - offset;
+            if (chunk > space) chunk = space;
+            if (chunk > length) chunk = length;
+
+            memcpy(shm->tx_data + offset, src, chunk);
+            src += chunk;
+            length -= chunk;
+            tail += chunk;
+
+            // publish the data, wake the reader up if it waits for it
+            STORE(ring->tail, tail);
+            FENCE();
+            if (LOAD(ring->reader_waiting)) {
+                signal_peer(shm->tx_data_efd);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads from the connection of a stream (see tcp_stream_ops)
+ */
+static ssize_t stream_read(struct tcp_stream *stream, struct iovec *iov, int iovcnt) {
+    struct tcp_shm *shm = stream->transport;
+
+    shm->deadline = stream->deadline;
+    return ring_read(shm, iov, iovcnt);
+}
+
+/**
+ * Writes on the connection of a stream (see tcp_stream_ops)
+ */
+static int stream_write(struct tcp_stream *stream, struct iovec *iov, int iovcnt) {
+    struct tcp_shm *shm = stream->transport;
+
+    shm->deadline = stream->deadline;
+    return ring_write(shm, iov, iovcnt);
+}
+
+static const struct tcp_stream_ops shm_ops = { stream_read, stream_write };
+
+
+/* HEADER IMPLEMENTATION */
+
+int shm_listen(char *address, int backlog) {
+    char unix_address[sizeof(TCP_UNIX_PREFIX) + PATH_MAX];
+
+    if (rendezvous_address(address, unix_address, sizeof unix_address)) {
+        return ERR_TCP_CREATE_SOCK;
+    }
+
+    return server_listen(unix_address, backlog);
+}
+
+struct tcp_shm *shm_connect(char *address, size_t ring_size) {
+    char unix_address[sizeof(TCP_UNIX_PREFIX) + PATH_MAX];
+    char control[CMSG_SPACE(FD_COUNT * sizeof(int))];
+    int fds[FD_COUNT];
+    struct shm_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    struct tcp_shm *shm;
+    char ack;
+    int i;
+
+    if (ring_size > TCP_SHM_MAX_RING) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (rendezvous_address(address, unix_address, sizeof unix_address)) {
+        return NULL;
+    }
+
+    if ((shm = alloc_shm()) == NULL) {
+        return NULL;
+    }
+
+    // power of 2 ring size: the offsets are computed with a mask
+    shm->ring_size = 1;
+    while (shm->ring_size < (ring_size ? ring_size : TCP_SHM_RING_SIZE)) {
+        shm->ring_size <<= 1;
+    }
+
+    shm->sockfd = client_connect(unix_address, NULL);
+    if (shm->sockfd < 0) {
+        shm->sockfd = -1;
+        free_shm(shm);
+        return NULL;
+    }
+
+    // shared memory (zero filled: empty rings) & wakeup counters
+    for (i = 0; i < FD_COUNT; i++) fds[i] = -1;
+    fds[FD_MEM] = memfd_create("tcp-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    for (i = FD_C2S_DATA; i < FD_COUNT; i++) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    for (i = 0; i < FD_COUNT && fds[i] >= 0; i++);
+    if (i < FD_COUNT
+            || ftruncate(fds[FD_MEM], SHM_HEADER_SIZE + 2 * shm->ring_size)
+            || fcntl(fds[FD_MEM], F_ADD_SEALS, SHM_SEALS | F_SEAL_GROW)
+            || map_rings(shm, fds[FD_MEM], 0)) {
+        goto error;
+    }
+
+    shm->tx_data_efd = fds[FD_C2S_DATA];
+    shm->tx_space_efd = fds[FD_C2S_SPACE];
+    shm->rx_data_efd = fds[FD_S2C_DATA];
+    shm->rx_space_efd = fds[FD_S2C_SPACE];
+
+    // send the rings to the server
+    hello.magic = SHM_MAGIC;
+    hello.version = SHM_VERSION;
+    hello.ring_size = shm->ring_size;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof hello;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(FD_COUNT * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, FD_COUNT * sizeof(int));
+
+    if (sendmsg(shm->sockfd, &msg, MSG_NOSIGNAL) != sizeof hello
+            || expect_data(shm->sockfd, &ack, 1)) {
+        goto error;
+    }
+
+    // the mapping keeps the memory
+    close(fds[FD_MEM]);
+    return shm;
+
+error:
+    // the eventfds already attached are closed with the connection
+    for (i = 0; i < FD_COUNT; i++) {
+        if (fds[i] >= 0 && (i == FD_MEM || shm->tx_data_efd < 0)) close(fds[i]);
+    }
+    free_shm(shm);
+    return NULL;
+}
+
+struct tcp_shm *shm_attach(int sockfd) {
+    char control[CMSG_SPACE(FD_COUNT * sizeof(int))];
+    int fds[FD_COUNT];
+    struct shm_hello hello;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    struct tcp_shm *shm;
+    struct stat st;
+    ssize_t bytes_read;
+    int i, seals;
+
+    if ((shm = alloc_shm()) == NULL) {
+        return NULL;
+    }
+    shm->sockfd = sockfd;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof hello;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    do bytes_read = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0) {
+        free_shm(shm);
+        return NULL;
+    }
+
+    // exactly the descriptors of the rings, none dropped by the kernel (MSG_CTRUNC)
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (bytes_read != sizeof hello || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL
+            || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(FD_COUNT * sizeof(int))
+            || CMSG_NXTHDR(&msg, cmsg) != NULL) {
+        close_received(&msg);
+        errno = EPROTO;
+        free_shm(shm);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), FD_COUNT * sizeof(int));
+
+    shm->tx_data_efd = fds[FD_S2C_DATA];
+    shm->tx_space_efd = fds[FD_S2C_SPACE];
+    shm->rx_data_efd = fds[FD_C2S_DATA];
+    shm->rx_space_efd = fds[FD_C2S_SPACE];
+    shm->ring_size = hello.ring_size;
+
+    // check the rings before trusting their size: bounded, the size of the mapping can not
+    // overflow, & sealed, the client cannot shrink the memory under the mapping (SIGBUS)
+    if (hello.magic != SHM_MAGIC || hello.version != SHM_VERSION
+            || hello.ring_size == 0 || hello.ring_size > TCP_SHM_MAX_RING
+            || (hello.ring_size & (hello.ring_size - 1))
+            || (seals = fcntl(fds[FD_MEM], F_GET_SEALS)) < 0
+            || (seals & SHM_SEALS) != SHM_SEALS
+            || fstat(fds[FD_MEM], &st)
+            || (uint64_t) st.st_size < SHM_HEADER_SIZE + 2 * hello.ring_size) {
+        errno = EPROTO;
+        close(fds[FD_MEM]);
+        free_shm(shm);
+        return NULL;
+    }
+
+    i = map_rings(shm, fds[FD_MEM], 1);
+    close(fds[FD_MEM]);
+
+    if (i || send_data(sockfd, "", 1)) {
+        free_shm(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+void shm_close(struct tcp_shm *shm) {
+    if (shm == NULL) {
+        return;
+    }
+
+    // end of stream for the peer reader
+    STORE(shm->tx->closed, 1);
+    FENCE();
+    signal_peer(shm->tx_data_efd);
+
+    free_shm(shm);
+}
+
+void shm_set_deadline(struct tcp_shm *shm, long long deadline) {
+    shm->deadline = deadline;
+}
+
+int shm_send(struct tcp_shm *shm, char *buffer, ssize_t length) {
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+
+    return ring_write(shm, &iov, 1);
+}
+
+ssize_t shm_receive(struct tcp_shm *shm, char *out_buffer, ssize_t max_length) {
+    struct iovec iov;
+
+    iov.iov_base = out_buffer;
+    iov.iov_len = max_length;
+
+    return ring_read(shm, &iov, 1);
+}
+
+int shm_expect(struct tcp_shm *shm, char *out_buffer, ssize_t length) {
+    ssize_t bytes_read;
+
+    while (length > 0) {
+        bytes_read = shm_receive(shm, out_buffer, length);
+
+        if (bytes_read == 0) {
+            return ERR_TCP_PEER_CLOSED;
+        }
+
+        if (bytes_read < 0) {
+            return bytes_read == ERR_TCP_TIMEOUT ? ERR_TCP_TIMEOUT : ERR_TCP_RECV_DATA;
+        }
+
+        out_buffer += bytes_read;
+        length -= bytes_read;
+    }
+
+    return 0;
+}
+
+struct tcp_stream *shm_stream_open(struct tcp_shm *shm, size_t buf_size) {
+    return tcp_stream_open_ops(&shm_ops, shm, buf_size);
+}
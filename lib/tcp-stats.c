@@ -0,0 +1,194 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * TCP library instrumentation: per-process & per-socket counters of the data calls,
+ * the system calls they turned into & the time spent waiting in them
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "tcp-internal.h"
+#include "tcp-stats.h"
+
+#ifdef TCP_STATS
+
+// counters updated with relaxed atomic additions: exact totals, no ordering needed
+#define COUNT(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+static struct tcp_stats process_stats;                  // whole process
+static struct tcp_stats socket_stats[TCP_STATS_MAX_FDS];// per socket file descriptor
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Gets the counters of a direction for the process & the socket
+ *
+ * @param sockfd: socket file descriptor
+ * @param dir: TCP_STATS_SEND or TCP_STATS_RECV
+ * @param out_socket: returned socket counters, NULL if the socket is not tracked
+ *
+ * @return the process counters
+ */
+static struct tcp_io_stats *get_io(int sockfd, int dir, struct tcp_io_stats **out_socket) {
+    *out_socket = NULL;
+
+    if (sockfd >= 0 && sockfd < TCP_STATS_MAX_FDS) {
+        *out_socket = dir == TCP_STATS_SEND ? &socket_stats[sockfd].send
+                                            : &socket_stats[sockfd].recv;
+    }
+
+    return dir == TCP_STATS_SEND ? &process_stats.send : &process_stats.recv;
+}
+
+/**
+ * Counts a wait in a histogram
+ *
+ * @param io: counters
+ * @param start_ns: time before the wait
+ * @param end_ns: time after the wait
+ */
+static void count_wait(struct tcp_io_stats *io, long long start_ns, long long end_ns) {
+    unsigned long long us = (end_ns - start_ns) / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (bucket >= TCP_STATS_BUCKETS) bucket = TCP_STATS_BUCKETS - 1;
+    COUNT(io->wait_hist[bucket], 1);
+}
+
+/**
+ * Copies counters, resetting them if asked
+ *
+ * @param out_stats: destination
+ * @param stats: counters to copy
+ * @param reset: 1 to reset the counters
+ */
+static void copy_stats(struct tcp_stats *out_stats, struct tcp_stats *stats, int reset) {
+    // the structure only holds unsigned long counters
+    unsigned long *src = (unsigned long *) stats;
+    unsigned long *dst = (unsigned long *) out_stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(struct tcp_stats) / sizeof(unsigned long); i++) {
+        dst[i] = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED)
+                       : __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+
+/* INTERNAL HOOKS */
+
+void stats_call(int sockfd, int dir) {
+    struct tcp_io_stats *sock, *proc = get_io(sockfd, dir, &sock);
+
+    COUNT(proc->calls, 1);
+    if (sock) COUNT(sock->calls, 1);
+}
+
+void stats_syscall(int sockfd, int dir, ssize_t rv, size_t requested, long long start_ns) {
+    struct tcp_io_stats *sock, *proc = get_io(sockfd, dir, &sock);
+    struct tcp_io_stats *io[2] = { proc, sock };
+    long long end_ns = stats_clock_ns();
+    int i;
+
+    for (i = 0; i < 2 && io[i] != NULL; i++) {
+        COUNT(io[i]->syscalls, 1);
+
+        if (rv >= 0) {
+            COUNT(io[i]->bytes, rv);
+            if ((size_t) rv < requested) COUNT(io[i]->short_ops, 1);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            COUNT(io[i]->would_block, 1);
+        } else if (errno != EINTR) {
+            COUNT(io[i]->errors, 1);
+        }
+
+        count_wait(io[i], start_ns, end_ns);
+    }
+}
+
+void stats_wait(int sockfd, int dir, long long start_ns) {
+    struct tcp_io_stats *sock, *proc = get_io(sockfd, dir, &sock);
+    long long end_ns = stats_clock_ns();
+
+    count_wait(proc, start_ns, end_ns);
+    if (sock) count_wait(sock, start_ns, end_ns);
+}
+
+void stats_forget(int sockfd) {
+    struct tcp_stats unused;
+
+    if (sockfd >= 0 && sockfd < TCP_STATS_MAX_FDS) {
+        copy_stats(&unused, &socket_stats[sockfd], 1);
+    }
+}
+
+size_t stats_iov_len(const struct iovec *iov, size_t iovcnt) {
+    size_t length = 0;
+
+    while (iovcnt--) {
+        length += iov[iovcnt].iov_len;
+    }
+
+    return length;
+}
+
+#endif
+
+
+/* HEADER IMPLEMENTATION */
+
+int tcp_stats_enabled(void) {
+#ifdef TCP_STATS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int tcp_stats_snapshot(int sockfd, struct tcp_stats *out_stats, int reset) {
+#ifdef TCP_STATS
+    if (sockfd < 0) {
+        copy_stats(out_stats, &process_stats, reset);
+        return 0;
+    }
+
+    if (sockfd >= TCP_STATS_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    copy_stats(out_stats, &socket_stats[sockfd], reset);
+    return 0;
+#else
+    (void) sockfd;
+    (void) out_stats;
+    (void) reset;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+unsigned long tcp_stats_percentile(const struct tcp_io_stats *io, double percentile) {
+    unsigned long total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < TCP_STATS_BUCKETS; i++) {
+        total += io->wait_hist[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < TCP_STATS_BUCKETS - 1; i++) {
+        seen += io->wait_hist[i];
+        if (seen * 100.0 >= percentile * total) break;
+    }
+
+    return 1UL << i;
+}
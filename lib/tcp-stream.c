@@ -0,0 +1,375 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Buffered TCP stream: read-ahead ring buffer serving exact reads
+ * & write-combining buffer flushed explicitly
+ * The stream runs over a socket, or over any transport given as read & write operations
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "tcp-bufpool.h"
+#include "tcp-internal.h"
+#include "tcp-stream.h"
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Reads the data available on the socket of the stream (see tcp_stream_ops)
+ */
+static ssize_t socket_read(struct tcp_stream *stream, struct iovec *iov, int iovcnt) {
+    ssize_t bytes_read;
+
+    // poll honours the low watermark: once readable, readv does not block
+    if (stream->deadline >= 0) {
+        int rv = wait_io(stream->fd, POLLIN, stream->deadline);
+        if (rv) return rv;
+    }
+
+    do bytes_read = io_readv(stream->fd, iov, iovcnt);
+    while (bytes_read < 0 && errno == EINTR);
+
+    return bytes_read;
+}
+
+/**
+ * Sends all the data on the socket of the stream (see tcp_stream_ops)
+ */
+static int socket_write(struct tcp_stream *stream, struct iovec *iov, int iovcnt) {
+    return send_datav_deadline(stream->fd, iov, iovcnt, stream->deadline);
+}
+
+static const struct tcp_stream_ops socket_ops = { socket_read, socket_write };
+
+/**
+ * Reads a given amount of data directly into the destination
+ *
+ * @param stream: stream
+ * @param out_buffer: returned buffer containing the data
+ * @param length: amount of bytes expected
+ *
+ * @return see tcp_stream_expect
+ */
+static int read_full(struct tcp_stream *stream, char *out_buffer, size_t length) {
+    struct iovec iov;
+    ssize_t bytes_read;
+
+    while (length > 0) {
+        iov.iov_base = out_buffer;
+        iov.iov_len = length;
+
+        bytes_read = stream->ops->read(stream, &iov, 1);
+        if (bytes_read == 0) {
+            return ERR_TCP_PEER_CLOSED;
+        }
+
+        if (bytes_read < 0) {
+            return bytes_read == ERR_TCP_TIMEOUT ? ERR_TCP_TIMEOUT : ERR_TCP_RECV_DATA;
+        }
+
+        out_buffer += bytes_read;
+        length -= bytes_read;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies data out of the ring buffer
+ *
+ * @param stream: stream
+ * @param out_buffer: destination buffer
+ * @param length: amount of bytes to copy (at most the amount buffered)
+ */
+static void ring_consume(struct tcp_stream *stream, char *out_buffer, size_t length) {
+    size_t first = stream->rcap - stream->rhead;    // bytes before the end of the ring
+
+    if (first > length) first = length;
+    memcpy(out_buffer, stream->rbuf + stream->rhead, first);
+    memcpy(out_buffer + first, stream->rbuf, length - first);
+
+    stream->rhead = (stream->rhead + length) % stream->rcap;
+    stream->rlen -= length;
+}
+
+/**
+ * Sets the socket low watermark if it changed
+ *
+ * @param stream: stream
+ * @param lowat: amount of bytes needed to wake the reader up
+ *
+ * @return 0 if no error occured, -1 otherwise (errno is set)
+ */
+static int set_lowat(struct tcp_stream *stream, int lowat) {
+    if (lowat == stream->lowat) {
+        return 0;
+    }
+
+    if (setsockopt(stream->fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(int))) {
+        return -1;
+    }
+
+    stream->lowat = lowat;
+    return 0;
+}
+
+/**
+ * Reads as much data as the free space of the ring buffer can hold
+ * (a single read filling both sides of the ring)
+ *
+ * @param stream: stream
+ * @param awaited: amount of bytes the reader is waiting for
+ *
+ * @return either
+ *      the amount of bytes received
+ *      0 if the remote host has closed the connection
+ *      ERR_TCP_TIMEOUT if the stream deadline has passed
+ *      -1 if an error occured (errno is set)
+ */
+static ssize_t ring_fill(struct tcp_stream *stream, size_t awaited) {
+    struct iovec iov[2];
+    size_t tail, free_space;
+    ssize_t bytes_read;
+    int iovcnt = 1;
+
+    // restart at the beginning of the memory to get a single free segment
+    if (stream->rlen == 0) {
+        stream->rhead = 0;
+    }
+
+    tail = (stream->rhead + stream->rlen) % stream->rcap;
+    free_space = stream->rcap - stream->rlen;
+
+    iov[0].iov_base = stream->rbuf + tail;
+    if (tail >= stream->rhead && tail + free_space > stream->rcap) {
+        // the free space wraps around the end of the ring
+        iov[0].iov_len = stream->rcap - tail;
+        iov[1].iov_base = stream->rbuf;
+        iov[1].iov_len = free_space - iov[0].iov_len;
+        iovcnt = 2;
+    } else {
+        iov[0].iov_len = free_space;
+    }
+
+    // wait for the whole block at once rather than waking up on each segment
+    if (stream->tune_lowat && stream->rlen == 0) {
+        if (awaited > free_space) awaited = free_space;
+        if (set_lowat(stream, (int) awaited)) return -1;
+    }
+
+    bytes_read = stream->ops->read(stream, iov, iovcnt);
+
+    if (bytes_read > 0) {
+        stream->rlen += bytes_read;
+    }
+
+    return bytes_read;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+struct tcp_stream *tcp_stream_open(int sockfd, size_t buf_size) {
+    struct tcp_stream *stream = tcp_stream_open_ops(&socket_ops, NULL, buf_size);
+
+    if (stream != NULL) {
+        stream->fd = sockfd;
+    }
+
+    return stream;
+}
+
+struct tcp_stream *tcp_stream_open_ops(const struct tcp_stream_ops *ops, void *transport,
+                                        size_t buf_size) {
+    struct tcp_stream *stream = calloc(1, sizeof(struct tcp_stream));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    if (buf_size == 0) {
+        buf_size = TCP_STREAM_BUF_SIZE;
+    }
+
+    stream->fd = -1;
+    stream->ops = ops;
+    stream->transport = transport;
+    stream->lowat = 1;
+    stream->deadline = -1;
+
+    // buffers rounded up to their class by the pool: the whole class is used
+    stream->rbuf = tcp_buf_get(buf_size, &stream->rcap);
+    stream->wbuf = tcp_buf_get(buf_size, &stream->wcap);
+
+    if (stream->rbuf == NULL || stream->wbuf == NULL) {
+        tcp_stream_free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+void tcp_stream_free(struct tcp_stream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+
+    tcp_buf_put(stream->rbuf, stream->rcap);
+    tcp_buf_put(stream->wbuf, stream->wcap);
+    free(stream);
+}
+
+int tcp_stream_expect(struct tcp_stream *stream, char *out_buffer, ssize_t length) {
+    size_t chunk;       // amount of bytes copied from the ring buffer
+    ssize_t bytes_read; // number of bytes read by ring_fill
+
+    while (length > 0) {
+        // serve the data read ahead first
+        if (stream->rlen > 0) {
+            chunk = stream->rlen < (size_t) length ? stream->rlen : (size_t) length;
+            ring_consume(stream, out_buffer, chunk);
+            out_buffer += chunk;
+            length -= chunk;
+            continue;
+        }
+
+        // a block larger than the ring is read directly into the destination
+        if ((size_t) length >= stream->rcap) {
+            return read_full(stream, out_buffer, length);
+        }
+
+        bytes_read = ring_fill(stream, length);
+
+        // if data was still expected & the remote has closed the connection
+        if (bytes_read == 0) {
+            return ERR_TCP_PEER_CLOSED;
+        }
+
+        if (bytes_read < 0) {
+            return bytes_read == ERR_TCP_TIMEOUT ? ERR_TCP_TIMEOUT : ERR_TCP_RECV_DATA;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t tcp_stream_receive(struct tcp_stream *stream, char *out_buffer, ssize_t max_length) {
+    struct iovec iov;
+    ssize_t bytes_read;
+
+    if (stream->rlen == 0) {
+        // nothing to copy from: a large buffer is filled directly
+        if ((size_t) max_length >= stream->rcap) {
+            iov.iov_base = out_buffer;
+            iov.iov_len = max_length;
+            return stream->ops->read(stream, &iov, 1);
+        }
+
+        bytes_read = ring_fill(stream, 1);
+        if (bytes_read <= 0) {
+            return bytes_read;
+        }
+    }
+
+    if ((size_t) max_length > stream->rlen) {
+        max_length = stream->rlen;
+    }
+
+    ring_consume(stream, out_buffer, max_length);
+    return max_length;
+}
+
+size_t tcp_stream_buffered(struct tcp_stream *stream) {
+    return stream->rlen;
+}
+
+void tcp_stream_set_deadline(struct tcp_stream *stream, long long deadline) {
+    stream->deadline = deadline;
+}
+
+int tcp_stream_tune_rcvlowat(struct tcp_stream *stream, int enable) {
+    if (stream->fd < 0) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    stream->tune_lowat = enable;
+    return enable ? 0 : set_lowat(stream, 1);
+}
+
+int tcp_stream_write(struct tcp_stream *stream, char *buffer, ssize_t length) {
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+
+    return tcp_stream_writev(stream, &iov, 1);
+}
+
+int tcp_stream_writev(struct tcp_stream *stream, struct iovec *iov, int iovcnt) {
+    struct iovec out_iov[TCP_STREAM_IOV_MAX];  // pending output followed by the data
+    size_t length = 0;  // total amount of data to write
+    int i, rv;
+
+    for (i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    // small data: flush if needed, then combine the write with the pending output
+    if (length < stream->wcap) {
+        if (stream->wlen + length > stream->wcap && (rv = tcp_stream_flush(stream))) {
+            return rv;
+        }
+
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(stream->wbuf + stream->wlen, iov[i].iov_base, iov[i].iov_len);
+            stream->wlen += iov[i].iov_len;
+        }
+        return 0;
+    }
+
+    // large data: sent without copy, in the same call as the pending output
+    if (iovcnt >= TCP_STREAM_IOV_MAX) {
+        if ((rv = tcp_stream_flush(stream))) return rv;
+        return stream->ops->write(stream, iov, iovcnt);
+    }
+
+    out_iov[0].iov_base = stream->wbuf;
+    out_iov[0].iov_len = stream->wlen;
+    memcpy(out_iov + 1, iov, iovcnt * sizeof(struct iovec));
+
+    rv = stream->ops->write(stream, out_iov, iovcnt + 1);
+    if (rv) {
+        return rv;
+    }
+
+    stream->wlen = 0;
+    return 0;
+}
+
+int tcp_stream_flush(struct tcp_stream *stream) {
+    struct iovec iov;
+    int rv;
+
+    if (stream->wlen == 0) {
+        return 0;
+    }
+
+    iov.iov_base = stream->wbuf;
+    iov.iov_len = stream->wlen;
+
+    rv = stream->ops->write(stream, &iov, 1);
+    if (rv) {
+        return rv;
+    }
+
+    stream->wlen = 0;
+    return 0;
+}
@@ -0,0 +1,178 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Kernel timestamps (SO_TIMESTAMPING) of the data received & sent
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <time.h>       // needed by linux/errqueue.h
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "tcp-internal.h"
+#include "tcp-timestamp.h"
+
+#define TS_CONTROL_SIZE 512     // control messages of a timestamped receive
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Reads one transmit timestamp from the error queue of a socket
+ *
+ * @param sockfd: socket file descriptor
+ * @param out_ts: returned timestamp
+ *
+ * @return either
+ *      1 if a timestamp has been read
+ *      0 if the message read was not a timestamp
+ *      -1 if an error occured (EAGAIN if the queue is empty)
+ *      errno is set
+ */
+static int read_tx(int sockfd, struct tcp_tx_timestamp *out_ts) {
+    char control[TS_CONTROL_SIZE];
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct scm_timestamping *stamps = NULL;
+    struct sock_extended_err *serr = NULL;
+
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    // timestamps only (SOF_TIMESTAMPING_OPT_TSONLY): no data comes with them
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            stamps = (struct scm_timestamping *) CMSG_DATA(cmsg);
+        } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+            serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+        }
+    }
+
+    if (stamps == NULL || serr == NULL || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) {
+        return 0;
+    }
+
+    switch (serr->ee_info) {
+    case SCM_TSTAMP_SCHED:  out_ts->kind = TCP_TX_SCHED; break;
+    case SCM_TSTAMP_ACK:    out_ts->kind = TCP_TX_ACKED; break;
+    default:                out_ts->kind = TCP_TX_SENT; break;
+    }
+    out_ts->id = serr->ee_data;
+    out_ts->ts = stamps->ts[0];   // software timestamp
+
+    return 1;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+int tcp_timestamping(int sockfd, int flags) {
+    int ts_flags = 0;
+
+    if (flags & TCP_TS_RX) {
+        ts_flags |= SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    }
+
+    // the send timestamps are identified by the offset of their last byte
+    if (flags & TCP_TS_TX) {
+        ts_flags |= SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE
+                  | SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_SOFTWARE
+                  | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof ts_flags) ? -1 : 0;
+}
+
+ssize_t receive_data_ts(int sockfd, char *out_buffer, ssize_t max_length,
+                        struct timespec *out_ts) {
+    char control[TS_CONTROL_SIZE];
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t rv;
+
+    stats_call(sockfd, TCP_STATS_RECV);
+
+    iov.iov_base = out_buffer;
+    iov.iov_len = max_length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    memset(out_ts, 0, sizeof(struct timespec));
+
+    rv = io_recvmsg(sockfd, &msg, 0);
+    if (rv <= 0) {
+        return rv;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            *out_ts = ((struct scm_timestamping *) CMSG_DATA(cmsg))->ts[0];
+        }
+    }
+
+    return rv;
+}
+
+int tcp_tx_timestamps(int sockfd, struct tcp_tx_timestamp *out_ts, int max, long long deadline) {
+    int count = 0;
+    int rv, err;
+    socklen_t len = sizeof err;
+
+    while (count < max) {
+        rv = read_tx(sockfd, &out_ts[count]);
+        if (rv > 0) {
+            count++;
+            continue;
+        }
+        if (rv == 0 || errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return count ? count : -1;
+        }
+
+        // queue drained
+        if (count > 0) {
+            return count;
+        }
+        if (deadline == 0) {
+            return ERR_TCP_WOULD_BLOCK;
+        }
+
+        // a pending socket error is reported like a queued timestamp
+        if (!getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) && err) {
+            errno = err;
+            return -1;
+        }
+
+        // shut down: no timestamp will come, poll would report POLLHUP at once
+        if (hung_up(sockfd)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        // woken up by the error queue
+        if ((rv = wait_io(sockfd, POLLERR, deadline))) {
+            return rv;
+        }
+    }
+
+    return count;
+}
+
+long long tcp_ts_elapsed_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
@@ -0,0 +1,174 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Connection metrics & socket buffer autotuning
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <linux/tcp.h>      // struct tcp_info with the delivery rate (not in netinet/tcp.h)
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "tcp-internal.h"
+#include "tcp-tune.h"
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Rounds a size up to a power of two, within limits
+ *
+ * @param size: size to round
+ * @param min: lower limit
+ * @param max: upper limit
+ *
+ * @return the size rounded
+ */
+static size_t round_chunk(size_t size, size_t min, size_t max) {
+    size_t chunk = min;
+
+    while (chunk < size && chunk < max) chunk <<= 1;
+    return chunk > max ? max : chunk;
+}
+
+/**
+ * Gets the size of the socket buffer tuned
+ *
+ * @param tune: autotuner state
+ *
+ * @return the buffer size reported by the kernel, 0 if an error occured
+ */
+static size_t buffer_size(struct tcp_autotune *tune) {
+    int size = 0;
+    socklen_t len = sizeof size;
+
+    if (getsockopt(tune->fd, SOL_SOCKET, tune->dir == TCP_TUNE_SEND ? SO_SNDBUF : SO_RCVBUF,
+                    &size, &len)) {
+        return 0;
+    }
+    return size;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+int tcp_info_sample(int sockfd, struct tcp_info_sample *out_sample) {
+    struct tcp_info info;
+    socklen_t len = sizeof info;
+
+    // the fields a kernel does not know are left zeroed
+    memset(&info, 0, sizeof info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+        return -1;
+    }
+
+    out_sample->rtt_us = info.tcpi_rtt;
+    out_sample->rttvar_us = info.tcpi_rttvar;
+    out_sample->min_rtt_us = info.tcpi_min_rtt;
+    out_sample->rcv_rtt_us = info.tcpi_rcv_rtt;
+    out_sample->snd_cwnd = info.tcpi_snd_cwnd;
+    out_sample->snd_mss = info.tcpi_snd_mss;
+    out_sample->retransmits = info.tcpi_total_retrans;
+    out_sample->delivery_rate = info.tcpi_delivery_rate;
+    out_sample->app_limited = info.tcpi_delivery_rate_app_limited;
+    out_sample->bytes_acked = info.tcpi_bytes_acked;
+    out_sample->bytes_received = info.tcpi_bytes_received;
+
+    return 0;
+}
+
+int tcp_autotune_init(struct tcp_autotune *tune, int sockfd, int dir,
+                      const struct tcp_autotune_options *opts) {
+    if (dir != TCP_TUNE_SEND && dir != TCP_TUNE_RECV) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(tune, 0, sizeof *tune);
+    tune->fd = sockfd;
+    tune->dir = dir;
+
+    // fill the defaults
+    if (opts != NULL) tune->opts = *opts;
+    if (tune->opts.interval_ms <= 0) tune->opts.interval_ms = TCP_TUNE_INTERVAL_MS;
+    if (tune->opts.min_chunk == 0) tune->opts.min_chunk = TCP_TUNE_MIN_CHUNK;
+    if (tune->opts.max_chunk == 0) tune->opts.max_chunk = TCP_TUNE_MAX_CHUNK;
+    if (tune->opts.max_chunk < tune->opts.min_chunk) tune->opts.max_chunk = tune->opts.min_chunk;
+    if (tune->opts.max_buf == 0) tune->opts.max_buf = TCP_TUNE_MAX_BUF;
+
+    tune->chunk = tune->opts.min_chunk;
+    if ((tune->buf = buffer_size(tune)) == 0 || tcp_info_sample(sockfd, &tune->last)) {
+        return -1;
+    }
+    tune->last_us = monotonic_ns() / 1000;
+
+    return 0;
+}
+
+size_t tcp_autotune_step(struct tcp_autotune *tune) {
+    struct tcp_info_sample sample;
+    long long now, elapsed;
+    unsigned long long bytes;   // bytes transferred since the previous sample
+    unsigned int rtt;           // rtt used for the BDP
+    size_t want;                // socket buffer wanted
+    size_t current;             // socket buffer reported by the kernel
+
+    // sample once per interval & at least once per rtt: the rate needs a window of data
+    now = monotonic_ns() / 1000;
+    elapsed = now - tune->last_us;
+    if (elapsed < tune->opts.interval_ms * 1000LL || elapsed < tune->last.rtt_us) {
+        return tune->chunk;
+    }
+    if (tcp_info_sample(tune->fd, &sample)) {
+        return tune->chunk;
+    }
+
+    // sender: rate estimated by the kernel, receiver: bytes received over the interval
+    if (tune->dir == TCP_TUNE_SEND) {
+        bytes = sample.bytes_acked - tune->last.bytes_acked;
+        tune->rate = sample.delivery_rate ? sample.delivery_rate : bytes * 1000000 / elapsed;
+        rtt = sample.min_rtt_us ? sample.min_rtt_us : sample.rtt_us;
+    } else {
+        bytes = sample.bytes_received - tune->last.bytes_received;
+        tune->rate = bytes * 1000000 / elapsed;
+        rtt = sample.rcv_rtt_us ? sample.rcv_rtt_us : sample.rtt_us;
+    }
+
+    tune->last = sample;
+    tune->last_us = now;
+
+    // nothing transferred meanwhile: keep the previous tuning
+    if (tune->rate == 0 || rtt == 0) {
+        return tune->chunk;
+    }
+    tune->bdp = tune->rate * rtt / 1000000;
+
+    // the kernel may have grown the buffer itself meanwhile (it stops once it is set):
+    // compare with the size it reports now
+    if ((current = buffer_size(tune)) != 0) tune->buf = current;
+
+    // twice the BDP lets the window keep growing with the rate; the kernel doubles
+    // the size asked for its bookkeeping: only grow past what it reports, never shrink
+    want = 2 * tune->bdp;
+    if (want > tune->opts.max_buf) want = tune->opts.max_buf;
+    if (current != 0 && 2 * want > current) {
+        int size = want;
+        if (setsockopt(tune->fd, SOL_SOCKET,
+                        tune->dir == TCP_TUNE_SEND ? SO_SNDBUF : SO_RCVBUF,
+                        &size, sizeof size) == 0) {
+            tune->buf = buffer_size(tune);
+            tune->adjustments++;
+        }
+    }
+
+    // a chunk per system call about the data in flight, within the socket buffer
+    tune->chunk = round_chunk(tune->bdp, tune->opts.min_chunk, tune->opts.max_chunk);
+    if (tune->buf && tune->chunk > tune->buf) {
+        tune->chunk = round_chunk(tune->buf / 2, tune->opts.min_chunk, tune->opts.max_chunk);
+    }
+
+    return tune->chunk;
+}
@@ -7,26 +7,34 @@
  * RI 2020 - Laura Binacchi - Fedora 32
  ****************************************************************************************/
 
+#define _GNU_SOURCE     // IOV_MAX, accept4
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 
+#include "tcp-internal.h"
 #include "tcp-util.h"
 
-/**
- * Gets the IPv4 or IPv6 address
- *
- * @param *sa: sockaddr structure
- *
- * @return the pointer to the sockaddr_in (IPv4) or sockaddr_in6 (IPv6) address
- */
 void *get_in_addr(struct sockaddr *sa) {
     if (sa->sa_family == AF_INET) {
         return &(((struct sockaddr_in*)sa)->sin_addr);
@@ -34,20 +42,569 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int client_connect(char *url, char* service) {
+int set_nonblocking(int sockfd, int enable) {
+    int flags = fcntl(sockfd, F_GETFL);
+
+    if (flags < 0) {
+        return -1;
+    }
+
+    flags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(sockfd, F_SETFL, flags) < 0 ? -1 : 0;
+}
+
+long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long tcp_deadline(int timeout_ms) {
+    return timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+}
+
+int wait_io(int sockfd, short events, long long deadline) {
+    struct pollfd pfd;
+    long long remaining, start;
+    int rv;
+
+    // in a coroutine, the scheduler waits for the socket while the others run
+    if (coro_running != NULL) {
+        start = stats_clock_ns();
+        rv = coro_wait(sockfd, events, deadline);
+        stats_wait(sockfd, events & POLLOUT ? TCP_STATS_SEND : TCP_STATS_RECV, start);
+        return rv;
+    }
+
+    pfd.fd = sockfd;
+    pfd.events = events;
+
+    while (1) {
+        if (deadline < 0) {
+            remaining = -1;
+        } else if ((remaining = deadline - monotonic_ms()) <= 0) {
+            errno = ETIMEDOUT;
+            return ERR_TCP_TIMEOUT;
+        }
+
+        start = stats_clock_ns();
+        rv = poll(&pfd, 1, remaining > INT_MAX ? INT_MAX : (int) remaining);
+        stats_wait(sockfd, events & POLLOUT ? TCP_STATS_SEND : TCP_STATS_RECV, start);
+        if (rv > 0) {
+            // errors & hang ups are reported by the next send or receive
+            return 0;
+        }
+
+        if (rv < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+int hung_up(int sockfd) {
+    struct pollfd pfd = { sockfd, 0, 0 };
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP);
+}
+
+struct addrinfo **interleave_families(struct addrinfo *server_info, int *out_count) {
+    struct addrinfo **addrs;
+    struct addrinfo *p, *q;
+    int count = 0;
+    int i = 0;
+
+    for (p = server_info; p != NULL; p = p->ai_next) count++;
+
+    addrs = malloc(count * sizeof(struct addrinfo *));
+    if (addrs == NULL) {
+        return NULL;
+    }
+
+    // p walks the addresses of the first family, q those of the other families
+    p = server_info;
+    q = server_info->ai_next;
+    while (q && q->ai_family == server_info->ai_family) q = q->ai_next;
+
+    while (p || q) {
+        if (p) {
+            addrs[i++] = p;
+            do p = p->ai_next;
+            while (p && p->ai_family != server_info->ai_family);
+        }
+        if (q) {
+            addrs[i++] = q;
+            do q = q->ai_next;
+            while (q && q->ai_family == server_info->ai_family);
+        }
+    }
+
+    *out_count = count;
+    return addrs;
+}
+
+/**
+ * Skips the bytes already transfered in an array of buffers
+ *
+ * @param iov: buffers array pointer, moved to the first buffer not entirely transfered
+ * @param iovcnt: amount of buffers, decreased by the amount of buffers skipped
+ * @param bytes: amount of bytes transfered
+ */
+static void advance_iov(struct iovec **iov, int *iovcnt, size_t bytes) {
+    // skip the buffers entirely transfered (and the empty ones)
+    while (*iovcnt > 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+
+    // move the start of the buffer partially transfered
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+}
+
+/** Cached resolution of a (host, service) pair */
+struct resolver_entry {
+    char *host;                 // NULL if the slot is free
+    char *service;
+    struct addrinfo *info;      // copy of the addresses, NULL on failure
+    int error;                  // getaddrinfo error code, 0 on success
+    long long expires;          // ms (monotonic) after which the entry is stale
+    long long last_used;        // ms (monotonic) of the last hit, for LRU eviction
+};
+
+static struct resolver_entry resolver_cache[TCP_RESOLVER_CACHE_SIZE];
+static struct resolver_stats resolver_counters;
+static int resolver_ttl = TCP_RESOLVER_TTL;
+static int resolver_negative_ttl = TCP_RESOLVER_NEGATIVE_TTL;
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Copies a list of addresses in memory owned by the library
+ *
+ * @param info: list to copy
+ *
+ * @return the copy (to free with resolve_free), NULL if an error occured
+ */
+static struct addrinfo *copy_addrinfo(struct addrinfo *info) {
+    struct addrinfo *head = NULL;
+    struct addrinfo **tail = &head;
+    struct addrinfo *node;
+
+    for (; info != NULL; info = info->ai_next) {
+        // the address is stored right after the node (one allocation per node)
+        node = malloc(sizeof(struct addrinfo) + info->ai_addrlen);
+        if (node == NULL) {
+            resolve_free(head);
+            return NULL;
+        }
+
+        *node = *info;
+        node->ai_addr = (struct sockaddr *) (node + 1);
+        memcpy(node->ai_addr, info->ai_addr, info->ai_addrlen);
+        node->ai_canonname = NULL;
+        node->ai_next = NULL;
+
+        *tail = node;
+        tail = &node->ai_next;
+    }
+
+    return head;
+}
+
+/**
+ * Tells if a getaddrinfo failure is definitive enough to be cached
+ *
+ * @param error: getaddrinfo error code
+ *
+ * @return 1 if the failure can be cached, 0 otherwise (e.g. temporary failure)
+ */
+static int is_negative_cacheable(int error) {
+    return error == EAI_NONAME || error == EAI_SERVICE
+        || error == EAI_NODATA || error == EAI_FAIL;
+}
+
+/**
+ * Finds the cache entry of a (host, service) pair
+ *
+ * @param host: host name
+ * @param service: service name
+ *
+ * @return the entry, NULL if the pair is not in the cache
+ */
+static struct resolver_entry *find_entry(char *host, char *service) {
+    struct resolver_entry *entry;
+
+    for (entry = resolver_cache; entry < resolver_cache + TCP_RESOLVER_CACHE_SIZE; entry++) {
+        if (entry->host && !strcmp(entry->host, host) && !strcmp(entry->service, service)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Empties a cache entry
+ *
+ * @param entry: entry to free
+ */
+static void clear_entry(struct resolver_entry *entry) {
+    free(entry->host);
+    free(entry->service);
+    resolve_free(entry->info);
+    memset(entry, 0, sizeof(struct resolver_entry));
+}
+
+/**
+ * Stores a resolution in the cache, replacing the least recently used entry if full
+ *
+ * @param host: host name
+ * @param service: service name
+ * @param info: addresses resolved (copied), NULL on failure
+ * @param error: getaddrinfo error code
+ * @param now: current monotonic time in ms
+ */
+static void store_entry(char *host, char *service, struct addrinfo *info,
+                        int error, long long now) {
+    struct resolver_entry *entry = find_entry(host, service);
+    struct resolver_entry *p;
+    int ttl = error ? resolver_negative_ttl : resolver_ttl;
+
+    if (ttl <= 0 || (error && !is_negative_cacheable(error))) {
+        if (entry) clear_entry(entry);
+        return;
+    }
+
+    // free slot, otherwise the least recently used one
+    if (entry == NULL) {
+        entry = resolver_cache;
+        for (p = resolver_cache; p < resolver_cache + TCP_RESOLVER_CACHE_SIZE; p++) {
+            if (p->host == NULL) {
+                entry = p;
+                break;
+            }
+            if (p->last_used < entry->last_used) entry = p;
+        }
+        if (entry->host && entry->expires > now) resolver_counters.evictions++;
+    }
+
+    clear_entry(entry);
+    entry->host = strdup(host);
+    entry->service = strdup(service);
+    entry->info = info ? copy_addrinfo(info) : NULL;
+    entry->error = error;
+    entry->expires = now + ttl * 1000LL;
+    entry->last_used = now;
+
+    // out of memory: forget the entry
+    if (!entry->host || !entry->service || (info && !entry->info)) clear_entry(entry);
+}
+
+int resolve_cached(char *host, char *service, struct addrinfo **out_info) {
     struct addrinfo hints;          // socket hints: struct given to getaddrinfo
     struct addrinfo *server_info;   // server infos: linked list filled by get addrinfo
-    struct addrinfo *p;             // linked list for iteration
-    int sockfd;                     // server socket file descriptor
-    int err;                        // error number returned by getaddrinfo
+    struct resolver_entry *entry;
+    long long now = monotonic_ms();
+    int err;
+
+    *out_info = NULL;
+
+    // serve the resolution from the cache while it is valid
+    if (host && service) {
+        pthread_mutex_lock(&resolver_lock);
+        entry = find_entry(host, service);
+        if (entry && entry->expires > now) {
+            resolver_counters.hits++;
+            if (entry->error) resolver_counters.negative_hits++;
+            entry->last_used = now;
+
+            err = entry->error;
+            if (!err && (*out_info = copy_addrinfo(entry->info)) == NULL) err = EAI_MEMORY;
+
+            pthread_mutex_unlock(&resolver_lock);
+            return err;
+        }
+        resolver_counters.misses++;
+        pthread_mutex_unlock(&resolver_lock);
+    }
 
     // fill the server hints
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;		// IPv4 or IPv6
     hints.ai_socktype = SOCK_STREAM;	// TCP
 
-    // generate server informations from hints
-    err = getaddrinfo(url, service, &hints, &server_info);
+    // resolve without holding the lock: other lookups are not delayed
+    err = getaddrinfo(host, service, &hints, &server_info);
+
+    if (host && service) {
+        pthread_mutex_lock(&resolver_lock);
+        store_entry(host, service, err ? NULL : server_info, err, now);
+        pthread_mutex_unlock(&resolver_lock);
+    }
+
+    if (err) {
+        return err;
+    }
+
+    *out_info = copy_addrinfo(server_info);
+    freeaddrinfo(server_info);
+
+    return *out_info ? 0 : EAI_MEMORY;
+}
+
+void resolve_free(struct addrinfo *info) {
+    struct addrinfo *next;
+
+    while (info) {
+        next = info->ai_next;
+        free(info);
+        info = next;
+    }
+}
+
+void resolver_configure(int ttl, int negative_ttl) {
+    pthread_mutex_lock(&resolver_lock);
+    resolver_ttl = ttl;
+    resolver_negative_ttl = negative_ttl;
+    pthread_mutex_unlock(&resolver_lock);
+
+    // entries stored with the previous time to live
+    if (ttl <= 0 || negative_ttl <= 0) resolver_invalidate(NULL, NULL);
+}
+
+void resolver_invalidate(char *host, char *service) {
+    struct resolver_entry *entry;
+
+    pthread_mutex_lock(&resolver_lock);
+    for (entry = resolver_cache; entry < resolver_cache + TCP_RESOLVER_CACHE_SIZE; entry++) {
+        if (entry->host == NULL) continue;
+        if (host && strcmp(entry->host, host)) continue;
+        if (service && strcmp(entry->service, service)) continue;
+        clear_entry(entry);
+    }
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+void resolver_get_stats(struct resolver_stats *out_stats, int reset) {
+    pthread_mutex_lock(&resolver_lock);
+    *out_stats = resolver_counters;
+    if (reset) memset(&resolver_counters, 0, sizeof(struct resolver_stats));
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+/**
+ * Parses a unix socket address ("unix:/path", "unixpacket:/path", "unix:@abstract")
+ *
+ * @param address: url or service given by the caller
+ * @param out_addr: returned socket address
+ * @param out_len: returned socket address length
+ * @param out_type: returned socket type (SOCK_STREAM or SOCK_SEQPACKET)
+ *
+ * @return either
+ *      1 if the address is a unix socket address
+ *      0 if it is not (ip address or service)
+ *      -1 if the path is too long (errno is set)
+ */
+static int parse_unix(char *address, struct sockaddr_un *out_addr, socklen_t *out_len,
+                        int *out_type) {
+    size_t path_len;
+    char *path;
+
+    if (address == NULL) {
+        return 0;
+    }
+
+    if (!strncmp(address, TCP_UNIX_PREFIX, strlen(TCP_UNIX_PREFIX))) {
+        path = address + strlen(TCP_UNIX_PREFIX);
+        *out_type = SOCK_STREAM;
+    } else if (!strncmp(address, TCP_UNIXPACKET_PREFIX, strlen(TCP_UNIXPACKET_PREFIX))) {
+        path = address + strlen(TCP_UNIXPACKET_PREFIX);
+        *out_type = SOCK_SEQPACKET;
+    } else {
+        return 0;
+    }
+
+    path_len = strlen(path);
+    if (path_len == 0 || path_len >= sizeof(out_addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(out_addr, 0, sizeof(struct sockaddr_un));
+    out_addr->sun_family = AF_UNIX;
+    memcpy(out_addr->sun_path, path, path_len);
+
+    // abstract namespace: the name starts with a null byte & is not null terminated
+    if (path[0] == '@') {
+        out_addr->sun_path[0] = '\0';
+        *out_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    } else {
+        *out_len = sizeof(struct sockaddr_un);
+    }
+
+    return 1;
+}
+
+/**
+ * Tells whether an address is a unix socket address (valid or not)
+ *
+ * @param address: url or service given by the caller
+ *
+ * @return 1 if the address is a unix socket address, 0 otherwise
+ */
+static int is_unix_address(char *address) {
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int type;
+
+    return parse_unix(address, &addr, &addr_len, &type) != 0;
+}
+
+/**
+ * Tells whether a socket is a unix domain socket
+ *
+ * @param sockfd: socket file descriptor
+ *
+ * @return 1 if the socket is a unix socket, 0 otherwise
+ */
+static int is_unix(int sockfd) {
+    int domain;
+    socklen_t len = sizeof(int);
+
+    return !getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) && domain == AF_UNIX;
+}
+
+void format_peer(int sockfd, struct sockaddr_storage *addr, char *out_ip) {
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (addr->ss_family != AF_UNIX) {
+        // network to presentation
+        inet_ntop(addr->ss_family, get_in_addr((struct sockaddr *) addr),
+                    out_ip, INET6_ADDRSTRLEN);
+    } else if (!getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.pid > 0) {
+        // the clients are usually unnamed: identified by their process
+        snprintf(out_ip, INET6_ADDRSTRLEN, "unix:%d", (int) cred.pid);
+    } else {
+        strcpy(out_ip, "unix");
+    }
+}
+
+/**
+ * Applies the tuning options on a socket, before it connects or listens
+ *
+ * @param sockfd: socket file descriptor
+ * @param opts: options to apply, NULL to keep the defaults
+ * @param listener: 1 for a socket about to listen, 0 for a socket about to connect
+ *
+ * @return 0 if all the options have been applied, -1 otherwise (errno is set)
+ */
+static int apply_options(int sockfd, const struct tcp_options *opts, int listener) {
+    int tcp_level;      // 1 if the TCP level options apply
+
+    if (opts == NULL) {
+        return 0;
+    }
+
+    tcp_level = (opts->nodelay || opts->congestion[0] || opts->fastopen > 0
+                    || opts->defer_accept > 0) && !is_unix(sockfd);
+
+    if (tcp_level && opts->nodelay
+            && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay, sizeof(int))) {
+        return -1;
+    }
+
+    if (opts->sndbuf > 0
+            && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, sizeof(int))) {
+        return -1;
+    }
+
+    if (opts->rcvbuf > 0
+            && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(int))) {
+        return -1;
+    }
+
+    if (tcp_level && opts->congestion[0] && setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION,
+                                    opts->congestion, strnlen(opts->congestion, TCP_CA_NAME_MAX))) {
+        return -1;
+    }
+
+    // Fast Open: queue of the connections accepted before the handshake on the server,
+    // connect deferred to the first send (to fill the SYN) on the client
+    if (tcp_level && opts->fastopen > 0 && (listener
+            ? setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(int))
+            : setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opts->fastopen, sizeof(int)))) {
+        return -1;
+    }
+
+    // the handshake alone does not wake the acceptor up: the first data does
+    if (tcp_level && listener && opts->defer_accept > 0 && setsockopt(sockfd, IPPROTO_TCP,
+                                    TCP_DEFER_ACCEPT, &opts->defer_accept, sizeof(int))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Connects to a unix socket
+ *
+ * @param url: unix socket address (see parse_unix)
+ * @param opts: options applied before connecting, can be NULL
+ *
+ * @return see client_connect_opts
+ */
+static int connect_unix(char *url, const struct tcp_options *opts) {
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int sockfd, type;
+
+    if (parse_unix(url, &addr, &addr_len, &type) < 0) {
+        return ERR_TCP_CREATE_SOCK;
+    }
+
+    if ((sockfd = socket(AF_UNIX, type, 0)) < 0) {
+        return ERR_TCP_CREATE_SOCK;
+    }
+
+    if (apply_options(sockfd, opts, 0)) {
+        close(sockfd);
+        return ERR_TCP_OVER_SOCK_OPT;
+    }
+
+    if (connect(sockfd, (struct sockaddr *) &addr, addr_len) < 0) {
+        close(sockfd);
+        return ERR_TCP_ACTIVE_CONNECT;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Connects to the first server address accepting the connection, one after the other
+ *
+ * @param url: url or ip address separated by dots
+ * @param service: port number or service
+ * @param opts: options applied before connecting, can be NULL
+ *
+ * @return see client_connect_opts
+ */
+static int connect_sequential(char *url, char* service, const struct tcp_options *opts) {
+    struct addrinfo *server_info;   // server infos: linked list filled by the resolver
+    struct addrinfo *p;             // linked list for iteration
+    int sockfd;                     // server socket file descriptor
+    int err;                        // error number returned by getaddrinfo
+
+    // generate server informations (cached resolution)
+    err = resolve_cached(url, service, &server_info);
     if (err) {
         // set errno
         errno = err;
@@ -62,6 +619,13 @@ int client_connect(char *url, char* service) {
             continue;
         }
 
+        // tune the socket before the handshake
+        if (apply_options(sockfd, opts, 0)) {
+            close(sockfd);
+            resolve_free(server_info);
+            return ERR_TCP_OVER_SOCK_OPT;
+        }
+
         // open an active connection to the remote host
         if (connect(sockfd, p->ai_addr, p->ai_addrlen) < 0) {
             close(sockfd);
@@ -73,7 +637,7 @@ int client_connect(char *url, char* service) {
     }
 
     // free the linked list (servinfo & p)
-    freeaddrinfo(server_info);
+    resolve_free(server_info);
 
     // if p is NULL after the loop, no connection has been successful
     if (p == NULL) {
@@ -83,13 +647,261 @@ int client_connect(char *url, char* service) {
     return sockfd;
 }
 
-int server_listen(char *service, int backlog) {
+/**
+ * Connects racing the server addresses (see client_connect_timeout)
+ *
+ * @param url: url or ip address separated by dots
+ * @param service: port number or service
+ * @param timeout_ms: overall deadline in milliseconds, < 0 to wait indefinitely
+ * @param opts: options applied before connecting, can be NULL
+ *
+ * @return see client_connect_opts
+ */
+static int connect_race(char *url, char *service, int timeout_ms,
+                        const struct tcp_options *opts) {
+    struct addrinfo *server_info;   // server infos: linked list filled by the resolver
+    struct addrinfo **addrs;        // addresses in the order they are tried
+    struct pollfd *attempts;        // connections in progress
+    int count;                      // amount of addresses
+    int next = 0;                   // index of the next address to try
+    int pending = 0;                // amount of connections in progress
+    int sockfd = -1;                // socket of the winning connection
+    int rv = ERR_TCP_ACTIVE_CONNECT;
+    int err;                        // error number returned by getaddrinfo or SO_ERROR
+    int last_errno = ECONNREFUSED;  // errno of the last failed attempt
+    long long now, deadline, next_attempt;
+    socklen_t err_len;
+    int wait, ready, i;
+
+    // generate server informations (cached resolution)
+    err = resolve_cached(url, service, &server_info);
+    if (err) {
+        // set errno
+        errno = err;
+        return ERR_TCP_CREATE_SOCK;
+    }
+
+    addrs = interleave_families(server_info, &count);
+    attempts = malloc(count * sizeof(struct pollfd));
+    if (addrs == NULL || attempts == NULL) {
+        free(addrs);
+        free(attempts);
+        resolve_free(server_info);
+        return ERR_TCP_CREATE_SOCK;
+    }
+
+    now = monotonic_ms();
+    deadline = timeout_ms < 0 ? -1 : now + timeout_ms;
+    next_attempt = now;
+
+    while (sockfd < 0) {
+        // start the next attempt when its turn has come
+        if (next < count && now >= next_attempt) {
+            struct addrinfo *p = addrs[next++];
+            int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+
+            if (fd < 0) {
+                last_errno = errno;
+                continue;
+            }
+
+            // tune the socket before the handshake
+            if (apply_options(fd, opts, 0)) {
+                close(fd);
+                rv = ERR_TCP_OVER_SOCK_OPT;
+                break;
+            }
+
+            if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+                sockfd = fd;
+                break;
+            }
+
+            if (errno != EINPROGRESS) {
+                // failed immediately: try the next address without waiting
+                last_errno = errno;
+                close(fd);
+                continue;
+            }
+
+            attempts[pending].fd = fd;
+            attempts[pending].events = POLLOUT;
+            pending++;
+            next_attempt = now + TCP_CONNECT_ATTEMPT_DELAY;
+        }
+
+        // every address failed
+        if (pending == 0 && next >= count) {
+            errno = last_errno;
+            break;
+        }
+
+        // wait until the next attempt, a connection result or the deadline
+        wait = -1;
+        if (next < count) wait = next_attempt - now;
+        if (deadline >= 0 && (wait < 0 || deadline - now < wait)) wait = deadline - now;
+
+        if (deadline >= 0 && now >= deadline) {
+            rv = ERR_TCP_TIMEOUT;
+            break;
+        }
+
+        ready = poll(attempts, pending, wait);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                last_errno = errno;
+                break;
+            }
+            ready = 0;
+        }
+
+        now = monotonic_ms();
+
+        // collect the results of the attempts
+        for (i = 0; i < pending && ready > 0; i++) {
+            if (!attempts[i].revents) continue;
+            ready--;
+
+            err_len = sizeof(int);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len)) err = errno;
+
+            if (err == 0) {
+                sockfd = attempts[i].fd;
+                attempts[i] = attempts[--pending];
+                break;
+            }
+
+            // failed: remove the attempt & start the next one now
+            last_errno = err;
+            close(attempts[i].fd);
+            attempts[i--] = attempts[--pending];
+            next_attempt = now;
+        }
+    }
+
+    // abandon the attempts still in progress
+    for (i = 0; i < pending; i++) {
+        close(attempts[i].fd);
+    }
+
+    free(attempts);
+    free(addrs);
+    resolve_free(server_info);
+
+    if (sockfd < 0) {
+        return rv;
+    }
+
+    // the caller uses a blocking socket
+    if (set_nonblocking(sockfd, 0)) {
+        close(sockfd);
+        return ERR_TCP_ACTIVE_CONNECT;
+    }
+
+    return sockfd;
+}
+
+int client_connect(char *url, char* service) {
+    return client_connect_opts(url, service, NULL);
+}
+
+int client_connect_timeout(char *url, char *service, int timeout_ms) {
+    if (is_unix_address(url)) {
+        return connect_unix(url, NULL);
+    }
+    return connect_race(url, service, timeout_ms, NULL);
+}
+
+int client_connect_opts(char *url, char *service, const struct tcp_options *opts) {
+    // a local connection does not go through the resolver nor the network
+    if (is_unix_address(url)) {
+        return connect_unix(url, opts);
+    }
+
+    // Fast Open defers the handshake to the first send: there is nothing to race
+    if (opts && opts->connect_timeout_ms && opts->fastopen <= 0) {
+        return connect_race(url, service, opts->connect_timeout_ms, opts);
+    }
+    return connect_sequential(url, service, opts);
+}
+
+/**
+ * Tells whether a unix socket file is left by a server which has exited:
+ * connecting to it is refused
+ *
+ * @param addr: unix socket address (path)
+ * @param addr_len: address length
+ * @param type: socket type
+ *
+ * @return either
+ *      1 if nobody listens on the path
+ *      0 if a server still accepts connections on it
+ *      -1 if it could not be probed (errno is set)
+ */
+static int unix_path_stale(struct sockaddr_un *addr, socklen_t addr_len, int type) {
+    int probe, rv;
+
+    if ((probe = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    // a full backlog refuses with EAGAIN: the server is alive
+    if (connect(probe, (struct sockaddr *) addr, addr_len) == 0 || errno == EAGAIN) {
+        rv = 0;
+    } else {
+        rv = errno == ECONNREFUSED ? 1 : -1;
+    }
+
+    close(probe);
+    return rv;
+}
+
+/**
+ * Creates a socket bound to a local port (the first address we can bind)
+ *
+ * @param service: port number or service
+ * @param reuseport: 1 to allow several sockets to bind the same port (SO_REUSEPORT)
+ *
+ * @return either
+ *      socket file descriptor if it was successfully bound
+ *      ERR_TCP_CREATE_SOCK, ERR_TCP_OVER_SOCK_OPT or ERR_TCP_BIND (see server_listen)
+ */
+static int bind_socket(char *service, int reuseport) {
     struct addrinfo hints;          // socket hints: struct given to getaddrinfo
     struct addrinfo *server_info;   // server infos: linked list filled by get addrinfo
     struct addrinfo *p;             // linked list for iteration
     int sockfd;                     // server socket file descriptor
     int err;                        // error number returned by getaddrinfo
     int yes = 1;                    // override reuse address param
+    struct sockaddr_un addr;        // unix socket address
+    socklen_t addr_len;
+    struct stat st;
+    int type;
+
+    // unix socket: bound to a path (or an abstract name)
+    if ((err = parse_unix(service, &addr, &addr_len, &type))) {
+        if (err < 0 || (sockfd = socket(AF_UNIX, type, 0)) < 0) {
+            return ERR_TCP_CREATE_SOCK;
+        }
+
+        // replace the socket file left by a previous server (never another kind of file),
+        // unless a server still listens on it
+        if (addr.sun_path[0] && !stat(addr.sun_path, &st) && S_ISSOCK(st.st_mode)) {
+            if ((err = unix_path_stale(&addr, addr_len, type)) <= 0) {
+                close(sockfd);
+                if (err == 0) errno = EADDRINUSE;
+                return ERR_TCP_BIND;
+            }
+            unlink(addr.sun_path);
+        }
+
+        if (bind(sockfd, (struct sockaddr *) &addr, addr_len)) {
+            close(sockfd);
+            return ERR_TCP_BIND;
+        }
+
+        return sockfd;
+    }
 
     // fill the hints
     memset(&hints, 0, sizeof hints);
@@ -114,7 +926,9 @@ int server_listen(char *service, int backlog) {
         }
 
         // override default socket options : allow to reuse the port
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) {
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))
+                || (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)))) {
+            close(sockfd);
             freeaddrinfo(server_info);
             return ERR_TCP_OVER_SOCK_OPT;
         }
@@ -136,6 +950,26 @@ int server_listen(char *service, int backlog) {
         return ERR_TCP_BIND;
     }
 
+    return sockfd;
+}
+
+int server_listen(char *service, int backlog) {
+    return server_listen_opts(service, backlog, NULL);
+}
+
+int server_listen_opts(char *service, int backlog, const struct tcp_options *opts) {
+    int sockfd = bind_socket(service, 0);   // server socket file descriptor
+
+    if (sockfd < 0) {
+        return sockfd;
+    }
+
+    // tune the socket before listening: the connections accepted inherit the options
+    if (apply_options(sockfd, opts, 1)) {
+        close(sockfd);
+        return ERR_TCP_OVER_SOCK_OPT;
+    }
+
     // open a passive connection
     if (listen(sockfd, backlog)) {
         return ERR_TCP_PASSIVE_CONNECT;
@@ -144,6 +978,126 @@ int server_listen(char *service, int backlog) {
     return sockfd;
 }
 
+int server_listen_sharded(char *service, int backlog, int shards,
+                            const struct tcp_options *opts, int *out_fds) {
+    // reuseport group program: the connection goes to the shard of the cpu receiving it
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },    // A = cpu
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) shards },         // A = A % shards
+        { BPF_RET | BPF_A, 0, 0, 0 },                                   // socket index A
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    int cpu, i;
+
+    // unix socket: no port groups, all the workers share the same socket
+    if (is_unix_address(service)) {
+        if ((out_fds[0] = server_listen_opts(service, backlog, opts)) < 0) {
+            return out_fds[0];
+        }
+
+        for (i = 1; i < shards; i++) {
+            if ((out_fds[i] = dup(out_fds[0])) < 0) {
+                while (i--) close(out_fds[i]);
+                return ERR_TCP_CREATE_SOCK;
+            }
+        }
+        return 0;
+    }
+
+    for (i = 0; i < shards; i++) {
+        out_fds[i] = bind_socket(service, 1);
+        if (out_fds[i] >= 0 && apply_options(out_fds[i], opts, 1)) {
+            close(out_fds[i]);
+            out_fds[i] = ERR_TCP_OVER_SOCK_OPT;
+        }
+
+        if (out_fds[i] < 0) {
+            int rv = out_fds[i];
+            while (i--) close(out_fds[i]);
+            return rv;
+        }
+
+        // favour the shard of the cpu processing the connection (best effort)
+        cpu = i;
+        setsockopt(out_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(int));
+    }
+
+    // the sockets are indexed in the group in their binding order (best effort)
+    setsockopt(out_fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+
+    // open the passive connections
+    for (i = 0; i < shards; i++) {
+        if (listen(out_fds[i], backlog)) {
+            for (i = 0; i < shards; i++) close(out_fds[i]);
+            return ERR_TCP_PASSIVE_CONNECT;
+        }
+    }
+
+    return 0;
+}
+
+int tcp_get_options(int sockfd, struct tcp_options *out_opts) {
+    socklen_t len;
+    int listening;      // 1 if the socket is listening
+
+    memset(out_opts, 0, sizeof(struct tcp_options));
+
+    len = sizeof(int);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &out_opts->sndbuf, &len)) return -1;
+
+    len = sizeof(int);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &out_opts->rcvbuf, &len)) return -1;
+
+    // no TCP level on a unix socket
+    if (is_unix(sockfd)) {
+        return 0;
+    }
+
+    len = sizeof(int);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &out_opts->nodelay, &len)) return -1;
+
+    len = TCP_CA_NAME_MAX - 1;
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, out_opts->congestion, &len)) return -1;
+
+    // Fast Open: queue length of a listening socket, deferred connect flag otherwise
+    len = sizeof(int);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len)) return -1;
+
+    len = sizeof(int);
+    if (getsockopt(sockfd, IPPROTO_TCP, listening ? TCP_FASTOPEN : TCP_FASTOPEN_CONNECT,
+                    &out_opts->fastopen, &len)) {
+        return -1;
+    }
+
+    len = sizeof(int);
+    if (listening && getsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                &out_opts->defer_accept, &len)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int tcp_fastopen_used(int sockfd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(struct tcp_info);
+
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+        return -1;
+    }
+
+    // set on both sides when the SYN-ACK acknowledged the data of the SYN
+    return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+}
+
+int tcp_pin_cpu(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(cpu_set_t), &set);
+}
+
 int server_accept(int sockfd, char *out_client_ip) {
     // address information about the incoming connection
     struct sockaddr_storage incoming_addr;
@@ -151,25 +1105,71 @@ int server_accept(int sockfd, char *out_client_ip) {
     int newfd;  // client socket file descriptor
 
     newfd = accept(sockfd, (struct sockaddr *)&incoming_addr, &sin_size);
-    if (newfd < 0) {
-        return -1;
+    while (newfd < 0) {
+        // non-blocking listener in a coroutine: yield until a connection is pending
+        if (coro_running == NULL || (errno != EAGAIN && errno != EWOULDBLOCK)
+                || wait_io(sockfd, POLLIN, -1)) {
+            return -1;
+        }
+
+        sin_size = sizeof(struct sockaddr_storage);
+        newfd = accept(sockfd, (struct sockaddr *)&incoming_addr, &sin_size);
     }
 
-    // network to presentation
-    inet_ntop(incoming_addr.ss_family, get_in_addr((struct sockaddr *)&incoming_addr),
-                out_client_ip, INET6_ADDRSTRLEN);
+    format_peer(newfd, &incoming_addr, out_client_ip);
 
     return newfd;
 }
 
+int server_accept_batch(int sockfd, struct tcp_accepted *out_conns, int max, int flags,
+                        long long deadline) {
+    socklen_t sin_size;
+    int count = 0, fl, rv;
+
+    // draining must stop on an empty backlog instead of blocking
+    if ((fl = fcntl(sockfd, F_GETFL)) < 0
+            || (!(fl & O_NONBLOCK) && fcntl(sockfd, F_SETFL, fl | O_NONBLOCK) < 0)) {
+        return -1;
+    }
+
+    while (count < max) {
+        sin_size = sizeof(struct sockaddr_storage);
+        out_conns[count].fd = accept4(sockfd, (struct sockaddr *) &out_conns[count].addr,
+                                        &sin_size, flags);
+        if (out_conns[count].fd >= 0) {
+            count++;
+            continue;
+        }
+
+        // aborted by the client before being accepted: take the next one
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+
+        // backlog drained, or an error reported by the next call
+        if (count > 0) break;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (deadline == 0) return ERR_TCP_WOULD_BLOCK;
+
+        // another acceptor may take the connection first: wait again then
+        if ((rv = wait_io(sockfd, POLLIN, deadline))) return rv;
+    }
+
+    return count;
+}
+
+void server_accepted_ip(struct tcp_accepted *conn, char *out_client_ip) {
+    format_peer(conn->fd, &conn->addr, out_client_ip);
+}
+
 int send_data(int sockfd, char *buffer, ssize_t length) {
     ssize_t bytes_sent;
 
+    stats_call(sockfd, TCP_STATS_SEND);
+
     // while bytes remains, send them
     while (length > 0) {
         //printf("DEBUG [send_data] sending %ld bytes\n", length);
 
-        bytes_sent = send(sockfd, buffer, length, 0);
+        bytes_sent = io_send(sockfd, buffer, length, 0);
         if (bytes_sent < 0) {
             return -1;
         }
@@ -183,18 +1183,100 @@ int send_data(int sockfd, char *buffer, ssize_t length) {
     return 0;
 }
 
+int send_datav(int sockfd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    ssize_t bytes_sent;
+
+    stats_call(sockfd, TCP_STATS_SEND);
+    memset(&msg, 0, sizeof msg);
+
+    // skip the empty buffers at the start
+    advance_iov(&iov, &iovcnt, 0);
+
+    // while buffers remain, send them (resuming in the middle of a buffer)
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        bytes_sent = io_sendmsg(sockfd, &msg, 0);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        advance_iov(&iov, &iovcnt, bytes_sent);
+    }
+
+    return 0;
+}
+
+int send_data_deadline(int sockfd, char *buffer, ssize_t length, long long deadline) {
+    ssize_t bytes_sent;
+    int rv;
+
+    stats_call(sockfd, TCP_STATS_SEND);
+
+    // while bytes remains, send what the socket accepts & wait for room for the rest
+    while (length > 0) {
+        bytes_sent = io_send(sockfd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+            if ((rv = wait_io(sockfd, POLLOUT, deadline))) return rv;
+            continue;
+        }
+
+        length -= bytes_sent;
+        buffer += bytes_sent;
+    }
+
+    return 0;
+}
+
+int send_datav_deadline(int sockfd, struct iovec *iov, int iovcnt, long long deadline) {
+    struct msghdr msg;
+    ssize_t bytes_sent;
+    int rv;
+
+    stats_call(sockfd, TCP_STATS_SEND);
+    memset(&msg, 0, sizeof msg);
+    advance_iov(&iov, &iovcnt, 0);
+
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        bytes_sent = io_sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+            if ((rv = wait_io(sockfd, POLLOUT, deadline))) return rv;
+            continue;
+        }
+
+        advance_iov(&iov, &iovcnt, bytes_sent);
+    }
+
+    return 0;
+}
+
 ssize_t receive_data(int sockfd, char *out_buffer, ssize_t max_length) {
-    return recv(sockfd, out_buffer, max_length, 0);
+    stats_call(sockfd, TCP_STATS_RECV);
+    return io_recv(sockfd, out_buffer, max_length, 0);
 }
 
 int expect_data(int sockfd, char *out_buffer, ssize_t length) {
-    ssize_t bytes_read; // number of bytes read by receive_data
+    ssize_t bytes_read; // number of bytes read by recv
+
+    stats_call(sockfd, TCP_STATS_RECV);
 
     // while bytes are still expected, read them
     while (length > 0) {
         // printf("DEBUG [expect_data] expecting %ld bytes\n", length);
 
-        bytes_read = receive_data(sockfd, out_buffer, length);
+        bytes_read = io_recv(sockfd, out_buffer, length, 0);
 
         // if data was still expected & server has closed the connection
         if (bytes_read == 0) {
@@ -215,6 +1297,71 @@ int expect_data(int sockfd, char *out_buffer, ssize_t length) {
     return 0;
 }
 
+int expect_data_deadline(int sockfd, char *out_buffer, ssize_t length, long long deadline) {
+    ssize_t bytes_read;
+    int rv;
+
+    stats_call(sockfd, TCP_STATS_RECV);
+
+    // while bytes are still expected, read the data available & wait for the rest
+    while (length > 0) {
+        bytes_read = io_recv(sockfd, out_buffer, length, MSG_DONTWAIT);
+
+        // if data was still expected & the remote has closed the connection
+        if (bytes_read == 0) {
+            return ERR_TCP_PEER_CLOSED;
+        }
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return ERR_TCP_RECV_DATA;
+
+            rv = wait_io(sockfd, POLLIN, deadline);
+            if (rv == ERR_TCP_TIMEOUT) return rv;
+            if (rv) return ERR_TCP_RECV_DATA;
+            continue;
+        }
+
+        out_buffer += bytes_read;
+        length -= bytes_read;
+    }
+
+    return 0;
+}
+
+int expect_datav(int sockfd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    ssize_t bytes_read;
+
+    stats_call(sockfd, TCP_STATS_RECV);
+    memset(&msg, 0, sizeof msg);
+    advance_iov(&iov, &iovcnt, 0);
+
+    // while buffers remain to be filled, read them
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        bytes_read = io_recvmsg(sockfd, &msg, 0);
+
+        // if data was still expected & the remote has closed the connection
+        if (bytes_read == 0) {
+            return ERR_TCP_PEER_CLOSED;
+        }
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return ERR_TCP_RECV_DATA;
+        }
+
+        advance_iov(&iov, &iovcnt, bytes_read);
+    }
+
+    return 0;
+}
+
 void disconnect(int sockfd) {
+    stats_forget(sockfd);
+    if (recording() >= 0) record_close(sockfd);
     close(sockfd);
 }
@@ -0,0 +1,268 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * Zero-copy send (MSG_ZEROCOPY): large buffers are sent from the user memory,
+ * the kernel notifies through the socket error queue when they can be reused
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/socket.h>
+
+#include "tcp-internal.h"
+#include "tcp-zerocopy.h"
+
+/** Sends completed out of order: ids lo to hi excluded */
+struct zc_range {
+    long long lo;
+    long long hi;
+};
+
+/** Zero-copy state of a socket */
+struct tcp_zerocopy {
+    int fd;                     // connection socket file descriptor
+    size_t threshold;           // buffers sent with a copy below this size
+    int enabled;                // 1 if the kernel accepted SO_ZEROCOPY
+    long long sent;             // zero-copy sends issued (the kernel numbers them from 0)
+    long long completed;        // zero-copy sends completed (all the ids below it)
+    struct zc_range *pending;   // ranges completed above completed, not merged yet
+    int pending_count;
+    int pending_cap;
+    struct tcp_zerocopy_stats stats;
+};
+
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Accounts a completion notification: the sends lo to hi (32 bits ids) are completed
+ * The kernel does not report the ranges in order: a range above the first uncompleted id
+ * is kept aside until the ids below it are completed
+ *
+ * @param zc: zero-copy state
+ * @param lo: id of the first send completed
+ * @param hi: id of the last send completed
+ *
+ * @return 0 if the range has been accounted, -1 if an error occured (errno is set)
+ */
+static int complete(struct tcp_zerocopy *zc, uint32_t lo, uint32_t hi) {
+    struct zc_range *grown;
+    long long first, last;
+    int i, merged;
+
+    // 64 bits ids, computed on 32 bits from the first uncompleted id to follow the wrap around
+    first = zc->completed + (uint32_t) (lo - (uint32_t) zc->completed);
+    last = first + (uint32_t) (hi - lo) + 1;
+    if (last > zc->sent) {
+        return 0;
+    }
+
+    if (first > zc->completed) {
+        if (zc->pending_count == zc->pending_cap) {
+            zc->pending_cap = zc->pending_cap ? 2 * zc->pending_cap : 8;
+            grown = realloc(zc->pending, zc->pending_cap * sizeof(struct zc_range));
+            if (grown == NULL) return -1;
+            zc->pending = grown;
+        }
+        zc->pending[zc->pending_count].lo = first;
+        zc->pending[zc->pending_count].hi = last;
+        zc->pending_count++;
+        return 0;
+    }
+
+    // contiguous: take the ranges kept aside which now follow
+    if (last > zc->completed) zc->completed = last;
+    do {
+        merged = 0;
+        for (i = 0; i < zc->pending_count; i++) {
+            if (zc->pending[i].lo <= zc->completed) {
+                if (zc->pending[i].hi > zc->completed) zc->completed = zc->pending[i].hi;
+                zc->pending[i--] = zc->pending[--zc->pending_count];
+                merged = 1;
+            }
+        }
+    } while (merged);
+
+    return 0;
+}
+
+/**
+ * Reads all the completion notifications queued on the socket error queue
+ *
+ * @param zc: zero-copy state
+ *
+ * @return the amount of notifications read, -1 if an error occured (errno is set)
+ */
+static int reap(struct tcp_zerocopy *zc) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct sock_extended_err *err;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    int count = 0;
+
+    while (1) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        // the error queue never blocks
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return count;
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+
+            err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // ee_info to ee_data: range of the sends completed
+            if (complete(zc, err->ee_info, err->ee_data)) {
+                return -1;
+            }
+            zc->stats.completions++;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->stats.kernel_copied++;
+            }
+            count++;
+        }
+    }
+}
+
+/**
+ * Sends a buffer with an ordinary send
+ *
+ * @param zc: zero-copy state
+ * @param buffer: buffer containing the data
+ * @param length: buffer length
+ *
+ * @return 0 if all bytes have been sent, -1 otherwise (errno is set)
+ */
+static int send_copy(struct tcp_zerocopy *zc, char *buffer, ssize_t length) {
+    if (send_data(zc->fd, buffer, length)) {
+        return -1;
+    }
+
+    zc->stats.copy_bytes += length;
+    return 0;
+}
+
+
+/* HEADER IMPLEMENTATION */
+
+struct tcp_zerocopy *zerocopy_create(int sockfd, size_t threshold) {
+    struct tcp_zerocopy *zc = calloc(1, sizeof(struct tcp_zerocopy));
+    int one = 1;
+
+    if (zc == NULL) {
+        return NULL;
+    }
+
+    zc->fd = sockfd;
+    zc->threshold = threshold > 0 ? threshold : TCP_ZEROCOPY_THRESHOLD;
+
+    // unsupported (old kernel, not a TCP socket): all the data is copied
+    zc->enabled = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(int)) == 0;
+
+    return zc;
+}
+
+void zerocopy_destroy(struct tcp_zerocopy *zc) {
+    if (zc == NULL) return;
+    free(zc->pending);
+    free(zc);
+}
+
+long long zerocopy_send(struct tcp_zerocopy *zc, char *buffer, ssize_t length) {
+    ssize_t bytes_sent;
+
+    // small buffers: pinning the pages costs more than the copy
+    if (!zc->enabled || (size_t) length < zc->threshold) {
+        return send_copy(zc, buffer, length) ? -1 : 0;
+    }
+
+    while (length > 0) {
+        bytes_sent = send(zc->fd, buffer, length, MSG_ZEROCOPY);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+
+            // out of socket option memory: notifications are pending, copy the rest
+            if (errno == ENOBUFS) {
+                if (reap(zc) < 0 || send_copy(zc, buffer, length)) return -1;
+                break;
+            }
+            return -1;
+        }
+
+        zc->sent++;
+        zc->stats.zerocopy_bytes += bytes_sent;
+        length -= bytes_sent;
+        buffer += bytes_sent;
+    }
+
+    // the buffer is reusable once the last send which used it is completed
+    return zc->sent;
+}
+
+int zerocopy_done(struct tcp_zerocopy *zc, long long ticket) {
+    if (zc->completed >= ticket) {
+        return 1;
+    }
+
+    if (reap(zc) < 0) {
+        return -1;
+    }
+
+    return zc->completed >= ticket;
+}
+
+int zerocopy_wait(struct tcp_zerocopy *zc, long long ticket, long long deadline) {
+    socklen_t len = sizeof(int);
+    int rv, so_error;
+
+    while (1) {
+        if ((rv = zerocopy_done(zc, ticket))) {
+            return rv > 0 ? 0 : -1;
+        }
+
+        // the error queue is notified by POLLERR
+        if ((rv = wait_io(zc->fd, POLLERR, deadline))) {
+            return rv;
+        }
+
+        // woken without notification: a socket error is pending or the connection is
+        // shut down (poll would report POLLHUP again at once)
+        if ((rv = reap(zc)) < 0) {
+            return -1;
+        }
+        if (rv == 0 && zc->completed < ticket) {
+            if (getsockopt(zc->fd, SOL_SOCKET, SO_ERROR, &so_error, &len)) return -1;
+            if (so_error) {
+                errno = so_error;
+                return -1;
+            }
+            if (hung_up(zc->fd)) {
+                errno = EPIPE;
+                return -1;
+            }
+        }
+    }
+}
+
+void zerocopy_get_stats(struct tcp_zerocopy *zc, struct tcp_zerocopy_stats *out_stats) {
+    *out_stats = zc->stats;
+}
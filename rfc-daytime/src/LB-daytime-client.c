@@ -3,6 +3,9 @@
  * 
  * Client implementing the daytime RFC (RFC 867)
  * with TCP and UDP protocols (add arg for udp)
+ * or querying many servers at once over TCP (-m)
+ * reporting the round trip & one-way times measured by the kernel (TCP)
+ * (handshake round trip estimated by TCP, reply timestamped on arrival)
  * 
  * Laura Binacchi
  */
@@ -19,8 +22,13 @@
 
 #include <arpa/inet.h>
 
+#include "tcp-fanout.h"
+#include "tcp-timestamp.h"
+#include "tcp-tune.h"
+
 #define PORT "13"		// port number or service name
 #define BUF_SIZE 100	// max number of bytes we can get at once 
+#define MULTI_TIMEOUT 5000	// ms given to a multi-host query
 
 // Get the pointer to the address (only IPv4 or IPv6)
 void *get_in_addr(struct sockaddr *sa) {
@@ -28,6 +36,64 @@ void *get_in_addr(struct sockaddr *sa) {
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// Query all the hosts concurrently & print their time with the latencies measured
+int multi_host(int count, char *hosts[]) {
+	struct tcp_fanout_target *targets;	// hosts queried & their results
+	struct tcp_fanout_options opts;		// keep at most BUF_SIZE bytes per reply
+	int succeeded;						// number of hosts which replied
+	int i;
+	size_t len;
+
+	targets = calloc(count, sizeof(struct tcp_fanout_target));
+	if (targets == NULL) {
+		perror("client calloc");
+		return 1;
+	}
+
+	// daytime: nothing to send, the server replies & closes the connection
+	for (i = 0; i < count; i++) {
+		targets[i].host = hosts[i];
+		targets[i].service = PORT;
+	}
+
+	memset(&opts, 0, sizeof opts);
+	opts.response_max = BUF_SIZE - 1;
+
+	succeeded = tcp_fanout(targets, count, &opts, tcp_deadline(MULTI_TIMEOUT));
+	if (succeeded < 0) {
+		perror("client fanout");
+		free(targets);
+		return 2;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (targets[i].status) {
+			printf("%s: %s\n", hosts[i],
+				targets[i].status == ERR_TCP_TIMEOUT ? "no reply before the deadline"
+				: targets[i].status == ERR_TCP_PEER_CLOSED ? "closed before the reply"
+				: targets[i].error < 0 ? gai_strerror(targets[i].error)
+				: strerror(targets[i].error));
+			continue;
+		}
+
+		// strip the end of line of the reply
+		len = targets[i].response_len;
+		while (len > 0 && (targets[i].response[len-1] == '\n'
+				|| targets[i].response[len-1] == '\r')) {
+			targets[i].response[--len] = '\0';
+		}
+
+		printf("%s (%s): '%s' [resolve %lld us, connect %lld us, reply %lld us]\n",
+			hosts[i], targets[i].ip, targets[i].response,
+			targets[i].resolve_us, targets[i].connect_us, targets[i].response_us);
+	}
+	printf("%d/%d hosts replied\n", succeeded, count);
+
+	tcp_fanout_free(targets, count);
+	free(targets);
+	return succeeded == count ? 0 : 3;
+}
+
 int main(int argc, char *argv[]) {
 	int sockfd;					// socket file descriptor
 	int numbytes;				// number of bytes received
@@ -40,10 +106,21 @@ int main(int argc, char *argv[]) {
 	char s[INET6_ADDRSTRLEN];	// string containing a human readable ip address
 	struct sockaddr_storage their_addr;
 	socklen_t sin_size;
+	struct timespec connecting;	// time the connection was started
+	struct timespec connected;	// time the connection was established
+	struct timespec arrived;	// time the reply reached the socket (kernel)
+	struct timespec read_at;	// time the reply was read
+	struct tcp_info_sample info;	// round trip estimated by TCP after the handshake
 	
+	// Multi-host mode
+	if (argc >= 3 && !strcmp(argv[1], "-m")) {
+		return multi_host(argc - 2, argv + 2);
+	}
+
 	// Test the params
 	if (argc < 2 || argc > 3) {
-	    fprintf(stderr,"usage: client hostname [udp]\n");
+	    fprintf(stderr,"usage: client hostname [udp]\n"
+	                   "       client -m hostname [hostname...]\n");
 	    exit(1);
 	} else {
 		udp = argc == 3 && !strcmp(argv[2], "udp");
@@ -69,12 +146,26 @@ int main(int argc, char *argv[]) {
 			continue;
 		}
 
+		// Timestamp the reply in the kernel (best effort)
+		if (!udp && tcp_timestamping(sockfd, TCP_TS_RX) == -1) {
+			perror("client timestamping");
+		}
+
 		// Open an active connection to the remote host
+		// (TCP: connect returns once the handshake has taken a round trip)
+		clock_gettime(CLOCK_REALTIME, &connecting);
 		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
 			perror("client connect");
 			close(sockfd);
 			continue;
 		}
+		clock_gettime(CLOCK_REALTIME, &connected);
+
+		// The kernel has measured the round trip of the handshake (SYN to SYN-ACK)
+		if (!udp && tcp_info_sample(sockfd, &info) == -1) {
+			perror("client tcp info");
+			info.rtt_us = 0;
+		}
 
 		break;
 	}
@@ -119,10 +210,23 @@ int main(int argc, char *argv[]) {
 	} else { // TCP connection
 		// Receive the response from the server into the buffer
 		// If numbyte = 0, the server closed the connection
-		if ((numbytes = recv(sockfd, buf, BUF_SIZE-1, 0)) == -1) {
+		if ((numbytes = receive_data_ts(sockfd, buf, BUF_SIZE-1, &arrived)) == -1) {
 	    	perror("client recv");
 	    	exit(1);
 		}
+		clock_gettime(CLOCK_REALTIME, &read_at);
+
+		// The one-way time is estimated as half the handshake round trip,
+		// connect also includes the system calls (measured in userspace)
+		printf("client handshake: round trip %u us (TCP estimate), one-way estimate %u us, "
+			"connect returned after %lld us (userspace)\n",
+			info.rtt_us, info.rtt_us / 2, tcp_ts_elapsed_us(&connecting, &connected));
+		if (arrived.tv_sec) {
+			printf("client reply: reached the socket %lld us after the connection, "
+				"read %lld us later\n",
+				tcp_ts_elapsed_us(&connected, &arrived),
+				tcp_ts_elapsed_us(&arrived, &read_at));
+		}
 	}
 
 	printf("client received '%d' bytes\n", numbytes);
@@ -3,6 +3,7 @@
  * 
  * Server implementing the daytime RFC (RFC 867)
  * with TCP and UDP protocols (add arg for udp)
+ * reporting the kernel send & acknowledgement times of each reply (TCP)
  * launch as su
  * 
  * Laura Binacchi
@@ -23,10 +24,43 @@
 #include <time.h>
 #include <assert.h>
 
+#include "tcp-timestamp.h"
+
 #define PORT "13"		// port number or service
 #define BACKLOG 10		// how many pending connections queue will hold
 #define DT_SIZE	64
 #define BUF_SIZE 100	// max number of bytes we can get at once 
+#define ACK_TIMEOUT 1000	// ms waited for the acknowledgement of the reply
+
+// Wait for the kernel timestamps of the reply & print the latencies measured
+void report_latency(int sockfd, ssize_t numbytes, struct timespec *sent) {
+	struct tcp_tx_timestamp ts[8];	// transmit timestamps read at once
+	struct timespec out = { 0 };	// time the reply was handed to the device
+	struct timespec acked = { 0 };	// time the reply was acknowledged
+	long long deadline = tcp_deadline(ACK_TIMEOUT);
+	int count, i;
+
+	// the timestamps of the last byte of the reply (offset numbytes-1)
+	while (acked.tv_sec == 0) {
+		if ((count = tcp_tx_timestamps(sockfd, ts, 8, deadline)) < 0) break;
+		for (i = 0; i < count; i++) {
+			if (ts[i].id != (unsigned int) numbytes - 1) continue;
+			if (ts[i].kind == TCP_TX_SENT) out = ts[i].ts;
+			if (ts[i].kind == TCP_TX_ACKED) acked = ts[i].ts;
+		}
+	}
+
+	if (out.tv_sec == 0 || acked.tv_sec == 0) {
+		printf("server: reply not acknowledged, no latency measured\n");
+		return;
+	}
+
+	// round trip measured in the kernel, without the time spent by both applications
+	printf("server reply: in the network %lld us after send, acked %lld us later "
+		"(round trip), one-way estimate %lld us\n",
+		tcp_ts_elapsed_us(sent, &out), tcp_ts_elapsed_us(&out, &acked),
+		tcp_ts_elapsed_us(&out, &acked) / 2);
+}
 
 // Save errno after a child death
 void sigchld_handler(int s) {
@@ -57,6 +91,7 @@ int main(int argc, char *argv[])
 	time_t t;
 	struct tm *dt;
 	char sdt[DT_SIZE];	// formatted string containing the system datetime
+	struct timespec sent;	// time the reply was sent (kernel clock)
 	char buf[BUF_SIZE];	// buffer used to wait the client connection
 	int yes = 1;
 	int udp = 0;
@@ -165,17 +200,26 @@ int main(int argc, char *argv[])
 					exit(1);
 				}
 			} else {
+				// timestamp the reply in the kernel (best effort)
+				if (tcp_timestamping(new_fd, TCP_TS_TX) == -1)
+					perror("server timestamping");
+				clock_gettime(CLOCK_REALTIME, &sent);
+
 				// send must return the same value as strlen(sdt)
 				// TODO check if all the data is sent
 				if ((numbytes = send(new_fd, sdt, strlen(sdt), 0)) == -1)
 					perror("server send");
 				printf("server sent %ld bytes\n", numbytes);
+				if (numbytes > 0) report_latency(new_fd, numbytes, &sent);
 			}
 			if (udp) close(sockfd);
 			else close(new_fd);
 
 			exit(0);
 		}
+
+		// the parent doesn't need the connection: the client sees it closed once the child is done
+		if (!udp) close(new_fd);
 	}
 
 	return 0;
@@ -0,0 +1,359 @@
+/** *************************************************************************************
+ * Exercice sur les librairies
+ * ===========================
+ *
+ * WAN emulation proxy: forwards the connections received on a port to a server
+ * through an emulated link, to test the clients & servers of the exercises
+ * under a WAN latency, bandwidth & reliability without netem (root only)
+ *
+ * Each direction (up: client to server, down: server to client) has its own:
+ *      delay       one-way propagation delay in ms
+ *      jitter      random variation of the delay in ms (+/-), the order is kept
+ *      bandwidth   link rate in kbit/s, the data queue behind it (0: unlimited)
+ *      reset       probability to reset the connection per chunk forwarded
+ *                  (the proxy aborts both sides with a RST)
+ *
+ * The proxy terminates the TCP connections: the endpoints see the emulated latency
+ * & rate in their data, not in their own acks & windows
+ *
+ * usage: wan-proxy [-d delay] [-j jitter] [-b bandwidth] [-r reset]
+ *                  listen_port target_host target_port
+ *      each value is "both" or "up/down", e.g. -d 40 -b 10000/50000 -r 0/0.001
+ *
+ * RI 2020 - Laura Binacchi - Fedora 32
+ ****************************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>         // sigaction
+#include <stddef.h>         // offsetof
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>       // WNOHANG
+#include <unistd.h>         // fork
+
+#include "bench-util.h"
+#include "tcp-util.h"
+
+#define BACKLOG     10              // amount of pending connections allowed
+#define CHUNK_SIZE  (16 * 1024)     // bytes read at once per direction
+#define QUEUE_MAX   (8 * 1024 * 1024)   // bytes queued per direction before reading stops
+
+#define UP          0               // client to server
+#define DOWN        1               // server to client
+
+static const char *dir_names[] = { "up", "down" };
+
+/** Link emulated in one direction */
+struct link_conf {
+    double delay_ms;
+    double jitter_ms;
+    double kbps;                    // 0: unlimited
+    double reset;                   // probability per chunk
+};
+
+/** Data waiting to be delivered */
+struct chunk {
+    struct chunk *next;
+    long long due_ns;               // time it leaves the emulated link
+    ssize_t len;                    // 0 for the end of the stream
+    char data[];
+};
+
+/** One direction of a proxied connection */
+struct direction {
+    int dir;                        // UP or DOWN
+    int src;                        // socket read
+    int dst;                        // socket written
+    struct link_conf *conf;
+    struct connection *conn;
+
+    pthread_t reader;
+    pthread_t writer;
+    unsigned int reader_seed;       // random state of each thread (rand_r)
+    unsigned int writer_seed;
+    long long link_free_ns;         // time the link is done sending the data queued
+    long long last_due_ns;          // due time of the last chunk queued (order kept)
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct chunk *head, *tail;
+    size_t queued;                  // bytes queued
+};
+
+/** Proxied connection */
+struct connection {
+    int client_fd;
+    int server_fd;
+    char client_ip[INET6_ADDRSTRLEN];
+    struct direction dirs[2];
+};
+
+// Save errno after a child death
+void sigchld_handler(int s) {
+    (void)s;
+    int saved_errno = errno;
+    while(waitpid(-1, NULL, WNOHANG) > 0);
+    errno = saved_errno;
+}
+
+/* PRIVATE FUNCTIONS */
+
+/**
+ * Parses an option value: "both" or "up/down"
+ *
+ * @param arg: value to parse
+ * @param confs: links of both directions
+ * @param offset: offset of the field in struct link_conf
+ *
+ * @return 0 if the value is valid, -1 otherwise
+ */
+static int parse_pair(char *arg, struct link_conf *confs, size_t offset) {
+    double *up = (double *) ((char *) &confs[UP] + offset);
+    double *down = (double *) ((char *) &confs[DOWN] + offset);
+    char *end;
+
+    *up = strtod(arg, &end);
+    *down = *up;
+    if (*end == '/') *down = strtod(end + 1, &end);
+
+    return *end || end == arg || *up < 0 || *down < 0 ? -1 : 0;
+}
+
+/**
+ * Aborts the connection: both sides get a RST, the proxy child exits
+ *
+ * @param conn: proxied connection
+ * @param dir: direction which decided the reset
+ */
+static void reset_connection(struct connection *conn, int dir) {
+    struct linger linger = { 1, 0 };    // close sends a RST
+
+    printf("[proxy:%s] resetting the connection (%s)\n", conn->client_ip, dir_names[dir]);
+    setsockopt(conn->client_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+    setsockopt(conn->server_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+
+    // _exit skips the stdio buffers (piped output is fully buffered)
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Reads a direction & queues the data with the time it leaves the emulated link:
+ * after the previous data has been sent at the link rate, plus the delay & jitter
+ */
+static void *reader_main(void *arg) {
+    struct direction *d = arg;
+    struct link_conf *conf = d->conf;
+    struct chunk *chunk;
+    long long now, delay;
+    ssize_t bytes;
+
+    do {
+        // out of memory: the data can not be forwarded anymore
+        chunk = malloc(sizeof(struct chunk) + CHUNK_SIZE);
+        if (chunk == NULL) {
+            reset_connection(d->conn, d->dir);
+        }
+
+        // the end of the stream (or an error) is forwarded as a shutdown
+        bytes = receive_data(d->src, chunk->data, CHUNK_SIZE);
+        chunk->len = bytes > 0 ? bytes : 0;
+        chunk->next = NULL;
+
+        // serialization on the link, then propagation
+        now = now_ns();
+        if (d->link_free_ns < now) d->link_free_ns = now;
+        if (conf->kbps > 0) d->link_free_ns += chunk->len * 8e6 / conf->kbps;
+
+        delay = (conf->delay_ms
+                + conf->jitter_ms * (2.0 * rand_r(&d->reader_seed) / RAND_MAX - 1)) * 1e6;
+        chunk->due_ns = d->link_free_ns + (delay > 0 ? delay : 0);
+        if (chunk->due_ns < d->last_due_ns) chunk->due_ns = d->last_due_ns;
+        d->last_due_ns = chunk->due_ns;
+
+        // queue it, waiting while the link is saturated
+        pthread_mutex_lock(&d->lock);
+        while (d->queued >= QUEUE_MAX) pthread_cond_wait(&d->cond, &d->lock);
+        if (d->tail) d->tail->next = chunk;
+        else d->head = chunk;
+        d->tail = chunk;
+        d->queued += chunk->len;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    } while (bytes > 0);
+
+    return NULL;
+}
+
+/**
+ * Delivers the data queued in a direction once it is due
+ */
+static void *writer_main(void *arg) {
+    struct direction *d = arg;
+    struct chunk *chunk;
+    ssize_t len;                    // bytes delivered, 0 once the direction has ended
+
+    do {
+        pthread_mutex_lock(&d->lock);
+        while (d->head == NULL) pthread_cond_wait(&d->cond, &d->lock);
+        chunk = d->head;
+        d->head = chunk->next;
+        if (d->head == NULL) d->tail = NULL;
+        pthread_mutex_unlock(&d->lock);
+
+        sleep_until(chunk->due_ns);
+
+        if (chunk->len && d->conf->reset > 0
+                && rand_r(&d->writer_seed) < d->conf->reset * RAND_MAX) {
+            reset_connection(d->conn, d->dir);
+        }
+
+        len = chunk->len;
+        if (len == 0 || send_data(d->dst, chunk->data, len)) {
+            shutdown(d->dst, SHUT_WR);
+            len = 0;
+        }
+
+        pthread_mutex_lock(&d->lock);
+        d->queued -= chunk->len;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        free(chunk);
+    } while (len);
+
+    // drop what the peer will not receive
+    pthread_mutex_lock(&d->lock);
+    while (d->head) {
+        chunk = d->head;
+        d->head = chunk->next;
+        d->queued -= chunk->len;
+        free(chunk);
+    }
+    d->tail = NULL;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+/**
+ * Forwards a connection in both directions until both have ended
+ *
+ * @param conn: proxied connection, both sockets connected
+ * @param confs: links of both directions
+ *
+ * @return EXIT_SUCCESS, EXIT_FAILURE if the threads could not be created
+ */
+static int proxy(struct connection *conn, struct link_conf *confs) {
+    struct direction *d;
+    int i, err;
+
+    for (i = UP; i <= DOWN; i++) {
+        d = &conn->dirs[i];
+        memset(d, 0, sizeof *d);
+        d->dir = i;
+        d->src = i == UP ? conn->client_fd : conn->server_fd;
+        d->dst = i == UP ? conn->server_fd : conn->client_fd;
+        d->conf = &confs[i];
+        d->conn = conn;
+        d->reader_seed = getpid() ^ (i << 16) ^ now_ns();
+        d->writer_seed = ~d->reader_seed;
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+
+        // the threads already started end with the process
+        if ((err = pthread_create(&d->reader, NULL, reader_main, d))
+                || (err = pthread_create(&d->writer, NULL, writer_main, d))) {
+            errno = err;
+            perror("[proxy] creating the forwarding threads");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the readers end once their writer has dropped the queue (peer gone) or on eof
+    for (i = UP; i <= DOWN; i++) {
+        pthread_join(conn->dirs[i].writer, NULL);
+    }
+    disconnect(conn->client_fd);
+    disconnect(conn->server_fd);
+
+    printf("[proxy:%s] closing\n", conn->client_ip);
+    return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char *argv[]) {
+    struct link_conf confs[2];          // links emulated up & down
+    struct connection conn;             // connection proxied by a child
+    struct sigaction sa;                // signal action
+    int sockfd;                         // listening socket
+    int opt, rv = 0;
+
+    memset(confs, 0, sizeof confs);
+    while ((opt = getopt(argc, argv, "d:j:b:r:")) != -1) {
+        switch (opt) {
+            case 'd': rv |= parse_pair(optarg, confs, offsetof(struct link_conf, delay_ms)); break;
+            case 'j': rv |= parse_pair(optarg, confs, offsetof(struct link_conf, jitter_ms)); break;
+            case 'b': rv |= parse_pair(optarg, confs, offsetof(struct link_conf, kbps)); break;
+            case 'r': rv |= parse_pair(optarg, confs, offsetof(struct link_conf, reset)); break;
+            default: rv = -1; break;
+        }
+    }
+    if (rv || argc - optind != 3) {
+        fprintf(stderr, "usage: %s [-d delay_ms] [-j jitter_ms] [-b kbit/s] [-r reset_prob] "
+                "listen_port target_host target_port\n"
+                "       each value is \"both\" or \"up/down\"\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sockfd = server_listen(argv[optind], BACKLOG);
+    if (sockfd < 0) {
+        perror("[proxy] listening");
+        return EXIT_FAILURE;
+    }
+
+    // clean all the dead processes
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("[proxy] sigaction");
+        disconnect(sockfd);
+        return EXIT_FAILURE;
+    }
+
+    printf("[proxy] forwarding port %s to %s:%s, up: %.0f+/-%.0f ms %.0f kbit/s reset %g, "
+            "down: %.0f+/-%.0f ms %.0f kbit/s reset %g\n",
+            argv[optind], argv[optind + 1], argv[optind + 2],
+            confs[UP].delay_ms, confs[UP].jitter_ms, confs[UP].kbps, confs[UP].reset,
+            confs[DOWN].delay_ms, confs[DOWN].jitter_ms, confs[DOWN].kbps, confs[DOWN].reset);
+
+    while (1) {
+        conn.client_fd = server_accept(sockfd, conn.client_ip);
+        if (conn.client_fd < 0) {
+            perror("[proxy] accepting incoming connection");
+            continue;
+        }
+
+        // a child per connection, as the servers of the exercises
+        if (!fork()) {
+            disconnect(sockfd);
+
+            conn.server_fd = client_connect(argv[optind + 1], argv[optind + 2]);
+            if (conn.server_fd < 0) {
+                perror("[proxy] connecting to the target");
+                disconnect(conn.client_fd);
+                return EXIT_FAILURE;
+            }
+
+            printf("[proxy:%s] connected to %s:%s\n", conn.client_ip,
+                    argv[optind + 1], argv[optind + 2]);
+            return proxy(&conn, confs);
+        }
+
+        disconnect(conn.client_fd);
+    }
+}